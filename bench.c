@@ -0,0 +1,764 @@
+/* GInetFlow - Micro benchmarks
+ *
+ * Copyright (C) 2017 ECLB Ltd
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library. If not, see <http://www.gnu.org/licenses/>
+ */
+#include "ginetflow.c"
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define BENCH_TUPLES        4096
+#define BENCH_ROUNDS        1000
+#define BENCH_LOOKUPS       (1 << 20)
+
+static gint rounds = BENCH_ROUNDS;
+static gchar *filter = NULL;
+
+/* Results are folded in here so the compiler cannot drop the work */
+static volatile guint64 bench_sink;
+
+/* Cycle counter where available, nanoseconds otherwise */
+#if defined(__x86_64__) || defined(__i386__)
+#define BENCH_UNIT "cycles"
+static inline guint64 bench_ticks(void)
+{
+    return __rdtsc();
+}
+#else
+#define BENCH_UNIT "ns"
+static inline guint64 bench_ticks(void)
+{
+    return g_get_monotonic_time() * 1000;
+}
+#endif
+
+static gboolean bench_enabled(const gchar * name)
+{
+    return filter == NULL || strstr(name, filter) != NULL;
+}
+
+static void bench_report(const gchar * name, guint64 ticks, guint64 count)
+{
+    g_printf("%-40s %10.2f %s/op\n", name, (double) ticks / count, BENCH_UNIT);
+}
+
+/* Reference implementation: the original bit at a time CRC16 */
+static guint16 crc16_bitwise(guint16 iv, guint64 p)
+{
+    int i;
+    int j;
+    guint32 b;
+    guint16 poly = 0x1021;
+    for (i = 7; i >= 0; i--) {
+        b = (p >> (i * 8)) & 0xff;
+        for (j = 7; j >= 0; j--) {
+            iv = ((iv << 1) ^ ((((iv >> 15) & 1) ^ ((b >> j) & 1)) ? poly : 0))
+                & 0xffff;
+        }
+    }
+    return iv;
+}
+
+static guint16 flow_hash_bitwise(GInetFlow * f)
+{
+    guint32 *lip = f->tuple.lower_ip;
+    guint32 *uip = f->tuple.upper_ip;
+    guint16 src_crc = 0xffff;
+    guint16 dst_crc = 0xffff;
+    guint16 prot_crc = 0xffff;
+    src_crc = crc16_bitwise(src_crc, ((guint64) lip[0]) << 32 | lip[1]);
+    src_crc = crc16_bitwise(src_crc, ((guint64) lip[2]) << 32 | lip[3]);
+    src_crc = crc16_bitwise(src_crc, ((guint64) f->tuple.lower_port) << 48);
+    dst_crc = crc16_bitwise(dst_crc, ((guint64) uip[0]) << 32 | uip[1]);
+    dst_crc = crc16_bitwise(dst_crc, ((guint64) uip[2]) << 32 | uip[3]);
+    dst_crc = crc16_bitwise(dst_crc, ((guint64) f->tuple.upper_port) << 48);
+    prot_crc = crc16_bitwise(prot_crc, ((guint64) f->tuple.protocol) << 56);
+    return src_crc ^ dst_crc ^ prot_crc;
+}
+
+static GInetFlow *bench_flows(guint family)
+{
+    GInetFlow *flows = g_malloc0(BENCH_TUPLES * sizeof(GInetFlow));
+    int i;
+    int j;
+
+    for (i = 0; i < BENCH_TUPLES; i++) {
+        GInetFlow *f = &flows[i];
+        f->family = family;
+        f->tuple.protocol = (i & 1) ? IP_PROTOCOL_TCP : IP_PROTOCOL_UDP;
+        f->tuple.lower_port = g_random_int_range(1, 32768);
+        f->tuple.upper_port = g_random_int_range(32768, 65536);
+        for (j = 0; j < (family == G_SOCKET_FAMILY_IPV4 ? 1 : 4); j++) {
+            f->tuple.lower_ip[j] = g_random_int();
+            f->tuple.upper_ip[j] = g_random_int();
+        }
+    }
+    return flows;
+}
+
+static void bench_flow_hash(const gchar * name, GInetFlowTable * table, guint family,
+                            flow_hash_fn hash_fn)
+{
+    GInetFlow *flows;
+    guint64 start;
+    guint64 ticks = 0;
+    guint64 sum = 0;
+    int r;
+    int i;
+
+    if (!bench_enabled(name))
+        return;
+    flows = bench_flows(family);
+    for (r = 0; r < rounds; r++) {
+        start = bench_ticks();
+        for (i = 0; i < BENCH_TUPLES; i++) {
+            if (hash_fn)
+                sum += hash_fn(table, &flows[i].tuple, family);
+            else
+                sum += flow_hash_bitwise(&flows[i]);
+        }
+        ticks += bench_ticks() - start;
+    }
+    bench_report(name, ticks, (guint64) rounds * BENCH_TUPLES);
+    bench_sink += sum;
+    g_free(flows);
+}
+
+static void bench_flow_hash_batch(const gchar * name, GInetFlowTable * table, guint family,
+                                  flow_hash_batch_fn batch_fn)
+{
+    GInetFlow *flows;
+    GInetFlow *batch[BENCH_TUPLES];
+    guint64 start;
+    guint64 ticks = 0;
+    guint64 sum = 0;
+    int r;
+    int i;
+
+    if (!bench_enabled(name))
+        return;
+    flows = bench_flows(family);
+    for (i = 0; i < BENCH_TUPLES; i++)
+        batch[i] = &flows[i];
+    for (r = 0; r < rounds; r++) {
+        start = bench_ticks();
+        for (i = 0; i < BENCH_TUPLES; i += FLOW_BATCH_MAX)
+            batch_fn(table, batch + i, FLOW_BATCH_MAX);
+        ticks += bench_ticks() - start;
+        sum += flows[r % BENCH_TUPLES].hash;
+    }
+    bench_report(name, ticks, (guint64) rounds * BENCH_TUPLES);
+    bench_sink += sum;
+    g_free(flows);
+}
+
+/* Key compares of flow pairs of which a random half match */
+static void bench_flow_compare(const gchar * name,
+                               gboolean(*compare) (GInetFlow * f1, GInetFlow * f2))
+{
+    GInetFlow *flows;
+    GInetFlow *others;
+    guint64 start;
+    guint64 ticks = 0;
+    guint64 sum = 0;
+    int r;
+    int i;
+
+    if (!bench_enabled(name))
+        return;
+    flows = bench_flows(G_SOCKET_FAMILY_IPV6);
+    others = g_new(GInetFlow, BENCH_TUPLES);
+    memcpy(others, flows, BENCH_TUPLES * sizeof(GInetFlow));
+    for (i = 0; i < BENCH_TUPLES; i++) {
+        if (g_random_boolean())
+            ((guint8 *) others[i].tuple.upper_ip)[g_random_int_range(0, 16)] ^= 0xff;
+    }
+    for (r = 0; r < rounds; r++) {
+        start = bench_ticks();
+        for (i = 0; i < BENCH_TUPLES; i++)
+            sum += compare(&flows[i], &others[i]);
+        ticks += bench_ticks() - start;
+    }
+    bench_report(name, ticks, (guint64) rounds * BENCH_TUPLES);
+    bench_sink += sum;
+    g_free(others);
+    g_free(flows);
+}
+
+/* Reference implementation: the original branch per ordering decision */
+static void tuple_order_branchy(GInetFlow * f, const guint8 * saddr, const guint8 * daddr,
+                                guint16 sport, guint16 dport)
+{
+    if (f->family == G_SOCKET_FAMILY_IPV4) {
+        guint32 sip, dip;
+        memcpy(&sip, saddr, 4);
+        memcpy(&dip, daddr, 4);
+        if (GUINT32_FROM_BE(sip) < GUINT32_FROM_BE(dip)) {
+            f->tuple.lower_ip[0] = sip;
+            f->tuple.upper_ip[0] = dip;
+        } else {
+            f->tuple.upper_ip[0] = sip;
+            f->tuple.lower_ip[0] = dip;
+        }
+    } else if (memcmp(saddr, daddr, 16) < 0) {
+        memcpy(f->tuple.lower_ip, saddr, 16);
+        memcpy(f->tuple.upper_ip, daddr, 16);
+    } else {
+        memcpy(f->tuple.upper_ip, saddr, 16);
+        memcpy(f->tuple.lower_ip, daddr, 16);
+    }
+    if (sport < dport) {
+        f->tuple.lower_port = sport;
+        f->tuple.upper_port = dport;
+        f->direction = 1;
+    } else {
+        f->tuple.upper_port = sport;
+        f->tuple.lower_port = dport;
+        f->direction = 0;
+    }
+}
+
+/* Canonical ordering of the addresses and ports of packets seen in random
+ * directions, as the parsers do for every packet
+ */
+static void bench_tuple_order(const gchar * name, guint family, gboolean branchy)
+{
+    GInetFlow *flows;
+    GInetFlow f = {.family = family };
+    guint64 start;
+    guint64 ticks = 0;
+    guint64 sum = 0;
+    int r;
+    int i;
+
+    if (!bench_enabled(name))
+        return;
+    flows = bench_flows(family);
+    for (i = 0; i < BENCH_TUPLES; i++) {
+        if (g_random_boolean()) {
+            guint16 port = flows[i].tuple.lower_port;
+            flows[i].tuple.lower_port = flows[i].tuple.upper_port;
+            flows[i].tuple.upper_port = port;
+        }
+    }
+    for (r = 0; r < rounds; r++) {
+        start = bench_ticks();
+        for (i = 0; i < BENCH_TUPLES; i++) {
+            const guint8 *lip = (const guint8 *) flows[i].tuple.lower_ip;
+            const guint8 *uip = (const guint8 *) flows[i].tuple.upper_ip;
+            guint16 lport = flows[i].tuple.lower_port;
+            guint16 uport = flows[i].tuple.upper_port;
+
+            if (branchy)
+                tuple_order_branchy(&f, lip, uip, lport, uport);
+            else if (family == G_SOCKET_FAMILY_IPV4) {
+                tuple_order_ipv4(&f, flows[i].tuple.lower_ip[0],
+                                 flows[i].tuple.upper_ip[0]);
+                f.direction = tuple_order_ports(&f, lport, uport);
+            } else {
+                tuple_order_ipv6(&f, lip, uip);
+                f.direction = tuple_order_ports(&f, lport, uport);
+            }
+            sum += f.tuple.lower_ip[0] + f.tuple.lower_port + f.direction;
+        }
+        ticks += bench_ticks() - start;
+    }
+    bench_report(name, ticks, (guint64) rounds * BENCH_TUPLES);
+    bench_sink += sum;
+    g_free(flows);
+}
+
+static GInetFlowTable *bench_table(GInetFlowTableEngine engine, guint64 capacity,
+                                   gboolean incremental)
+{
+    GInetFlowTable *table = g_object_new(G_INET_TYPE_FLOW_TABLE, "engine", engine,
+                                         "capacity", capacity,
+                                         "incremental-resize", incremental, NULL);
+    g_inet_flow_table_hash_set(table, G_INET_FLOW_HASH_CRC32C);
+    return table;
+}
+
+static GInetFlow *bench_table_flows(GInetFlowTable * table, guint count)
+{
+    GInetFlow *flows = g_new0(GInetFlow, count);
+    guint i;
+
+    for (i = 0; i < count; i++) {
+        flows[i].family = G_SOCKET_FAMILY_IPV4;
+        flows[i].tuple.protocol = IP_PROTOCOL_TCP;
+        flows[i].tuple.lower_port = g_random_int_range(1, 32768);
+        flows[i].tuple.upper_port = g_random_int_range(32768, 65536);
+        flows[i].tuple.lower_ip[0] = g_random_int();
+        flows[i].tuple.upper_ip[0] = g_random_int();
+        flow_hash64(table, &flows[i]);
+    }
+    return flows;
+}
+
+static int bench_compare_ticks(const void *a, const void *b)
+{
+    guint64 ta = *(const guint64 *) a;
+    guint64 tb = *(const guint64 *) b;
+    return ta < tb ? -1 : ta > tb;
+}
+
+/* Inserts of count new flows, with the tail latency reported too since that
+ * is where resizes show. The growable engines start empty, the cuckoo table
+ * is sized for count.
+ */
+static void bench_flow_insert(const gchar * name, GInetFlowTableEngine engine,
+                              gboolean incremental, guint count)
+{
+    GInetFlowTable *table;
+    GInetFlow *flows;
+    guint64 *samples;
+    guint64 start;
+    guint64 ticks = 0;
+    guint i;
+
+    if (!bench_enabled(name))
+        return;
+    table = bench_table(engine, engine == G_INET_FLOW_TABLE_ENGINE_CUCKOO ? count : 0,
+                        incremental);
+    flows = bench_table_flows(table, count);
+    samples = g_new(guint64, count);
+    for (i = 0; i < count; i++) {
+        start = bench_ticks();
+        if (!flow_index_lookup(table, &flows[i]))
+            flow_index_insert(table, &flows[i]);
+        samples[i] = bench_ticks() - start;
+        ticks += samples[i];
+    }
+    bench_report(name, ticks, count);
+    qsort(samples, count, sizeof(guint64), bench_compare_ticks);
+    g_printf("%-40s %10" G_GUINT64_FORMAT " %s p99.99, %" G_GUINT64_FORMAT " max\n", name,
+             samples[count - count / 10000 - 1], BENCH_UNIT, samples[count - 1]);
+    g_object_unref(table);
+    g_free(samples);
+    g_free(flows);
+}
+
+/* Lookups of random existing flows in a table of count flows. The found
+ * flow is touched as a packet update would, so its cache miss is counted.
+ */
+static void bench_lookups(const gchar * name, GInetFlowTable * table, GInetFlow * flows,
+                          guint count)
+{
+    GInetFlow *packets;
+    guint64 start;
+    guint64 ticks = 0;
+    guint64 sum = 0;
+    int passes = MAX(rounds / 100, 1);
+    int r;
+    guint i;
+
+    packets = g_new0(GInetFlow, BENCH_LOOKUPS);
+    for (i = 0; i < BENCH_LOOKUPS; i++) {
+        GInetFlow *f = &flows[g_random_int_range(0, count)];
+        packets[i].family = f->family;
+        packets[i].hash = f->hash;
+        packets[i].tuple = f->tuple;
+    }
+
+    for (r = 0; r < passes; r++) {
+        start = bench_ticks();
+        for (i = 0; i < BENCH_LOOKUPS; i++) {
+            GInetFlow *f = flow_index_lookup(table, &packets[i]);
+            if (f)
+                sum += ++f->packets;
+        }
+        ticks += bench_ticks() - start;
+    }
+    bench_report(name, ticks, (guint64) passes * BENCH_LOOKUPS);
+    bench_sink += sum;
+    g_free(packets);
+}
+
+static void bench_flow_lookup(const gchar * name, GInetFlowTableEngine engine,
+                              guint count)
+{
+    GInetFlowTable *table;
+    GInetFlow *flows;
+    guint i;
+
+    if (!bench_enabled(name))
+        return;
+    table = bench_table(engine, count, FALSE);
+    flows = bench_table_flows(table, count);
+    for (i = 0; i < count; i++) {
+        if (!flow_index_lookup(table, &flows[i]))
+            flow_index_insert(table, &flows[i]);
+    }
+    bench_lookups(name, table, flows, count);
+    g_object_unref(table);
+    g_free(flows);
+}
+
+/* Lookups in a record table, whose index and records can sit on huge pages */
+static void bench_flow_lookup_records(const gchar * name, gboolean huge, guint count)
+{
+    GInetFlowTable *table;
+    GInetFlow *flows;
+    guint64 page_size;
+    guint i;
+
+    if (!bench_enabled(name))
+        return;
+    table = g_object_new(G_INET_TYPE_FLOW_TABLE, "engine", G_INET_FLOW_TABLE_ENGINE_SWISS,
+                         "capacity", (guint64) count, "records", TRUE,
+                         "huge-pages", huge, NULL);
+    g_inet_flow_table_hash_set(table, G_INET_FLOW_HASH_CRC32C);
+    flows = bench_table_flows(table, count);
+    for (i = 0; i < count; i++)
+        flow_packet_get(table, &flows[i], FALSE);
+    bench_lookups(name, table, flows, count);
+    g_object_get(table, "page-size", &page_size, NULL);
+    g_printf("%-40s %10" G_GUINT64_FORMAT " bytes\n", name, page_size);
+    g_object_unref(table);
+    g_free(flows);
+}
+
+/* Lookups through the table in trains of BENCH_TRAIN packets per flow,
+ * as bursty traffic arrives, with and without the exact match cache
+ */
+#define BENCH_TRAIN         8
+static void bench_flow_cache(const gchar * name, guint cache_size, guint count)
+{
+    GInetFlowTable *table;
+    GInetFlow *flows;
+    GInetFlow *packets;
+    GInetFlow *f = NULL;
+    guint64 start;
+    guint64 ticks = 0;
+    guint64 sum = 0;
+    gdouble rate;
+    int passes = MAX(rounds / 100, 1);
+    int r;
+    guint i;
+
+    if (!bench_enabled(name))
+        return;
+    table = g_object_new(G_INET_TYPE_FLOW_TABLE, "engine", G_INET_FLOW_TABLE_ENGINE_SWISS,
+                         "capacity", (guint64) count, "records", TRUE,
+                         "cache-size", cache_size, NULL);
+    g_inet_flow_table_hash_set(table, G_INET_FLOW_HASH_CRC32C);
+    flows = bench_table_flows(table, count);
+    for (i = 0; i < count; i++)
+        flow_packet_get(table, &flows[i], FALSE);
+    packets = g_new0(GInetFlow, BENCH_LOOKUPS);
+    for (i = 0; i < BENCH_LOOKUPS; i++) {
+        if (i % BENCH_TRAIN == 0)
+            f = &flows[g_random_int_range(0, count)];
+        packets[i].family = f->family;
+        packets[i].hash = f->hash;
+        packets[i].tuple = f->tuple;
+    }
+
+    for (r = 0; r < passes; r++) {
+        start = bench_ticks();
+        for (i = 0; i < BENCH_LOOKUPS; i++) {
+            GInetFlow *found = flow_packet_get(table, &packets[i], FALSE);
+            if (found)
+                sum += ++found->packets;
+        }
+        ticks += bench_ticks() - start;
+    }
+    bench_report(name, ticks, (guint64) passes * BENCH_LOOKUPS);
+    g_object_get(table, "cache-hit-rate", &rate, NULL);
+    g_printf("%-40s %10.2f hit rate\n", name, rate);
+    bench_sink += sum;
+    g_object_unref(table);
+    g_free(packets);
+    g_free(flows);
+}
+
+/* Flow creation and release under churn: every new flow replaces the
+ * oldest of a fixed window of live flows, either objects or records.
+ */
+static void bench_flow_churn(const gchar * name, gboolean records, gboolean recycle,
+                             guint count)
+{
+    GInetFlowTable *table;
+    GInetFlow *flows;
+    GInetFlow *live[BENCH_TUPLES] = { };
+    guint64 start;
+    guint i;
+
+    if (!bench_enabled(name))
+        return;
+    table = g_object_new(G_INET_TYPE_FLOW_TABLE, "engine", G_INET_FLOW_TABLE_ENGINE_SWISS,
+                         "capacity", (guint64) BENCH_TUPLES, "records", records,
+                         "recycle", recycle, NULL);
+    g_inet_flow_table_hash_set(table, G_INET_FLOW_HASH_CRC32C);
+    flows = bench_table_flows(table, count);
+
+    start = bench_ticks();
+    for (i = 0; i < count; i++) {
+        GInetFlow **slot = &live[i % BENCH_TUPLES];
+        if (*slot) {
+            if (records)
+                g_inet_flow_record_release((GInetFlowRecord *) * slot);
+            else
+                g_object_unref(*slot);
+        }
+        *slot = flow_packet_get(table, &flows[i], TRUE);
+    }
+    bench_report(name, bench_ticks() - start, count);
+    for (i = 0; i < BENCH_TUPLES; i++) {
+        if (live[i] && !records)
+            g_object_unref(live[i]);
+    }
+    g_object_unref(table);
+    g_free(flows);
+}
+
+static void bench_expire_release(GInetFlowRecord * record, gpointer user_data)
+{
+    g_inet_flow_record_release(record);
+}
+
+/* Flows arriving over five minutes, each rescheduled by a second packet,
+ * then collected a second at a time as they expire, one by one or in a
+ * batch. Reports the cost per flow of scheduling twice and expiring once.
+ */
+static void bench_flow_expire(const gchar * name, gboolean batch, guint count)
+{
+    GInetFlowTable *table;
+    GInetFlow *flows;
+    GInetFlow *flow;
+    guint64 base = 1500000000000000ULL;
+    guint64 expired = 0;
+    guint64 start;
+    guint64 ts;
+    guint i;
+
+    if (!bench_enabled(name))
+        return;
+    table = g_object_new(G_INET_TYPE_FLOW_TABLE, "engine", G_INET_FLOW_TABLE_ENGINE_SWISS,
+                         "capacity", (guint64) count, "records", TRUE, NULL);
+    g_inet_flow_table_hash_set(table, G_INET_FLOW_HASH_CRC32C);
+    flows = bench_table_flows(table, count);
+    for (i = 0; i < count; i++)
+        flows[i].timestamp = base + (guint64) i * 300000000 / count;
+
+    start = bench_ticks();
+    for (i = 0; i < count; i++)
+        flow_packet_get(table, &flows[i], TRUE);
+    for (i = 0; i < count; i++) {
+        flows[i].timestamp += 1000000;
+        flow_packet_get(table, &flows[i], TRUE);
+    }
+    for (ts = base; expired < count; ts += 1000000) {
+        if (batch) {
+            expired += g_inet_flow_record_expire_batch(table, ts, G_MAXUINT,
+                                                       bench_expire_release, NULL, NULL);
+            continue;
+        }
+        while ((flow = flow_expire(table, ts))) {
+            g_inet_flow_record_release((GInetFlowRecord *) flow);
+            expired++;
+        }
+    }
+    bench_report(name, bench_ticks() - start, count);
+    g_object_unref(table);
+    g_free(flows);
+}
+
+/* Updates or plain lookups from several threads into one table, split
+ * into locked stripes unless stripes is 0. Lookups hold the read lock for
+ * a few hundred packets at a time. Reports the wall clock cost per packet.
+ */
+#define BENCH_THREADS_MAX   16
+#define BENCH_READ_CHUNK    256
+struct bench_thread {
+    GInetFlowTable *table;
+    GInetFlow *packets;
+    gboolean update;
+};
+
+static gpointer bench_update_thread(gpointer data)
+{
+    struct bench_thread *thread = (struct bench_thread *) data;
+    guint64 sum = 0;
+    guint i;
+
+    for (i = 0; i < BENCH_LOOKUPS; i++) {
+        GInetFlow *f;
+
+        if (!thread->update && i % BENCH_READ_CHUNK == 0)
+            g_inet_flow_read_lock();
+        f = flow_table_get(thread->table, &thread->packets[i], thread->update);
+        if (f)
+            sum += f->packets;
+        if (!thread->update && i % BENCH_READ_CHUNK == BENCH_READ_CHUNK - 1)
+            g_inet_flow_read_unlock();
+    }
+    bench_sink += sum;
+    return NULL;
+}
+
+static void bench_flow_threads(const gchar * name, guint stripes, gboolean lock_free,
+                               gboolean update, guint nthreads, guint count)
+{
+    struct bench_thread threads[BENCH_THREADS_MAX];
+    GThread *ids[BENCH_THREADS_MAX];
+    GInetFlowTable *table;
+    GInetFlow *flows;
+    GInetFlow *flow;
+    guint64 start;
+    guint i, j;
+
+    if (!bench_enabled(name))
+        return;
+    table = g_object_new(G_INET_TYPE_FLOW_TABLE, "engine", G_INET_FLOW_TABLE_ENGINE_SWISS,
+                         "capacity", (guint64) count, "stripes", stripes,
+                         "lock-free-lookups", lock_free, NULL);
+    g_inet_flow_table_hash_set(table, G_INET_FLOW_HASH_CRC32C);
+    flows = bench_table_flows(table, count);
+    for (i = 0; i < count; i++)
+        flow_table_get(table, &flows[i], TRUE);
+    for (i = 0; i < nthreads; i++) {
+        threads[i].table = table;
+        threads[i].update = update;
+        threads[i].packets = g_new0(GInetFlow, BENCH_LOOKUPS);
+        for (j = 0; j < BENCH_LOOKUPS; j++) {
+            GInetFlow *f = &flows[g_random_int_range(0, count)];
+            threads[i].packets[j].family = f->family;
+            threads[i].packets[j].hash = f->hash;
+            threads[i].packets[j].tuple = f->tuple;
+        }
+    }
+
+    start = bench_ticks();
+    for (i = 0; i < nthreads; i++)
+        ids[i] = g_thread_new("bench", bench_update_thread, &threads[i]);
+    for (i = 0; i < nthreads; i++)
+        g_thread_join(ids[i]);
+    bench_report(name, bench_ticks() - start, (guint64) nthreads * BENCH_LOOKUPS);
+
+    for (i = 0; i < nthreads; i++)
+        g_free(threads[i].packets);
+    while ((flow = g_inet_flow_expire(table, G_MAXUINT64)))
+        g_object_unref(flow);
+    g_object_unref(table);
+    g_free(flows);
+}
+
+static GOptionEntry entries[] = {
+    {"rounds", 'r', 0, G_OPTION_ARG_INT, &rounds, "Rounds per benchmark", NULL},
+    {"filter", 'f', 0, G_OPTION_ARG_STRING, &filter, "Only run benchmarks matching", NULL},
+    {NULL}
+};
+
+int main(int argc, char **argv)
+{
+    GError *error = NULL;
+    GOptionContext *context;
+    GInetFlowTable *table;
+
+    context = g_option_context_new("- Benchmarks for libginetflow");
+    g_option_context_add_main_entries(context, entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        g_print("%s", g_option_context_get_help(context, FALSE, NULL));
+        g_print("ERROR: %s\n", error->message);
+        exit(1);
+    }
+
+    /* Class initialisation builds the hash tables */
+    table = g_inet_flow_table_new();
+
+    bench_flow_hash("flow_hash/crc16-bitwise/ipv4", table, G_SOCKET_FAMILY_IPV4, NULL);
+    bench_flow_hash("flow_hash/crc16-bitwise/ipv6", table, G_SOCKET_FAMILY_IPV6, NULL);
+    bench_flow_hash("flow_hash/crc16/ipv4", table, G_SOCKET_FAMILY_IPV4, flow_hash_crc16);
+    bench_flow_hash("flow_hash/crc16/ipv6", table, G_SOCKET_FAMILY_IPV6, flow_hash_crc16);
+    bench_flow_hash("flow_hash/crc32c-sw/ipv4", table, G_SOCKET_FAMILY_IPV4,
+                    flow_hash_crc32c_sw);
+    bench_flow_hash("flow_hash/crc32c-sw/ipv6", table, G_SOCKET_FAMILY_IPV6,
+                    flow_hash_crc32c_sw);
+    bench_flow_hash("flow_hash/crc32c/ipv4", table, G_SOCKET_FAMILY_IPV4, crc32c_impl);
+    bench_flow_hash("flow_hash/crc32c/ipv6", table, G_SOCKET_FAMILY_IPV6, crc32c_impl);
+    g_inet_flow_table_hash_set(table, G_INET_FLOW_HASH_TOEPLITZ);
+    bench_flow_hash("flow_hash/toeplitz/ipv4", table, G_SOCKET_FAMILY_IPV4,
+                    flow_hash_toeplitz);
+    bench_flow_hash("flow_hash/toeplitz/ipv6", table, G_SOCKET_FAMILY_IPV6,
+                    flow_hash_toeplitz);
+    bench_flow_hash("flow_hash/siphash13/ipv4", table, G_SOCKET_FAMILY_IPV4,
+                    flow_hash_siphash);
+    bench_flow_hash("flow_hash/siphash13/ipv6", table, G_SOCKET_FAMILY_IPV6,
+                    flow_hash_siphash);
+
+    g_inet_flow_table_hash_set(table, G_INET_FLOW_HASH_SIPHASH);
+    bench_flow_hash_batch("flow_hash_batch/siphash13-scalar/ipv4", table,
+                          G_SOCKET_FAMILY_IPV4, flow_hash_batch_scalar);
+    bench_flow_hash_batch("flow_hash_batch/siphash13/ipv4", table, G_SOCKET_FAMILY_IPV4,
+                          siphash_batch_impl);
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2"))
+        bench_flow_hash_batch("flow_hash_batch/siphash13-avx2/ipv4", table,
+                              G_SOCKET_FAMILY_IPV4, flow_hash_batch_siphash_avx2);
+#endif
+    g_inet_flow_table_hash_set(table, G_INET_FLOW_HASH_CRC32C);
+    bench_flow_hash_batch("flow_hash_batch/crc32c-scalar/ipv4", table,
+                          G_SOCKET_FAMILY_IPV4, flow_hash_batch_scalar);
+    bench_flow_hash_batch("flow_hash_batch/crc32c/ipv4", table, G_SOCKET_FAMILY_IPV4,
+                          crc32c_batch_impl);
+
+    bench_flow_compare("flow_compare/scalar", flow_compare_scalar);
+    bench_flow_compare("flow_compare/vector", flow_compare);
+    bench_tuple_order("tuple_order/branchy/ipv4", G_SOCKET_FAMILY_IPV4, TRUE);
+    bench_tuple_order("tuple_order/branchless/ipv4", G_SOCKET_FAMILY_IPV4, FALSE);
+    bench_tuple_order("tuple_order/branchy/ipv6", G_SOCKET_FAMILY_IPV6, TRUE);
+    bench_tuple_order("tuple_order/branchless/ipv6", G_SOCKET_FAMILY_IPV6, FALSE);
+
+    bench_flow_lookup("flow_lookup/ghash/1M", G_INET_FLOW_TABLE_ENGINE_GHASH, 1000000);
+    bench_flow_lookup("flow_lookup/swiss/1M", G_INET_FLOW_TABLE_ENGINE_SWISS, 1000000);
+    bench_flow_lookup("flow_lookup/cuckoo/1M", G_INET_FLOW_TABLE_ENGINE_CUCKOO, 1000000);
+    bench_flow_lookup("flow_lookup/dual/1M", G_INET_FLOW_TABLE_ENGINE_DUAL, 1000000);
+    bench_flow_lookup("flow_lookup/ghash/10M", G_INET_FLOW_TABLE_ENGINE_GHASH, 10000000);
+    bench_flow_lookup("flow_lookup/swiss/10M", G_INET_FLOW_TABLE_ENGINE_SWISS, 10000000);
+    bench_flow_lookup("flow_lookup/cuckoo/10M", G_INET_FLOW_TABLE_ENGINE_CUCKOO,
+                      10000000);
+    bench_flow_lookup("flow_lookup/dual/10M", G_INET_FLOW_TABLE_ENGINE_DUAL, 10000000);
+    bench_flow_lookup_records("flow_lookup/records/10M", FALSE, 10000000);
+    bench_flow_lookup_records("flow_lookup/records-huge/10M", TRUE, 10000000);
+    bench_flow_cache("flow_lookup/bursts/1M", 0, 1000000);
+    bench_flow_cache("flow_lookup/bursts-cache-4K/1M", 4096, 1000000);
+    bench_flow_insert("flow_insert/ghash/1M", G_INET_FLOW_TABLE_ENGINE_GHASH, FALSE,
+                      1000000);
+    bench_flow_insert("flow_insert/swiss/1M", G_INET_FLOW_TABLE_ENGINE_SWISS, FALSE,
+                      1000000);
+    bench_flow_insert("flow_insert/swiss-incremental/1M", G_INET_FLOW_TABLE_ENGINE_SWISS,
+                      TRUE, 1000000);
+    bench_flow_insert("flow_insert/cuckoo/1M", G_INET_FLOW_TABLE_ENGINE_CUCKOO, FALSE,
+                      1000000);
+
+    bench_flow_churn("flow_churn/objects", FALSE, FALSE, 1000000);
+    bench_flow_churn("flow_churn/objects-recycled", FALSE, TRUE, 1000000);
+    bench_flow_churn("flow_churn/records", TRUE, FALSE, 1000000);
+    bench_flow_expire("flow_expire/records/1M", FALSE, 1000000);
+    bench_flow_expire("flow_expire/records-batch/1M", TRUE, 1000000);
+
+    bench_flow_threads("flow_update/1-thread/1M", 0, FALSE, TRUE, 1, 1000000);
+    bench_flow_threads("flow_update/stripes-64/1-thread/1M", 64, FALSE, TRUE, 1, 1000000);
+    bench_flow_threads("flow_update/stripes-64/4-threads/1M", 64, FALSE, TRUE, 4, 1000000);
+    bench_flow_threads("flow_update/stripes-64/8-threads/1M", 64, FALSE, TRUE, 8, 1000000);
+    bench_flow_threads("flow_read/stripes-64/4-threads/1M", 64, FALSE, FALSE, 4, 1000000);
+    bench_flow_threads("flow_read/lock-free/4-threads/1M", 64, TRUE, FALSE, 4, 1000000);
+
+    g_object_unref(table);
+    g_option_context_free(context);
+    return 0;
+}
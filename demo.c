@@ -16,10 +16,14 @@
  * You should have received a copy of the GNU General Public License
  * along with this library. If not, see <http://www.gnu.org/licenses/>
  */
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
 #include <pcap.h>
 #if defined(LIBNDPI_OLD_API) || defined(LIBNDPI_NEW_API)
 #include "libndpi/ndpi_api.h"
@@ -29,16 +33,25 @@
 #include "ginetflow.h"
 
 #define MAX_WORKERS 64
+/* Workers age their shard every so many frames, expiring as many flows at most */
+#define AGING_FRAMES 1024
 static gint nworkers = 1;
 static gboolean dpi = FALSE;
 static gchar *filename = NULL;
 static gboolean verbose = FALSE;
+static gboolean numa = FALSE;
 
 static GThreadPool *workers[MAX_WORKERS];
 static gint processed[MAX_WORKERS] = { };
+static gboolean pinned[MAX_WORKERS] = { };
+static gint expired[MAX_WORKERS] = { };
+static GMainContext *aging[MAX_WORKERS];
+
+static gint numa_node = -1;
+static cpu_set_t numa_cpus;
 
 static gint frames = 0;
-static GInetFlowTable *table = NULL;
+static GInetFlowShardedTable *table = NULL;
 
 #if defined(LIBNDPI_OLD_API) || defined(LIBNDPI_NEW_API)
 static struct ndpi_detection_module_struct *module = NULL;
@@ -105,37 +118,79 @@ static void analyse_frame(GInetFlow * flow, const uint8_t * frame, uint32_t leng
 }
 #endif
 
+/* NUMA node of the CPU the calling thread runs on */
+static int current_node(void)
+{
+    unsigned int cpu, node;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0)
+        return 0;
+    return node;
+}
+
+/* CPUs of a node, from a sysfs list such as "0-7,16-23" */
+static gboolean node_cpus(int node, cpu_set_t * set)
+{
+    gchar *path = g_strdup_printf("/sys/devices/system/node/node%d/cpulist", node);
+    gchar *list = NULL;
+    gchar **ranges;
+    int first, last, i;
+
+    CPU_ZERO(set);
+    if (g_file_get_contents(path, &list, NULL, NULL)) {
+        ranges = g_strsplit(g_strstrip(list), ",", -1);
+        for (i = 0; ranges[i]; i++) {
+            if (sscanf(ranges[i], "%d-%d", &first, &last) == 1)
+                last = first;
+            for (; first <= last && first < CPU_SETSIZE; first++)
+                CPU_SET(first, set);
+        }
+        g_strfreev(ranges);
+        g_free(list);
+    }
+    g_free(path);
+    return CPU_COUNT(set) > 0;
+}
+
 typedef struct Job {
-    GInetFlow *flow;
     uint8_t *frame;
     uint32_t length;
 } Job;
 
+/* Each worker owns one shard, so flows are looked up with no sharing */
 static void worker_func(gpointer a, gpointer b)
 {
     Job *job = (Job *) a;
     int id = GPOINTER_TO_INT(b);
+    GInetFlowTable *shard = g_inet_flow_sharded_table_get_shard(table, id);
+    GInetFlow *flow;
+    static __thread gboolean affined = FALSE;
+
+    /* Pool threads are created on demand, so each pins itself on first use */
+    if (numa && !affined) {
+        pinned[id] = sched_setaffinity(0, sizeof(numa_cpus), &numa_cpus) == 0;
+        affined = TRUE;
+    }
+    flow = g_inet_flow_get_full(shard, job->frame, job->length, 0, 0, TRUE, TRUE);
 #if defined(LIBNDPI_OLD_API) || defined(LIBNDPI_NEW_API)
-    if (dpi)
-        analyse_frame(job->flow, job->frame, job->length);
+    if (flow && dpi)
+        analyse_frame(flow, job->frame, job->length);
 #endif
-    processed[id]++;
+    /* Age the shard between frames, from the thread that owns it */
+    if (++processed[id] % AGING_FRAMES == 0)
+        g_main_context_iteration(aging[id], FALSE);
     free(job->frame);
     free(job);
 }
 
 static void process_frame(const uint8_t * frame, uint32_t length)
 {
-    GInetFlow *flow = g_inet_flow_get_full(table, frame, length, 0, 0, TRUE, TRUE);
-    if (flow) {
-        guint hash = 0;
+    gint shard = g_inet_flow_sharded_table_shard_for_frame(table, frame, length, 0, TRUE);
+    if (shard >= 0) {
         Job *job = calloc(1, sizeof(Job));
-        job->flow = flow;
         job->frame = malloc(length);
         memcpy(job->frame, frame, length);
         job->length = length;
-        g_object_get(flow, "hash", &hash, NULL);
-        g_thread_pool_push(workers[hash % nworkers], (gpointer) job, NULL);
+        g_thread_pool_push(workers[shard], (gpointer) job, NULL);
         frames++;
     }
     return;
@@ -159,12 +214,6 @@ static void process_pcap(const char *filename)
         process_frame(frame, hdr.caplen);
     }
     pcap_close(pcap);
-
-    guint64 size, misses, hits;
-    g_object_get(table, "size", &size, "misses", &misses, "hits", &hits, NULL);
-    g_printf("\nProcessed %d frames," " %" G_GUINT64_FORMAT " misses,"
-             " %" G_GUINT64_FORMAT " hits," " %" G_GUINT64_FORMAT " flows\n",
-             frames, misses, hits, size);
 }
 
 static void print_flow(GInetFlow * flow, gpointer data)
@@ -204,17 +253,27 @@ static void clean_flow(GInetFlow * flow, gpointer data)
         ndpi_free(ndpi->src);
         ndpi_free(ndpi->dst);
         free(ndpi);
+        g_object_set_data((GObject *) flow, "ndpi", NULL);
     }
 #endif
     g_object_unref(flow);
 }
 
+static void expire_flow(GInetFlow * flow, gpointer data)
+{
+    expired[GPOINTER_TO_INT(data)]++;
+    clean_flow(flow, NULL);
+}
+
 static GOptionEntry entries[] = {
     {"pcap", 'p', 0, G_OPTION_ARG_STRING, &filename, "Pcap file to use", NULL},
-    {"workers", 'w', 0, G_OPTION_ARG_INT, &nworkers, "Number of worker threads", NULL},
+    {"workers", 'w', 0, G_OPTION_ARG_INT, &nworkers,
+     "Number of worker threads, each owning a flow table shard", NULL},
 #if defined(LIBNDPI_OLD_API) || defined(LIBNDPI_NEW_API)
     {"dpi", 'd', 0, G_OPTION_ARG_NONE, &dpi, "Analyse frames using DPI", NULL},
 #endif
+    {"numa", 'n', 0, G_OPTION_ARG_NONE, &numa,
+     "Keep capture, workers and the flow table on one NUMA node", NULL},
     {"verbose", 'v', 0, G_OPTION_ARG_NONE, &verbose, "Be verbose", NULL},
     {NULL}
 };
@@ -259,7 +318,29 @@ int main(int argc, char **argv)
             g_thread_pool_new((GFunc) worker_func, GINT_TO_POINTER(i), 1, FALSE, NULL);
     }
 
-    table = g_inet_flow_table_new();
+    /* One shard per worker, all kept on the capture node */
+    if (numa) {
+        numa_node = current_node();
+        if (!node_cpus(numa_node, &numa_cpus)) {
+            g_print("ERROR: No CPUs found for NUMA node %d\n", numa_node);
+            exit(1);
+        }
+        sched_setaffinity(0, sizeof(numa_cpus), &numa_cpus);
+        table = g_object_new(G_INET_TYPE_FLOW_SHARDED_TABLE, "shards", nworkers,
+                             "numa-node", numa_node, NULL);
+        g_printf("NUMA node %d, %d CPUs\n", numa_node, CPU_COUNT(&numa_cpus));
+    } else {
+        table = g_inet_flow_sharded_table_new(nworkers);
+    }
+    for (i = 0; i < nworkers; i++) {
+        GSource *source =
+            g_inet_flow_aging_source_new(g_inet_flow_sharded_table_get_shard(table, i),
+                                         AGING_FRAMES);
+        aging[i] = g_main_context_new();
+        g_source_set_callback(source, (GSourceFunc) expire_flow, GINT_TO_POINTER(i), NULL);
+        g_source_attach(source, aging[i]);
+        g_source_unref(source);
+    }
     process_pcap(filename);
 
     for (i = 0; i < nworkers; i++) {
@@ -277,14 +358,34 @@ int main(int argc, char **argv)
         g_thread_pool_free(workers[i], FALSE, TRUE);
     }
 
+    guint64 size, misses, hits;
+    g_object_get(table, "size", &size, "misses", &misses, "hits", &hits, NULL);
+    g_printf("\nProcessed %d frames," " %" G_GUINT64_FORMAT " misses,"
+             " %" G_GUINT64_FORMAT " hits," " %" G_GUINT64_FORMAT " flows\n",
+             frames, misses, hits, size);
+
     g_printf("Worker:frames");
     for (i = 0; i < nworkers; i++)
         g_printf(" %d:%d", i, processed[i]);
     g_printf("\n");
+    g_printf("Worker:expired");
+    for (i = 0; i < nworkers; i++)
+        g_printf(" %d:%d", i, expired[i]);
+    g_printf("\n");
+    if (numa) {
+        g_printf("Worker:pinned");
+        for (i = 0; i < nworkers; i++)
+            g_printf(" %d:%s", i, pinned[i] ? "yes" : "no");
+        g_printf("\n");
+    }
     g_printf
         ("Hash    lip              uip            prot lport uport  pkts  state  app\n");
-    g_inet_flow_foreach(table, (GIFFunc) print_flow, NULL);
-    g_inet_flow_foreach(table, (GIFFunc) clean_flow, NULL);
+    for (i = 0; i < nworkers; i++) {
+        GInetFlowTable *shard = g_inet_flow_sharded_table_get_shard(table, i);
+        g_inet_flow_foreach(shard, (GIFFunc) print_flow, NULL);
+        g_inet_flow_foreach(shard, (GIFFunc) clean_flow, NULL);
+        g_main_context_unref(aging[i]);
+    }
     g_object_unref(table);
 #if defined(LIBNDPI_OLD_API) || defined(LIBNDPI_NEW_API)
     if (module)
@@ -19,11 +19,22 @@
 #include <stdio.h>
 #include <string.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 #include <arpa/inet.h>
 #include <glib.h>
 #include <glib/gprintf.h>
 #include <gio/gio.h>
 #include "ginetflow.h"
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#endif
 
 #define DEBUG(fmt, args...)
 //#define DEBUG(fmt, args...) {g_printf("%s: ",__func__);g_printf (fmt, ## args);}
@@ -41,22 +52,37 @@ struct tuple {
     guint32 upper_ip[4];
 };
 
-/** GInetFlow */
+/** GInetFlow
+ * Laid out for LP64 so that the GObject header and cold fields fill the
+ * first cache line and everything a lookup and a packet update touch
+ * shares the second. Fields set once per flow or read elsewhere follow.
+ */
 struct _GInetFlow {
     GObject parent;
     struct _GInetFlowTable *table;
     GList list;
+    gpointer context;
+    /* Hot */
+    struct tuple tuple;
     guint64 timestamp;
-    guint64 lifetime;
     guint64 packets;
-    GInetFlowState state;
-    guint family;
-    guint16 hash;
-    guint16 flags;
+    guint32 lifetime;
+    guint8 state;
     guint8 direction;
-    struct tuple tuple;
-    gpointer context;
+    guint16 flags;
+    /* Cold */
+    guint64 hash;
+    guint family;
+    guint16 wheel_slot;
+    guint8 timeout_class;
+    /* A record's GObject wrapper, or the record a wrapper views */
+    struct _GInetFlow *object;
+    struct _GInetFlow *record;
 };
+#define FLOW_HOT_START      G_STRUCT_OFFSET(GInetFlow, tuple)
+#define FLOW_HOT_END        (G_STRUCT_OFFSET(GInetFlow, flags) + sizeof(guint16))
+/* Flows in a slab are spaced so each one's hot line stays aligned */
+#define FLOW_STRIDE         ((sizeof(GInetFlow) + 63) & ~(gsize) 63)
 
 struct frag_info {
     guint32 id;
@@ -69,29 +95,318 @@ struct _GInetFlowClass {
 };
 G_DEFINE_TYPE(GInetFlow, g_inet_flow, G_TYPE_OBJECT);
 
-static int lifetime_values[] = {
-    G_INET_FLOW_DEFAULT_CLOSED_TIMEOUT,
+/* Timeout classes every table starts with, one per flow state and in the
+ * same order, whatever the protocol
+ */
+#define FLOW_STATES         (FLOW_CLOSED + 1)
+#define TIMEOUT_CLASSES_MAX 256
+static const guint32 default_timeouts[FLOW_STATES] = {
     G_INET_FLOW_DEFAULT_NEW_TIMEOUT,
     G_INET_FLOW_DEFAULT_OPEN_TIMEOUT,
+    G_INET_FLOW_DEFAULT_CLOSED_TIMEOUT,
+};
+
+/* Hierarchical timing wheel of flow expiry times. Each level has 64 slots
+ * and a slot spans a whole turn of the level below, so ticks of about 65ms
+ * reach out 12 days. Flows due later than that wait in the top level and
+ * are placed again each time their slot comes round. Flows whose expiry
+ * tick has been passed sit on the due list until they are released.
+ */
+#define WHEEL_TICK_BITS     16
+#define WHEEL_BITS          6
+#define WHEEL_SLOTS         (1 << WHEEL_BITS)
+#define WHEEL_LEVELS        4
+/* Flows hold their slot plus one, or 0 when not on the wheel */
+#define WHEEL_DUE           (WHEEL_LEVELS * WHEEL_SLOTS + 1)
+struct timing_wheel {
+    guint64 now;
+    guint64 occupied[WHEEL_LEVELS];
+    GList *slots[WHEEL_LEVELS * WHEEL_SLOTS];
+    GList *due;
+};
+
+/* Ages a table from a main loop. wake is the earliest deadline the source
+ * is set to run for, so only flows due before it need to move it sooner.
+ */
+struct flow_aging_source {
+    GSource source;
+    GInetFlowTable *table;
+    guint budget;
+    GMutex lock;
+    guint64 wake;
+};
+
+typedef guint64(*flow_hash_fn) (GInetFlowTable * table, const struct tuple * tuple,
+                                guint family);
+
+/* Fills in the hash of every flow in the batch */
+typedef void (*flow_hash_batch_fn) (GInetFlowTable * table, GInetFlow ** flows,
+                                    guint count);
+
+/* Frames parsed and hashed together by g_inet_flow_get_batch */
+#define FLOW_BATCH_MAX      64
+
+/* Longest Toeplitz input: IPv6 addresses and both ports */
+#define TOEPLITZ_INPUT_MAX  36
+
+/* Index bucket: one cache line of seven 7 bit tags and their flows. For the
+ * Swiss engine, overflow counts the entries that probed past this bucket
+ * when inserted, so a lookup can stop at the first bucket where it is zero.
+ * The cuckoo engine leaves it unused.
+ */
+#define BUCKET_SLOTS        7
+#define SWISS_MIN_BUCKETS   8
+/* Old buckets migrated per table operation during an incremental resize */
+#define SWISS_MIGRATE_STEP  4
+#define CUCKOO_DEFAULT_CAPACITY 65536
+/* Bucket nodes visited when making room for a cuckoo insert */
+#define CUCKOO_SEARCH_MAX   256
+/* Longest chain of moves, including the initial buckets */
+#define CUCKOO_DEPTH_MAX    5
+struct flow_bucket {
+    union {
+        struct {
+            guint8 tags[BUCKET_SLOTS];
+            guint8 overflow;
+        };
+        /* Tags and overflow count, for lock-free readers to load at once */
+        guint64 group;
+    };
+    GInetFlow *flows[BUCKET_SLOTS];
+} __attribute__ ((aligned(64)));
+
+/* Compact IPv4 bucket for the dual engine: three flows with their 13 byte
+ * keys inline, so lookups compare keys without touching the flows. Empty
+ * slots have no flow. Overflow is kept as for the Swiss engine.
+ */
+#define BUCKET4_SLOTS       3
+struct flow_bucket4 {
+    guint64 ips[BUCKET4_SLOTS];
+    guint32 ports[BUCKET4_SLOTS];
+    guint8 protocol[BUCKET4_SLOTS];
+    guint8 overflow;
+    GInetFlow *flows[BUCKET4_SLOTS];
+} __attribute__ ((aligned(64)));
+
+struct bucket_array {
+    gpointer mem;
+    union {
+        struct flow_bucket *buckets;
+        struct flow_bucket4 *buckets4;
+    };
+    guint64 mask;
+    guint shift;
+    guint64 size;
+    /* Backed by huge pages or bound to a NUMA node, and the mapping to
+     * release if so
+     */
+    gboolean huge;
+    int node;
+    gsize length;
+    gsize page_size;
+    /* Odd while a grown array is being published to lock-free readers */
+    guint seq;
 };
 
-#define LIFETIME_COUNT (sizeof(lifetime_values) / sizeof(lifetime_values[0]))
+/* Concurrent tables count hits and misses per thread rather than per
+ * stripe, so threads working on different stripes never share a counter
+ * cache line. Threads beyond COUNTER_SLOTS share slots.
+ */
+#define COUNTER_SLOTS       64
+struct flow_counters {
+    guint64 hits;
+    guint64 misses;
+} __attribute__ ((aligned(64)));
+
+/* Most stripes a concurrent table can be split into */
+#define TABLE_STRIPES_MAX   256
+
+/* Exact match cache entry, the hash is kept so misses do not touch flows */
+#define FLOW_CACHE_MAX      65536
+struct flow_cache_entry {
+    guint64 hash;
+    GInetFlow *flow;
+};
 
 /** GInetFlowTable */
 struct _GInetFlowTable {
     GObject parent;
+    /* A concurrent table keeps its flows in stripes, each a table of its
+     * own guarded by its lock and chosen by flow hash
+     */
+    GInetFlowTable **stripes;
+    guint nstripes;
+    GInetFlowTable *owner;
+    GMutex lock;
+    struct flow_counters *counters;
+    /* Stripes with lock-free lookups retire what they unlink, and free it
+     * once no reader can still see it
+     */
+    gboolean lock_free;
+    GList *retiring;
+    guint retiring_count;
+    GList *retiring_mem;
+    GList *retired;
+    GList *retired_mem;
+    guint64 retired_epoch;
+    GInetFlowTableEngine engine;
+    guint64 capacity;
     GHashTable *table;
-    GList *list[LIFETIME_COUNT];
+    struct bucket_array buckets;
+    struct bucket_array buckets4;
+    gboolean incremental;
+    struct bucket_array migrating;
+    guint64 migrated;
+    GInetFlowHash hash_type;
+    flow_hash_fn hash_fn;
+    flow_hash_batch_fn hash_batch_fn;
+    GInetFlowHashFields hash_fields;
+    guint8 hash_key[G_INET_FLOW_HASH_KEY_MAX];
+    guint64 sip_key[2];
+    guint32 *toeplitz;
+    struct timing_wheel wheel;
+    guint32 *timeouts;
+    guint ntimeouts;
+    guint8 timeout_select[256][FLOW_STATES];
+    GSource *aging;
+    GList *pool;
+    gboolean recycle;
+    gboolean records;
+    GList *slabs;
+    gboolean huge;
+    int node;
+    guint64 in_use;
+    guint64 free;
+    guint64 high_water;
     GList *frag_info_list;
     guint64 hits;
     guint64 misses;
     guint64 max;
+    struct flow_cache_entry *cache;
+    guint cache_size;
+    guint cache_shift;
+    guint64 cache_hits;
+    guint64 cache_lookups;
 };
 struct _GInetFlowTableClass {
     GObjectClass parent;
 };
 G_DEFINE_TYPE(GInetFlowTable, g_inet_flow_table, G_TYPE_OBJECT);
 
+/* Stripes of a concurrent table are locked, plain tables are not */
+static inline void stripe_lock(GInetFlowTable * table)
+{
+    if (table->owner)
+        g_mutex_lock(&table->lock);
+}
+
+static inline void stripe_unlock(GInetFlowTable * table)
+{
+    if (table->owner)
+        g_mutex_unlock(&table->lock);
+}
+
+static inline GInetFlowTable *stripe_for_hash(GInetFlowTable * table, guint64 hash)
+{
+    return table->stripes[(hash ^ (hash >> 32)) & (table->nstripes - 1)];
+}
+
+static __thread guint counter_slot;
+static gint counter_slots_next;
+
+static inline struct flow_counters *thread_counters(GInetFlowTable * table)
+{
+    if (!counter_slot)
+        counter_slot = g_atomic_int_add(&counter_slots_next, 1) % COUNTER_SLOTS + 1;
+    return &table->counters[counter_slot - 1];
+}
+
+#define FLOW_COUNT(__t, __field) \
+    ((__t)->counters ? \
+     (void) __atomic_add_fetch(&thread_counters(__t)->__field, 1, __ATOMIC_RELAXED) : \
+     (void) (__t)->__field++)
+
+/* Epoch based reclamation for lock-free lookups. A reader publishes the
+ * epoch it entered at in a slot of its own for as long as it holds the
+ * read lock. Writers retire the flows and arrays they unlink and bump the
+ * epoch, and free them once every reader has either left or entered at a
+ * later epoch. Threads beyond EPOCH_READERS_MAX get no slot and look flows
+ * up under the stripe locks instead.
+ */
+#define EPOCH_READERS_MAX   64
+#define EPOCH_BATCH         64
+struct epoch_reader {
+    guint64 epoch;
+    gint claimed;
+    guint nest;
+} __attribute__ ((aligned(64)));
+static struct epoch_reader epoch_readers[EPOCH_READERS_MAX];
+static guint64 epoch_global = 1;
+
+static void epoch_reader_release(gpointer data)
+{
+    struct epoch_reader *reader = (struct epoch_reader *) data;
+
+    __atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+    reader->nest = 0;
+    g_atomic_int_set(&reader->claimed, 0);
+}
+
+static GPrivate epoch_reader_key = G_PRIVATE_INIT(epoch_reader_release);
+
+static struct epoch_reader *epoch_reader_get(void)
+{
+    struct epoch_reader *reader = g_private_get(&epoch_reader_key);
+    int i;
+
+    for (i = 0; !reader && i < EPOCH_READERS_MAX; i++) {
+        if (g_atomic_int_compare_and_exchange(&epoch_readers[i].claimed, 0, 1)) {
+            reader = &epoch_readers[i];
+            g_private_set(&epoch_reader_key, reader);
+        }
+    }
+    return reader;
+}
+
+void g_inet_flow_read_lock(void)
+{
+    struct epoch_reader *reader = epoch_reader_get();
+
+    /* A sequentially consistent store so the index is only read after it */
+    if (reader && reader->nest++ == 0)
+        __atomic_store_n(&reader->epoch, __atomic_load_n(&epoch_global, __ATOMIC_SEQ_CST),
+                         __ATOMIC_SEQ_CST);
+}
+
+void g_inet_flow_read_unlock(void)
+{
+    struct epoch_reader *reader = g_private_get(&epoch_reader_key);
+
+    if (reader && reader->nest && --reader->nest == 0)
+        __atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+}
+
+static inline gboolean epoch_reading(void)
+{
+    struct epoch_reader *reader = g_private_get(&epoch_reader_key);
+
+    return reader && reader->nest;
+}
+
+/* Oldest epoch a reader is still in */
+static guint64 epoch_min_active(void)
+{
+    guint64 min = G_MAXUINT64;
+    int i;
+
+    for (i = 0; i < EPOCH_READERS_MAX; i++) {
+        guint64 epoch = __atomic_load_n(&epoch_readers[i].epoch, __ATOMIC_SEQ_CST);
+        if (epoch && epoch < min)
+            min = epoch;
+    }
+    return min;
+}
+
 /* Packet */
 #define ETH_PROTOCOL_8021Q      0x8100
 #define ETH_PROTOCOL_8021AD     0x88A8
@@ -221,20 +536,80 @@ static inline guint64 get_time_us(void)
     return (tv.tv_sec * (guint64) TIMESTAMP_RESOLUTION_US + tv.tv_usec);
 }
 
+/* CRC16-CCITT (poly 0x1021, MSB first) using slicing-by-8 lookup tables.
+ * crc16_table[k][x] is the CRC of byte x followed by k zero bytes, so all
+ * eight bytes of a 64 bit word can be folded in with independent lookups.
+ */
+#define CRC16_POLY 0x1021
+static guint16 crc16_table[8][256];
+
+static void crc16_init(void)
+{
+    int i;
+    int j;
+    guint16 crc;
+
+    for (i = 0; i < 256; i++) {
+        crc = i << 8;
+        for (j = 0; j < 8; j++)
+            crc = (crc & 0x8000) ? (crc << 1) ^ CRC16_POLY : (crc << 1);
+        crc16_table[0][i] = crc;
+    }
+    for (j = 1; j < 8; j++) {
+        for (i = 0; i < 256; i++) {
+            crc = crc16_table[j - 1][i];
+            crc16_table[j][i] = (crc << 8) ^ crc16_table[0][crc >> 8];
+        }
+    }
+}
+
 static inline guint16 crc16(guint16 iv, guint64 p)
+{
+    return crc16_table[7][((iv >> 8) ^ (p >> 56)) & 0xff] ^
+        crc16_table[6][(iv ^ (p >> 48)) & 0xff] ^
+        crc16_table[5][(p >> 40) & 0xff] ^
+        crc16_table[4][(p >> 32) & 0xff] ^
+        crc16_table[3][(p >> 24) & 0xff] ^
+        crc16_table[2][(p >> 16) & 0xff] ^
+        crc16_table[1][(p >> 8) & 0xff] ^ crc16_table[0][p & 0xff];
+}
+
+/* CRC32C (Castagnoli, reflected poly 0x82f63b78), slicing-by-8 fallback for
+ * CPUs without a crc32 instruction. Gives the same result as SSE4.2 crc32q.
+ */
+#define CRC32C_POLY 0x82f63b78
+static guint32 crc32c_table[8][256];
+
+static void crc32c_init(void)
 {
     int i;
     int j;
-    guint32 b;
-    guint16 poly = 0x1021;
-    for (i = 7; i >= 0; i--) {
-        b = (p >> (i * 8)) & 0xff;
-        for (j = 7; j >= 0; j--) {
-            iv = ((iv << 1) ^ ((((iv >> 15) & 1) ^ ((b >> j) & 1)) ? poly : 0))
-                & 0xffff;
+    guint32 crc;
+
+    for (i = 0; i < 256; i++) {
+        crc = i;
+        for (j = 0; j < 8; j++)
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : (crc >> 1);
+        crc32c_table[0][i] = crc;
+    }
+    for (j = 1; j < 8; j++) {
+        for (i = 0; i < 256; i++) {
+            crc = crc32c_table[j - 1][i];
+            crc32c_table[j][i] = (crc >> 8) ^ crc32c_table[0][crc & 0xff];
         }
     }
-    return iv;
+}
+
+static inline guint32 crc32c_u64_sw(guint32 crc, guint64 v)
+{
+    v ^= crc;
+    return crc32c_table[7][v & 0xff] ^
+        crc32c_table[6][(v >> 8) & 0xff] ^
+        crc32c_table[5][(v >> 16) & 0xff] ^
+        crc32c_table[4][(v >> 24) & 0xff] ^
+        crc32c_table[3][(v >> 32) & 0xff] ^
+        crc32c_table[2][(v >> 40) & 0xff] ^
+        crc32c_table[1][(v >> 48) & 0xff] ^ crc32c_table[0][v >> 56];
 }
 
 static int find_flow_by_frag_info(gconstpointer a, gconstpointer b)
@@ -274,12 +649,26 @@ static guint16 clear_expired_frag_info(GList * frag_info_list, guint64 timestamp
     return cleared;
 }
 
+/* Fragments of a concurrent table are tracked by the stripe for their ID */
+static GInetFlowTable *frag_table(GInetFlowTable * table, guint32 id)
+{
+    return table->stripes ? table->stripes[id & (table->nstripes - 1)] : table;
+}
+
+/* Frames parsed without a table, only to route them to a shard, track no
+ * fragments and leave the ports of non-first fragments unset
+ */
 static gboolean store_frag_info(GInetFlowTable * table, GInetFlow * f, guint32 id)
 {
+    if (!table)
+        return TRUE;
     f->timestamp = f->timestamp ? : get_time_us();
+    table = frag_table(table, id);
+    stripe_lock(table);
     if (g_list_length(table->frag_info_list) >= MAX_FRAG_DEPTH) {
         if (clear_expired_frag_info(table->frag_info_list, f->timestamp) == 0) {
             DEBUG("Fragment tracking limit reached\n");
+            stripe_unlock(table);
             return FALSE;
         }
     }
@@ -288,191 +677,1522 @@ static gboolean store_frag_info(GInetFlowTable * table, GInetFlow * f, guint32 i
     memcpy(&(entry->tuple), &(f->tuple), sizeof(struct tuple));
     entry->timestamp = f->timestamp;
     table->frag_info_list = g_list_prepend(table->frag_info_list, entry);
+    stripe_unlock(table);
     return TRUE;
 }
 
+/* Non-first fragments take their ports from the first, the last one
+ * (MF unset) also cleans up
+ */
+static gboolean find_frag_info(GInetFlowTable * table, GInetFlow * f, guint32 id,
+                               gboolean last)
+{
+    struct frag_info entry = { };
+    GList *match;
+
+    if (!table)
+        return TRUE;
+    entry.id = id;
+    memcpy(&(entry.tuple), &(f->tuple), sizeof(struct tuple));
+    table = frag_table(table, id);
+    stripe_lock(table);
+    match = g_list_find_custom(table->frag_info_list, &entry, find_flow_by_frag_info);
+    if (match) {
+        struct frag_info *found_flow = match->data;
+        f->tuple.lower_port = found_flow->tuple.lower_port;
+        f->tuple.upper_port = found_flow->tuple.upper_port;
+        if (last) {
+            table->frag_info_list = g_list_remove(table->frag_info_list, found_flow);
+            free(found_flow);
+        }
+    }
+    stripe_unlock(table);
+    return match != NULL;
+}
+
 static guint32 get_hdr_len(guint8 hdr_ext_len)
 {
     return (hdr_ext_len + IPV6_FIRST_8_OCTETS) * EIGHT_OCTET_UNITS;
 }
 
-static guint16 flow_hash(GInetFlow * f)
+/* 64 bit finaliser from MurmurHash3 */
+static inline guint64 hash_fmix64(guint64 h)
+{
+    h ^= h >> 33;
+    h *= G_GUINT64_CONSTANT(0xff51afd7ed558ccd);
+    h ^= h >> 33;
+    h *= G_GUINT64_CONSTANT(0xc4ceb9fe1a85ec53);
+    h ^= h >> 33;
+    return h;
+}
+
+/* Cheap multiplicative mix of the whole tuple used to widen the CRC16 */
+static inline guint64 tuple_mix64(const struct tuple *t)
+{
+    guint64 h;
+
+    h = (((guint64) t->lower_ip[0] << 32) | t->lower_ip[1]) *
+        G_GUINT64_CONSTANT(0x9e3779b97f4a7c15);
+    h ^= (((guint64) t->lower_ip[2] << 32) | t->lower_ip[3]) *
+        G_GUINT64_CONSTANT(0xc2b2ae3d27d4eb4f);
+    h ^= (((guint64) t->upper_ip[0] << 32) | t->upper_ip[1]) *
+        G_GUINT64_CONSTANT(0x165667b19e3779f9);
+    h ^= (((guint64) t->upper_ip[2] << 32) | t->upper_ip[3]) *
+        G_GUINT64_CONSTANT(0xd6e8feb86659fd93);
+    h ^= (((guint64) t->protocol << 32) | ((guint64) t->lower_port << 16) | t->upper_port) *
+        G_GUINT64_CONSTANT(0x94d049bb133111eb);
+    return hash_fmix64(h);
+}
+
+/* Spread a 32 bit hash over 64 bits, keeping the original value in the low half */
+static inline guint64 hash_widen32(guint32 h)
+{
+    return ((guint64) (h * 0x9e3779b1U) << 32) | h;
+}
+
+/* The low 16 bits are the legacy CRC16 flow hash, the rest a 64 bit tuple mix */
+static inline guint64 hash_extend16(const struct tuple *t, guint16 h)
 {
-    if (f->hash)
-        return f->hash;
+    return (tuple_mix64(t) & ~G_GUINT64_CONSTANT(0xffff)) | h;
+}
 
+static guint64 flow_hash_crc16(GInetFlowTable * table, const struct tuple *t, guint family)
+{
     guint16 src_crc = 0xffff;
     guint16 dst_crc = 0xffff;
     guint16 prot_crc = 0xffff;
-    src_crc = crc16(src_crc, ((guint64) f->tuple.lower_ip[0]) << 32 | f->tuple.lower_ip[1]);
-    src_crc = crc16(src_crc, ((guint64) f->tuple.lower_ip[2]) << 32 | f->tuple.lower_ip[3]);
-    src_crc = crc16(src_crc, ((guint64) f->tuple.lower_port) << 48);
-    dst_crc = crc16(dst_crc, ((guint64) f->tuple.upper_ip[0]) << 32 | f->tuple.upper_ip[1]);
-    dst_crc = crc16(dst_crc, ((guint64) f->tuple.upper_ip[2]) << 32 | f->tuple.upper_ip[3]);
-    dst_crc = crc16(dst_crc, ((guint64) f->tuple.upper_port) << 48);
-    prot_crc = crc16(prot_crc, ((guint64) f->tuple.protocol) << 56);
-    f->hash = (src_crc ^ dst_crc ^ prot_crc);
-    g_printf("%s", "");
-    return f->hash;
+    src_crc = crc16(src_crc, ((guint64) t->lower_ip[0]) << 32 | t->lower_ip[1]);
+    src_crc = crc16(src_crc, ((guint64) t->lower_ip[2]) << 32 | t->lower_ip[3]);
+    src_crc = crc16(src_crc, ((guint64) t->lower_port) << 48);
+    dst_crc = crc16(dst_crc, ((guint64) t->upper_ip[0]) << 32 | t->upper_ip[1]);
+    dst_crc = crc16(dst_crc, ((guint64) t->upper_ip[2]) << 32 | t->upper_ip[3]);
+    dst_crc = crc16(dst_crc, ((guint64) t->upper_port) << 48);
+    prot_crc = crc16(prot_crc, ((guint64) t->protocol) << 56);
+    return hash_extend16(t, src_crc ^ dst_crc ^ prot_crc);
 }
 
-static gboolean flow_compare(GInetFlow * f1, GInetFlow * f2)
+/* The tuple as the 64 bit words fed to CRC32C and SipHash: two for IPv4,
+ * skipping the address words that are always zero, and five for IPv6.
+ * Word w is stored at m[w * stride] so that batches can be laid out by lane.
+ */
+#define TUPLE_WORDS_MAX     5
+static inline int tuple_words(const struct tuple *t, guint family, guint64 * m, int stride)
 {
-    if (f1->tuple.protocol != f2->tuple.protocol)
-        return FALSE;
-    if (f1->tuple.lower_port != f2->tuple.lower_port)
-        return FALSE;
-    if (f1->tuple.upper_port != f2->tuple.upper_port)
-        return FALSE;
-    if (memcmp(f1->tuple.upper_ip, f2->tuple.upper_ip, 16) != 0)
-        return FALSE;
-    if (memcmp(f1->tuple.lower_ip, f2->tuple.lower_ip, 16) != 0)
-        return FALSE;
-    return TRUE;
+    guint64 ports = t->protocol | ((guint64) t->lower_port << 16) |
+        ((guint64) t->upper_port << 32);
+
+    if (family == G_SOCKET_FAMILY_IPV4) {
+        m[0] = t->lower_ip[0] | ((guint64) t->upper_ip[0] << 32);
+        m[stride] = ports;
+        return 2;
+    }
+    m[0 * stride] = t->lower_ip[0] | ((guint64) t->lower_ip[1] << 32);
+    m[1 * stride] = t->lower_ip[2] | ((guint64) t->lower_ip[3] << 32);
+    m[2 * stride] = t->upper_ip[0] | ((guint64) t->upper_ip[1] << 32);
+    m[3 * stride] = t->upper_ip[2] | ((guint64) t->upper_ip[3] << 32);
+    m[4 * stride] = ports;
+    return 5;
 }
 
-static gboolean flow_parse_tcp(GInetFlow * f, const guint8 * data, guint32 length)
+/* CRC32C over the tuple words. The same words are fed to the software
+ * tables and to the CPU instructions.
+ */
+#define CRC32C_TUPLE(__step, __t, __family) ({                                      \
+    guint64 __m[TUPLE_WORDS_MAX];                                                   \
+    int __n = tuple_words(__t, __family, __m, 1);                                   \
+    guint32 __crc = 0xffffffff;                                                     \
+    int __i;                                                                        \
+    for (__i = 0; __i < __n; __i++)                                                 \
+        __crc = __step(__crc, __m[__i]);                                            \
+    ~__crc;                                                                         \
+})
+
+static guint64 flow_hash_crc32c_sw(GInetFlowTable * table, const struct tuple *t,
+                                   guint family)
 {
-    tcp_hdr_t *tcp = (tcp_hdr_t *) data;
-    if (length < sizeof(tcp_hdr_t))
-        return FALSE;
-    guint16 sport = GUINT16_FROM_BE(tcp->source);
-    guint16 dport = GUINT16_FROM_BE(tcp->destination);
-    if (sport < dport) {
-        f->tuple.lower_port = sport;
-        f->tuple.upper_port = dport;
-        f->direction = 1;
-    } else {
-        f->tuple.upper_port = sport;
-        f->tuple.lower_port = dport;
-        f->direction = 0;
-    }
-    f->flags = GUINT16_FROM_BE(tcp->flags);
-    return TRUE;
+    return hash_widen32(CRC32C_TUPLE(crc32c_u64_sw, t, family));
 }
 
-static gboolean flow_parse_udp(GInetFlow * f, const guint8 * data, guint32 length)
+#if defined(__x86_64__)
+__attribute__ ((target("sse4.2")))
+static guint64 flow_hash_crc32c_sse42(GInetFlowTable * table, const struct tuple *t,
+                                      guint family)
 {
-    udp_hdr_t *udp = (udp_hdr_t *) data;
-    if (length < sizeof(udp_hdr_t))
-        return FALSE;
-    guint16 sport = GUINT16_FROM_BE(udp->source);
-    guint16 dport = GUINT16_FROM_BE(udp->destination);
-    if (sport < dport) {
-        f->tuple.lower_port = sport;
-        f->tuple.upper_port = dport;
-        f->direction = 1;
-    } else {
-        f->tuple.upper_port = sport;
-        f->tuple.lower_port = dport;
-        f->direction = 0;
+    return hash_widen32(CRC32C_TUPLE(_mm_crc32_u64, t, family));
+}
+#elif defined(__aarch64__)
+__attribute__ ((target("+crc")))
+static guint64 flow_hash_crc32c_armv8(GInetFlowTable * table, const struct tuple *t,
+                                      guint family)
+{
+    return hash_widen32(CRC32C_TUPLE(__builtin_aarch64_crc32cx, t, family));
+}
+#endif
+
+/* Symmetric RSS key: repeating every 16 bits makes the hash independent of
+ * the order of addresses and ports, so both directions of a flow agree.
+ */
+static const guint8 toeplitz_default_key[G_INET_FLOW_HASH_KEY_MAX] = {
+    0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d,
+    0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a,
+    0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d,
+    0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a,
+};
+
+/* 32 bits of the key starting at the given bit offset */
+static guint32 toeplitz_window(const guint8 * key, int bit)
+{
+    guint64 k = 0;
+    int i;
+
+    for (i = 0; i < 5; i++) {
+        int byte = bit / 8 + i;
+        k = (k << 8) | (byte < G_INET_FLOW_HASH_KEY_MAX ? key[byte] : 0);
     }
-    return TRUE;
+    return (guint32) (k >> (8 - bit % 8));
 }
 
-static gboolean flow_parse_sctp(GInetFlow * f, const guint8 * data, guint32 length)
+/* Precompute the XOR of key windows for every value of every input byte */
+static void toeplitz_init(GInetFlowTable * table)
 {
-    sctp_hdr_t *sctp = (sctp_hdr_t *) data;
-    if (length < sizeof(sctp_hdr_t))
-        return FALSE;
-    guint16 sport = GUINT16_FROM_BE(sctp->source);
-    guint16 dport = GUINT16_FROM_BE(sctp->destination);
-    if (sport < dport) {
-        f->tuple.lower_port = sport;
-        f->tuple.upper_port = dport;
-    } else {
-        f->tuple.upper_port = sport;
-        f->tuple.lower_port = dport;
+    guint32 window[8];
+    int pos;
+    int bit;
+    int v;
+
+    if (!table->toeplitz)
+        table->toeplitz = g_malloc(TOEPLITZ_INPUT_MAX * 256 * sizeof(guint32));
+    for (pos = 0; pos < TOEPLITZ_INPUT_MAX; pos++) {
+        for (bit = 0; bit < 8; bit++)
+            window[bit] = toeplitz_window(table->hash_key, pos * 8 + bit);
+        for (v = 0; v < 256; v++) {
+            guint32 h = 0;
+            for (bit = 0; bit < 8; bit++) {
+                if (v & (0x80 >> bit))
+                    h ^= window[bit];
+            }
+            table->toeplitz[pos * 256 + v] = h;
+        }
     }
-    return TRUE;
 }
 
-static gboolean flow_parse_ipv4(GInetFlow * f, const guint8 * data, guint32 length,
-                                GInetFlowTable * table)
+/* Toeplitz hash as computed by NIC RSS over addresses then ports, all in
+ * network byte order. The value is not widened so that it matches a hash
+ * handed in from the NIC.
+ */
+static guint64 flow_hash_toeplitz(GInetFlowTable * table, const struct tuple *t,
+                                  guint family)
 {
-    ip_hdr_t *iph = (ip_hdr_t *) data;
-    if (length < sizeof(ip_hdr_t))
-        return FALSE;
-    guint32 sip = GINT32_FROM_BE(iph->saddr);
-    guint32 dip = GINT32_FROM_BE(iph->daddr);
-    if (sip < dip) {
-        f->tuple.lower_ip[0] = iph->saddr;
-        f->tuple.upper_ip[0] = iph->daddr;
-    } else {
-        f->tuple.upper_ip[0] = iph->saddr;
-        f->tuple.lower_ip[0] = iph->daddr;
+    const guint32 *lut = table->toeplitz;
+    const guint8 *lip = (const guint8 *) t->lower_ip;
+    const guint8 *uip = (const guint8 *) t->upper_ip;
+    int len = family == G_SOCKET_FAMILY_IPV6 ? 16 : 4;
+    guint32 h = 0;
+    int i;
+
+    for (i = 0; i < len; i++) {
+        h ^= lut[i * 256 + lip[i]];
+        h ^= lut[(len + i) * 256 + uip[i]];
     }
-    f->tuple.protocol = iph->protocol;
+    if (table->hash_fields == G_INET_FLOW_HASH_FIELDS_4TUPLE) {
+        lut += 2 * len * 256;
+        h ^= lut[0 * 256 + (t->lower_port >> 8)];
+        h ^= lut[1 * 256 + (t->lower_port & 0xff)];
+        h ^= lut[2 * 256 + (t->upper_port >> 8)];
+        h ^= lut[3 * 256 + (t->upper_port & 0xff)];
+    }
+    return h;
+}
 
-    /* Non-first IP fragments (frag_offset is non-zero) will need a look-up
-     * to find sport and dport
-     */
-    if ((GUINT16_FROM_BE(iph->frag_off) & 0x1FFF) != 0) {
-        struct frag_info entry = { };
-        entry.id = iph->id;
-        memcpy(&(entry.tuple), &(f->tuple), sizeof(struct tuple));
-
-        GList *match =
-            g_list_find_custom(table->frag_info_list, &entry, find_flow_by_frag_info);
-        if (!match)
-            return FALSE;
+#define SIP_ROTL(__x, __b) (((__x) << (__b)) | ((__x) >> (64 - (__b))))
+#define SIP_ROUND(__v) do {                                                         \
+    __v[0] += __v[1]; __v[1] = SIP_ROTL(__v[1], 13); __v[1] ^= __v[0];             \
+    __v[0] = SIP_ROTL(__v[0], 32);                                                  \
+    __v[2] += __v[3]; __v[3] = SIP_ROTL(__v[3], 16); __v[3] ^= __v[2];             \
+    __v[0] += __v[3]; __v[3] = SIP_ROTL(__v[3], 21); __v[3] ^= __v[0];             \
+    __v[2] += __v[1]; __v[1] = SIP_ROTL(__v[1], 17); __v[1] ^= __v[2];             \
+    __v[2] = SIP_ROTL(__v[2], 32);                                                  \
+} while (0)
 
-        struct frag_info *found_flow = match->data;
-        f->tuple.lower_port = found_flow->tuple.lower_port;
-        f->tuple.upper_port = found_flow->tuple.upper_port;
+/* SipHash with c compression and d finalisation rounds over whole 64 bit
+ * words. Rounds are constants at every call site so the loops unroll.
+ */
+static inline guint64 siphash(const guint64 key[2], const guint64 * m, int n, int c,
+                              int d)
+{
+    guint64 v[4];
+    guint64 b = ((guint64) n * 8) << 56;
+    int i;
+    int r;
 
-        /* If this is the last IP fragment (MF is unset), clean up */
-        if ((GUINT16_FROM_BE(iph->frag_off) & 0x2000) == 0) {
-            table->frag_info_list = g_list_remove(table->frag_info_list, found_flow);
-            free(found_flow);
-        }
-        return TRUE;
+    v[0] = key[0] ^ G_GUINT64_CONSTANT(0x736f6d6570736575);
+    v[1] = key[1] ^ G_GUINT64_CONSTANT(0x646f72616e646f6d);
+    v[2] = key[0] ^ G_GUINT64_CONSTANT(0x6c7967656e657261);
+    v[3] = key[1] ^ G_GUINT64_CONSTANT(0x7465646279746573);
+    for (i = 0; i <= n; i++) {
+        guint64 w = i < n ? m[i] : b;
+        v[3] ^= w;
+        for (r = 0; r < c; r++)
+            SIP_ROUND(v);
+        v[0] ^= w;
     }
+    v[2] ^= 0xff;
+    for (r = 0; r < d; r++)
+        SIP_ROUND(v);
+    return v[0] ^ v[1] ^ v[2] ^ v[3];
+}
 
-    switch (iph->protocol) {
-    case IP_PROTOCOL_TCP:
-        if (!flow_parse_tcp(f, data + sizeof(ip_hdr_t), length - sizeof(ip_hdr_t)))
-            return FALSE;
-        break;
-    case IP_PROTOCOL_UDP:
-        if (!flow_parse_udp(f, data + sizeof(ip_hdr_t), length - sizeof(ip_hdr_t)))
-            return FALSE;
-        break;
-    case IP_PROTOCOL_ICMP:
-    default:
-        f->tuple.lower_port = 0;
-        f->tuple.upper_port = 0;
-        break;
-    }
+/* Keyed SipHash-1-3 over the same words as the CRC32C hash. The seed is
+ * per table so colliding tuples cannot be worked out offline.
+ */
+static guint64 flow_hash_siphash(GInetFlowTable * table, const struct tuple *t,
+                                 guint family)
+{
+    guint64 m[TUPLE_WORDS_MAX];
+    int n = tuple_words(t, family, m, 1);
 
-    /* Store ID and tuple if the packet is a first IP fragment (MF set and frag_off is zero) */
-    if (((GUINT16_FROM_BE(iph->frag_off) & 0x2000) != 0) &&
-        ((GUINT16_FROM_BE(iph->frag_off) & 0x1FFF) == 0)) {
-        return store_frag_info(table, f, iph->id);
-    }
+    return siphash(table->sip_key, m, n, 1, 3);
+}
 
-    return TRUE;
+/* Batch hashing falls back to one flow at a time */
+static void flow_hash_batch_scalar(GInetFlowTable * table, GInetFlow ** f, guint count)
+{
+    guint i;
+
+    for (i = 0; i < count; i++)
+        f[i]->hash = table->hash_fn(table, &f[i]->tuple, f[i]->family);
 }
 
-static gboolean flow_parse_ipv6(GInetFlow * f, const guint8 * data, guint32 length,
-                                GInetFlowTable * table)
+#if defined(__x86_64__)
+/* Four independent CRC chains hide the latency of the crc32 instruction */
+__attribute__ ((target("sse4.2")))
+static void flow_hash_batch_crc32c_sse42(GInetFlowTable * table, GInetFlow ** f,
+                                         guint count)
 {
-    ip6_hdr_t *iph = (ip6_hdr_t *) data;
-    frag_hdr_t *fragment_hdr = NULL;
-    auth_hdr_t *auth_hdr;
-    ipv6_partial_ext_hdr_t *ipv6_part_hdr;
+    guint i;
 
-    if (length < sizeof(ip6_hdr_t))
-        return FALSE;
-    if (memcmp(iph->saddr, iph->daddr, 16) < 0) {
-        memcpy(f->tuple.lower_ip, iph->saddr, 16);
-        memcpy(f->tuple.upper_ip, iph->daddr, 16);
-    } else {
-        memcpy(f->tuple.upper_ip, iph->saddr, 16);
-        memcpy(f->tuple.lower_ip, iph->daddr, 16);
+    for (i = 0; i + 4 <= count; i += 4) {
+        guint32 c0 = CRC32C_TUPLE(_mm_crc32_u64, &f[i]->tuple, f[i]->family);
+        guint32 c1 = CRC32C_TUPLE(_mm_crc32_u64, &f[i + 1]->tuple, f[i + 1]->family);
+        guint32 c2 = CRC32C_TUPLE(_mm_crc32_u64, &f[i + 2]->tuple, f[i + 2]->family);
+        guint32 c3 = CRC32C_TUPLE(_mm_crc32_u64, &f[i + 3]->tuple, f[i + 3]->family);
+        f[i]->hash = hash_widen32(c0);
+        f[i + 1]->hash = hash_widen32(c1);
+        f[i + 2]->hash = hash_widen32(c2);
+        f[i + 3]->hash = hash_widen32(c3);
     }
-    f->tuple.protocol = iph->next_hdr;
-    data += sizeof(ip6_hdr_t);
+    for (; i < count; i++)
+        f[i]->hash = flow_hash_crc32c_sse42(table, &f[i]->tuple, f[i]->family);
+}
+
+#define SIP_ROUND_LANES(__v, __add, __xor, __rotl) do {                             \
+    __v[0] = __add(__v[0], __v[1]); __v[1] = __rotl(__v[1], 13);                    \
+    __v[1] = __xor(__v[1], __v[0]); __v[0] = __rotl(__v[0], 32);                    \
+    __v[2] = __add(__v[2], __v[3]); __v[3] = __rotl(__v[3], 16);                    \
+    __v[3] = __xor(__v[3], __v[2]);                                                 \
+    __v[0] = __add(__v[0], __v[3]); __v[3] = __rotl(__v[3], 21);                    \
+    __v[3] = __xor(__v[3], __v[0]);                                                 \
+    __v[2] = __add(__v[2], __v[1]); __v[1] = __rotl(__v[1], 17);                    \
+    __v[1] = __xor(__v[1], __v[2]); __v[2] = __rotl(__v[2], 32);                    \
+} while (0)
+
+/* SipHash-1-3 of __n flows with __words each, one per 64 bit vector lane.
+ * Matches siphash().
+ */
+#define SIPHASH13_LANES(__n, __words, __key, __f, __set1, __load, __store, __add, __xor,  \
+                        __rotl) do {                                                \
+    guint64 __m[TUPLE_WORDS_MAX][__n];                                              \
+    typeof(__set1(0)) __v[4];                                                       \
+    typeof(__set1(0)) __x;                                                          \
+    int __w;                                                                        \
+    int __l;                                                                        \
+    for (__l = 0; __l < __n; __l++)                                                 \
+        tuple_words(&(__f)[__l]->tuple, (__f)[__l]->family, &__m[0][__l], __n);     \
+    __v[0] = __set1((__key)[0] ^ G_GUINT64_CONSTANT(0x736f6d6570736575));           \
+    __v[1] = __set1((__key)[1] ^ G_GUINT64_CONSTANT(0x646f72616e646f6d));           \
+    __v[2] = __set1((__key)[0] ^ G_GUINT64_CONSTANT(0x6c7967656e657261));           \
+    __v[3] = __set1((__key)[1] ^ G_GUINT64_CONSTANT(0x7465646279746573));           \
+    for (__w = 0; __w <= (__words); __w++) {                                        \
+        __x = __w < (__words) ? __load(__m[__w]) : __set1((guint64) (__words) << 59); \
+        __v[3] = __xor(__v[3], __x);                                                \
+        SIP_ROUND_LANES(__v, __add, __xor, __rotl);                                 \
+        __v[0] = __xor(__v[0], __x);                                                \
+    }                                                                               \
+    __v[2] = __xor(__v[2], __set1(0xff));                                           \
+    SIP_ROUND_LANES(__v, __add, __xor, __rotl);                                     \
+    SIP_ROUND_LANES(__v, __add, __xor, __rotl);                                     \
+    SIP_ROUND_LANES(__v, __add, __xor, __rotl);                                     \
+    __x = __xor(__xor(__v[0], __v[1]), __xor(__v[2], __v[3]));                      \
+    __store(__m[0], __x);                                                           \
+    for (__l = 0; __l < __n; __l++)                                                 \
+        (__f)[__l]->hash = __m[0][__l];                                             \
+} while (0)
+
+typedef void (*siphash_lanes_fn) (GInetFlowTable * table, GInetFlow ** f, int words);
+
+/* Vector lanes must hash messages of one length, so each chunk of the batch
+ * is split into its IPv4 and IPv6 flows first.
+ */
+static void siphash_batch_grouped(GInetFlowTable * table, GInetFlow ** f, guint count,
+                                  guint lanes, siphash_lanes_fn lanes_fn)
+{
+    GInetFlow *group[2][FLOW_BATCH_MAX];
+    guint n[2];
+    guint done;
+    guint i;
+    int g;
+
+    for (done = 0; done < count; done += i) {
+        n[0] = n[1] = 0;
+        for (i = 0; i < FLOW_BATCH_MAX && done + i < count; i++) {
+            g = f[done + i]->family != G_SOCKET_FAMILY_IPV4;
+            group[g][n[g]++] = f[done + i];
+        }
+        for (g = 0; g < 2; g++) {
+            guint j;
+            for (j = 0; j + lanes <= n[g]; j += lanes)
+                lanes_fn(table, group[g] + j, g ? 5 : 2);
+            for (; j < n[g]; j++)
+                group[g][j]->hash = flow_hash_siphash(table, &group[g][j]->tuple,
+                                                      group[g][j]->family);
+        }
+    }
+}
+
+#define AVX2_SET1(__x)      _mm256_set1_epi64x(__x)
+#define AVX2_LOAD(__p)      _mm256_loadu_si256((const __m256i *) (__p))
+#define AVX2_STORE(__p, __x) _mm256_storeu_si256((__m256i *) (__p), __x)
+#define AVX2_ROTL(__x, __b) \
+    _mm256_or_si256(_mm256_slli_epi64(__x, __b), _mm256_srli_epi64(__x, 64 - (__b)))
+
+__attribute__ ((target("avx2")))
+static void siphash_lanes_avx2(GInetFlowTable * table, GInetFlow ** f, int words)
+{
+    SIPHASH13_LANES(4, words, table->sip_key, f, AVX2_SET1, AVX2_LOAD, AVX2_STORE,
+                    _mm256_add_epi64, _mm256_xor_si256, AVX2_ROTL);
+}
+
+static void flow_hash_batch_siphash_avx2(GInetFlowTable * table, GInetFlow ** f,
+                                         guint count)
+{
+    siphash_batch_grouped(table, f, count, 4, siphash_lanes_avx2);
+}
+
+#define AVX512_SET1(__x)    _mm512_set1_epi64(__x)
+#define AVX512_LOAD(__p)    _mm512_loadu_si512(__p)
+#define AVX512_STORE(__p, __x) _mm512_storeu_si512(__p, __x)
+
+__attribute__ ((target("avx512f")))
+static void siphash_lanes_avx512(GInetFlowTable * table, GInetFlow ** f, int words)
+{
+    SIPHASH13_LANES(8, words, table->sip_key, f, AVX512_SET1, AVX512_LOAD, AVX512_STORE,
+                    _mm512_add_epi64, _mm512_xor_si512, _mm512_rol_epi64);
+}
+
+static void flow_hash_batch_siphash_avx512(GInetFlowTable * table, GInetFlow ** f,
+                                           guint count)
+{
+    siphash_batch_grouped(table, f, count, 8, siphash_lanes_avx512);
+}
+#endif
+
+/* Best CRC32C implementation for this CPU, chosen once at class init */
+static flow_hash_fn crc32c_impl = flow_hash_crc32c_sw;
+static const gchar *crc32c_impl_name = "crc32c-sw";
+static flow_hash_batch_fn crc32c_batch_impl = flow_hash_batch_scalar;
+static flow_hash_batch_fn siphash_batch_impl = flow_hash_batch_scalar;
+
+static void hash_init(void)
+{
+    crc16_init();
+    crc32c_init();
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc32c_impl = flow_hash_crc32c_sse42;
+        crc32c_impl_name = "crc32c-sse4.2";
+        crc32c_batch_impl = flow_hash_batch_crc32c_sse42;
+    }
+    if (__builtin_cpu_supports("avx512f"))
+        siphash_batch_impl = flow_hash_batch_siphash_avx512;
+    else if (__builtin_cpu_supports("avx2"))
+        siphash_batch_impl = flow_hash_batch_siphash_avx2;
+#elif defined(__aarch64__)
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+        crc32c_impl = flow_hash_crc32c_armv8;
+        crc32c_impl_name = "crc32c-armv8";
+    }
+#endif
+}
+
+static const gchar *flow_hash_name(GInetFlowTable * table)
+{
+    switch (table->hash_type) {
+    case G_INET_FLOW_HASH_CRC32C:
+        return crc32c_impl_name;
+    case G_INET_FLOW_HASH_TOEPLITZ:
+        return "toeplitz";
+    case G_INET_FLOW_HASH_SIPHASH:
+        return "siphash13";
+    case G_INET_FLOW_HASH_CRC16:
+    default:
+        return "crc16";
+    }
+}
+
+static guint64 flow_hash64(GInetFlowTable * table, GInetFlow * f)
+{
+    if (!f->hash)
+        f->hash = table->hash_fn(table, &f->tuple, f->family);
+    return f->hash;
+}
+
+/* GHashTable bucket hash. Flows always carry their 64 bit hash by now */
+static guint flow_hash(GInetFlow * f)
+{
+    return (guint) (f->hash ^ (f->hash >> 32));
+}
+
+static inline gboolean flow_compare_scalar(GInetFlow * f1, GInetFlow * f2)
+{
+    if (f1->tuple.protocol != f2->tuple.protocol)
+        return FALSE;
+    if (f1->tuple.lower_port != f2->tuple.lower_port)
+        return FALSE;
+    if (f1->tuple.upper_port != f2->tuple.upper_port)
+        return FALSE;
+    if (memcmp(f1->tuple.upper_ip, f2->tuple.upper_ip, 16) != 0)
+        return FALSE;
+    if (memcmp(f1->tuple.lower_ip, f2->tuple.lower_ip, 16) != 0)
+        return FALSE;
+    return TRUE;
+}
+
+/* SSE2 is part of x86-64, so the whole key is compared without branches:
+ * protocol and ports in one masked word (leaving out the padding after
+ * them) and each address in one 128 bit compare.
+ */
+static gboolean flow_compare(GInetFlow * f1, GInetFlow * f2)
+{
+#if defined(__SSE2__)
+    guint64 w1, w2;
+    __m128i l, u;
+
+    memcpy(&w1, &f1->tuple, sizeof(w1));
+    memcpy(&w2, &f2->tuple, sizeof(w2));
+    l = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) f1->tuple.lower_ip),
+                       _mm_loadu_si128((const __m128i *) f2->tuple.lower_ip));
+    u = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) f1->tuple.upper_ip),
+                       _mm_loadu_si128((const __m128i *) f2->tuple.upper_ip));
+    return ((w1 ^ w2) & G_GUINT64_CONSTANT(0xffffffffffff)) == 0 &&
+        _mm_movemask_epi8(_mm_and_si128(l, u)) == 0xffff;
+#else
+    return flow_compare_scalar(f1, f2);
+#endif
+}
+
+/* Multiplicative remix so that hashes which only fill their low bits (CRC16
+ * or a NIC supplied value) still spread over the high bits used as index.
+ */
+static inline guint64 bucket_mix(guint64 hash)
+{
+    return hash * G_GUINT64_CONSTANT(0x9e3779b97f4a7c15);
+}
+
+/* Occupied slots always have the top bit set, empty slots are zero */
+static inline guint8 bucket_tag(guint64 mixed)
+{
+    return 0x80 | (mixed & 0x7f);
+}
+
+/* Bit mask of the slots holding tag. Candidates are confirmed by comparing
+ * the flow, so the carry false positives of the SWAR form are harmless.
+ */
+static inline guint group_match_swar(guint64 w, guint8 tag)
+{
+    w ^= G_GUINT64_CONSTANT(0x0101010101010101) * tag;
+    w = (w - G_GUINT64_CONSTANT(0x0101010101010101)) & ~w &
+        G_GUINT64_CONSTANT(0x8080808080808080);
+    /* Gather the top bit of each byte into the low byte */
+    return (((w >> 7) * G_GUINT64_CONSTANT(0x0102040810204080)) >> 56) & 0x7f;
+}
+
+static inline guint group_match(guint64 group, guint8 tag)
+{
+#if defined(__x86_64__)
+    __m128i tags = _mm_cvtsi64_si128(group);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(tags, _mm_set1_epi8(tag))) & 0x7f;
+#else
+    return group_match_swar(group, tag);
+#endif
+}
+
+static inline guint bucket_match_swar(const struct flow_bucket *b, guint8 tag)
+{
+    return group_match_swar(b->group, tag);
+}
+
+static inline guint bucket_match(const struct flow_bucket *b, guint8 tag)
+{
+    return group_match(b->group, tag);
+}
+
+#define HUGE_PAGE_2MB       (G_GSIZE_CONSTANT(2) << 20)
+#define HUGE_PAGE_1GB       (G_GSIZE_CONSTANT(1) << 30)
+/* Older C libraries leave these to <linux/mman.h> */
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT      26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB        (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB        (30 << MAP_HUGE_SHIFT)
+#endif
+
+/* Explicit huge pages, 1GB ones only for allocations that fill one, then a
+ * 2MB aligned mapping advised to use transparent huge pages. page_size is
+ * the page size asked for, which transparent huge pages only honour on a
+ * best effort basis.
+ */
+static gpointer huge_map(gsize size, gsize * length, gsize * page_size)
+{
+#if defined(MAP_HUGETLB) && defined(MADV_HUGEPAGE)
+    const gsize pages[] = { HUGE_PAGE_1GB, HUGE_PAGE_2MB };
+    const int flags[] = { MAP_HUGE_1GB, MAP_HUGE_2MB };
+    guint8 *mem;
+    guint8 *start;
+    gsize len;
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS(pages); i++) {
+        if (size < pages[i] && pages[i] == HUGE_PAGE_1GB)
+            continue;
+        len = (size + pages[i] - 1) & ~(pages[i] - 1);
+        mem = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | flags[i], -1, 0);
+        if (mem != MAP_FAILED) {
+            *length = len;
+            *page_size = pages[i];
+            return mem;
+        }
+    }
+
+    /* Over map so the start can be trimmed to a 2MB boundary */
+    len = (size + HUGE_PAGE_2MB - 1) & ~(HUGE_PAGE_2MB - 1);
+    mem = mmap(NULL, len + HUGE_PAGE_2MB, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+        return NULL;
+    start = (guint8 *) (((guintptr) mem + HUGE_PAGE_2MB - 1) &
+                        ~(guintptr) (HUGE_PAGE_2MB - 1));
+    if (start != mem)
+        munmap(mem, start - mem);
+    munmap(start + len, HUGE_PAGE_2MB - (start - mem));
+    if (madvise(start, len, MADV_HUGEPAGE) == 0)
+        *page_size = HUGE_PAGE_2MB;
+    *length = len;
+    return start;
+#else
+    return NULL;
+#endif
+}
+
+/* Prefer node for the pages of a fresh mapping, before anything touches
+ * them. Unbound memory lands on the node of the thread that first touches
+ * each page.
+ */
+#define NUMA_NODES_MAX      64
+#define NUMA_MPOL_PREFERRED 1
+static void numa_bind(gpointer mem, gsize length, int node)
+{
+#if defined(SYS_mbind)
+    unsigned long mask = 1UL << node;
+
+    if (syscall(SYS_mbind, mem, length, NUMA_MPOL_PREFERRED, &mask,
+                (unsigned long) NUMA_NODES_MAX + 1, 0) != 0)
+        g_warning("Failed to bind flow memory to NUMA node %d", node);
+#endif
+}
+
+/* Zeroed memory for the index and record slabs, from huge pages when asked
+ * and bound to a NUMA node when one is given. length is the size of the
+ * mapping to unmap, or 0 when the memory came from calloc.
+ */
+static gpointer flow_mem_alloc(gboolean huge, int node, gsize size, gsize * length,
+                               gsize * page_size)
+{
+    guint8 *mem = NULL;
+
+    *length = 0;
+    *page_size = sysconf(_SC_PAGESIZE);
+    if (huge)
+        mem = huge_map(size, length, page_size);
+    if (!mem && node >= 0) {
+        *length = (size + *page_size - 1) & ~(*page_size - 1);
+        mem = mmap(NULL, *length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                   -1, 0);
+        if (mem == MAP_FAILED) {
+            *length = 0;
+            mem = NULL;
+        }
+    }
+    if (!mem)
+        return calloc(1, size);
+    if (node >= 0)
+        numa_bind(mem, *length, node);
+    return mem;
+}
+
+static void flow_mem_free(gpointer mem, gsize length)
+{
+    if (length)
+        munmap(mem, length);
+    else
+        free(mem);
+}
+
+/* calloc rather than an aligned allocation and memset: large arrays come
+ * straight from the kernel already zeroed, so growing costs no O(n) clear.
+ */
+static void buckets_init(struct bucket_array *s, guint64 nbuckets)
+{
+    G_STATIC_ASSERT(sizeof(struct flow_bucket4) == sizeof(struct flow_bucket));
+    guintptr align = sizeof(struct flow_bucket) - 1;
+
+    s->mem = flow_mem_alloc(s->huge, s->node, (nbuckets + 1) * sizeof(struct flow_bucket),
+                            &s->length, &s->page_size);
+    if (!s->mem)
+        g_error("Failed to allocate %" G_GUINT64_FORMAT " flow buckets", nbuckets);
+    s->buckets = (struct flow_bucket *) (((guintptr) s->mem + align) & ~align);
+    s->mask = nbuckets - 1;
+    s->shift = 64 - g_bit_storage(s->mask);
+    s->size = 0;
+}
+
+static void buckets_free(struct bucket_array *s)
+{
+    flow_mem_free(s->mem, s->length);
+    s->mem = NULL;
+    s->buckets = NULL;
+}
+
+/* Churn and saturated overflow counts can leave every bucket marked, so
+ * probes give up after one pass over the array. Shared probes run beside
+ * the writer: they load the tags and overflow count relaxed, and acquire
+ * each flow pointer, which orders it after the flow's tuple.
+ */
+static inline GInetFlow *swiss_probe(struct bucket_array *s, GInetFlow * packet,
+                                     gboolean shared)
+{
+    guint64 mixed = bucket_mix(packet->hash);
+    guint64 i = mixed >> s->shift;
+    guint8 tag = bucket_tag(mixed);
+    guint64 probes;
+
+    for (probes = 0; probes <= s->mask; probes++) {
+        struct flow_bucket *b = &s->buckets[i];
+        guint m = group_match(shared ? __atomic_load_n(&b->group, __ATOMIC_RELAXED) :
+                              b->group, tag);
+        while (m) {
+            GInetFlow **slot = &b->flows[__builtin_ctz(m)];
+            GInetFlow *f = shared ? __atomic_load_n(slot, __ATOMIC_ACQUIRE) : *slot;
+            /* Only the hot line is read, the hash is not compared. Lock-free
+             * readers can find a tagged slot whose flow is not set yet.
+             */
+            if (f && flow_compare(f, packet))
+                return f;
+            m &= m - 1;
+        }
+        if (!(shared ? __atomic_load_n(&b->overflow, __ATOMIC_RELAXED) : b->overflow))
+            return NULL;
+        i = (i + 1) & s->mask;
+    }
+    return NULL;
+}
+
+static GInetFlow *swiss_lookup(struct bucket_array *s, GInetFlow * packet)
+{
+    return swiss_probe(s, packet, FALSE);
+}
+
+static void swiss_place(struct bucket_array *s, GInetFlow * flow)
+{
+    guint64 mixed = bucket_mix(flow->hash);
+    guint64 i = mixed >> s->shift;
+
+    for (;;) {
+        struct flow_bucket *b = &s->buckets[i];
+        guint m = bucket_match(b, 0);
+        if (m) {
+            int slot = __builtin_ctz(m);
+            __atomic_store_n(&b->tags[slot], bucket_tag(mixed), __ATOMIC_RELAXED);
+            /* Publishes the flow to lock-free readers */
+            __atomic_store_n(&b->flows[slot], flow, __ATOMIC_RELEASE);
+            s->size++;
+            return;
+        }
+        /* Saturated counts are never decremented, lookups just probe on */
+        if (b->overflow != G_MAXUINT8)
+            __atomic_store_n(&b->overflow, b->overflow + 1, __ATOMIC_RELAXED);
+        i = (i + 1) & s->mask;
+    }
+}
+
+/* Keep at most 7/8 of the slots in use */
+static inline gboolean swiss_full(struct bucket_array *s)
+{
+    return (s->size + 1) * 8 > (s->mask + 1) * BUCKET_SLOTS * 7;
+}
+
+/* The grown array is filled aside and then swapped in under the sequence
+ * count, so lock-free readers see either the old array or the new one
+ * complete. The old array is returned in old for the caller to free.
+ */
+static void swiss_grow(struct bucket_array *s, struct bucket_array *old)
+{
+    struct bucket_array grown = {.huge = s->huge,.node = s->node };
+    guint seq = s->seq;
+    guint64 i;
+    int slot;
+
+    buckets_init(&grown, (s->mask + 1) * 2);
+    for (i = 0; i <= s->mask; i++) {
+        for (slot = 0; slot < BUCKET_SLOTS; slot++) {
+            if (s->buckets[i].tags[slot])
+                swiss_place(&grown, s->buckets[i].flows[slot]);
+        }
+    }
+    *old = *s;
+    __atomic_store_n(&s->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    /* Readers copy the array, mask and shift while the count is odd */
+    __atomic_store_n(&s->buckets, grown.buckets, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->mask, grown.mask, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->shift, grown.shift, __ATOMIC_RELAXED);
+    s->mem = grown.mem;
+    s->size = grown.size;
+    s->length = grown.length;
+    s->page_size = grown.page_size;
+    __atomic_store_n(&s->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static void swiss_insert(struct bucket_array *s, GInetFlow * flow)
+{
+    if (swiss_full(s)) {
+        struct bucket_array old;
+
+        swiss_grow(s, &old);
+        buckets_free(&old);
+    }
+    swiss_place(s, flow);
+}
+
+/* Lookup without the stripe lock, on a consistent view of the array */
+static GInetFlow *swiss_lookup_shared(struct bucket_array *s, GInetFlow * packet)
+{
+    struct bucket_array view;
+    guint seq;
+
+    do {
+        seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+        view.buckets = __atomic_load_n(&s->buckets, __ATOMIC_RELAXED);
+        view.mask = __atomic_load_n(&s->mask, __ATOMIC_RELAXED);
+        view.shift = __atomic_load_n(&s->shift, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || seq != __atomic_load_n(&s->seq, __ATOMIC_RELAXED));
+    return swiss_probe(&view, packet, TRUE);
+}
+
+static gboolean swiss_remove(struct bucket_array *s, GInetFlow * flow)
+{
+    guint64 mixed = bucket_mix(flow->hash);
+    guint64 home = mixed >> s->shift;
+    guint8 tag = bucket_tag(mixed);
+    guint64 i = home;
+    guint64 probes;
+
+    for (probes = 0; probes <= s->mask; probes++) {
+        struct flow_bucket *b = &s->buckets[i];
+        guint m = bucket_match(b, tag);
+        while (m) {
+            int slot = __builtin_ctz(m);
+            if (b->flows[slot] == flow) {
+                __atomic_store_n(&b->tags[slot], 0, __ATOMIC_RELAXED);
+                __atomic_store_n(&b->flows[slot], NULL, __ATOMIC_RELAXED);
+                s->size--;
+                /* Undo the overflow counts taken when it was inserted */
+                for (; home != i; home = (home + 1) & s->mask) {
+                    guint8 *overflow = &s->buckets[home].overflow;
+                    if (*overflow != G_MAXUINT8)
+                        __atomic_store_n(overflow, *overflow - 1, __ATOMIC_RELAXED);
+                }
+                return TRUE;
+            }
+            m &= m - 1;
+        }
+        if (!b->overflow)
+            return FALSE;
+        i = (i + 1) & s->mask;
+    }
+    return FALSE;
+}
+
+/* Incremental resize: growing only allocates the new array. The old one
+ * stays live and a few of its buckets move across on every table operation,
+ * so no single packet pays for rehashing the whole table. Migrated buckets
+ * keep their overflow counts so chains through them still reach flows
+ * that have not moved yet.
+ */
+static void swiss_migrate(GInetFlowTable * table, guint64 count)
+{
+    struct bucket_array *old = &table->migrating;
+
+    for (; count && old->buckets; count--) {
+        struct flow_bucket *b = &old->buckets[table->migrated];
+        int slot;
+
+        for (slot = 0; slot < BUCKET_SLOTS; slot++) {
+            if (b->tags[slot]) {
+                swiss_place(&table->buckets, b->flows[slot]);
+                b->tags[slot] = 0;
+                b->flows[slot] = NULL;
+                old->size--;
+            }
+        }
+        if (++table->migrated > old->mask || old->size == 0)
+            buckets_free(old);
+    }
+}
+
+static GInetFlow *swiss_lookup_incremental(GInetFlowTable * table, GInetFlow * packet)
+{
+    GInetFlow *flow;
+
+    swiss_migrate(table, SWISS_MIGRATE_STEP);
+    flow = swiss_lookup(&table->buckets, packet);
+    if (!flow && table->migrating.buckets)
+        flow = swiss_lookup(&table->migrating, packet);
+    return flow;
+}
+
+static void swiss_insert_incremental(GInetFlowTable * table, GInetFlow * flow)
+{
+    struct bucket_array *s = &table->buckets;
+
+    if (swiss_full(s)) {
+        /* Migration normally ends long before the new array fills */
+        swiss_migrate(table, G_MAXUINT64);
+        table->migrating = *s;
+        table->migrated = 0;
+        buckets_init(s, (s->mask + 1) * 2);
+    }
+    swiss_place(s, flow);
+    swiss_migrate(table, SWISS_MIGRATE_STEP);
+}
+
+static void swiss_remove_incremental(GInetFlowTable * table, GInetFlow * flow)
+{
+    if (!swiss_remove(&table->buckets, flow) && table->migrating.buckets)
+        swiss_remove(&table->migrating, flow);
+}
+
+/* Compact IPv4 index of the dual engine. Keys pack both addresses into one
+ * word and both ports into another, so the 24 zero bytes an IPv4 flow
+ * carries in its tuple are neither stored nor compared.
+ */
+static inline guint64 compact_ips(const GInetFlow * f)
+{
+    return f->tuple.lower_ip[0] | ((guint64) f->tuple.upper_ip[0] << 32);
+}
+
+static inline guint32 compact_ports(const GInetFlow * f)
+{
+    return f->tuple.lower_port | ((guint32) f->tuple.upper_port << 16);
+}
+
+static GInetFlow *compact_lookup(struct bucket_array *s, GInetFlow * packet)
+{
+    guint64 i = bucket_mix(packet->hash) >> s->shift;
+    guint64 ips = compact_ips(packet);
+    guint32 ports = compact_ports(packet);
+    guint8 protocol = packet->tuple.protocol;
+    guint64 probes;
+    int slot;
+
+    /* Bounded like the Swiss probe, every bucket may be marked */
+    for (probes = 0; probes <= s->mask; probes++) {
+        struct flow_bucket4 *b = &s->buckets4[i];
+        for (slot = 0; slot < BUCKET4_SLOTS; slot++) {
+            if (b->ips[slot] == ips && b->ports[slot] == ports &&
+                b->protocol[slot] == protocol && b->flows[slot])
+                return b->flows[slot];
+        }
+        if (!b->overflow)
+            return NULL;
+        i = (i + 1) & s->mask;
+    }
+    return NULL;
+}
+
+static void compact_place(struct bucket_array *s, GInetFlow * flow)
+{
+    guint64 i = bucket_mix(flow->hash) >> s->shift;
+    int slot;
+
+    for (;;) {
+        struct flow_bucket4 *b = &s->buckets4[i];
+        for (slot = 0; slot < BUCKET4_SLOTS; slot++) {
+            if (!b->flows[slot]) {
+                b->ips[slot] = compact_ips(flow);
+                b->ports[slot] = compact_ports(flow);
+                b->protocol[slot] = flow->tuple.protocol;
+                b->flows[slot] = flow;
+                s->size++;
+                return;
+            }
+        }
+        if (b->overflow != G_MAXUINT8)
+            b->overflow++;
+        i = (i + 1) & s->mask;
+    }
+}
+
+/* Three slots per bucket probe out sooner, so keep at most 3/4 in use */
+static inline gboolean compact_full(struct bucket_array *s)
+{
+    return (s->size + 1) * 4 > (s->mask + 1) * BUCKET4_SLOTS * 3;
+}
+
+static void compact_insert(struct bucket_array *s, GInetFlow * flow)
+{
+    if (compact_full(s)) {
+        struct bucket_array old = *s;
+        guint64 i;
+        int slot;
+
+        buckets_init(s, (old.mask + 1) * 2);
+        for (i = 0; i <= old.mask; i++) {
+            for (slot = 0; slot < BUCKET4_SLOTS; slot++) {
+                if (old.buckets4[i].flows[slot])
+                    compact_place(s, old.buckets4[i].flows[slot]);
+            }
+        }
+        buckets_free(&old);
+    }
+    compact_place(s, flow);
+}
+
+static void compact_remove(struct bucket_array *s, GInetFlow * flow)
+{
+    guint64 home = bucket_mix(flow->hash) >> s->shift;
+    guint64 i = home;
+    guint64 probes;
+    int slot;
+
+    for (probes = 0; probes <= s->mask; probes++) {
+        struct flow_bucket4 *b = &s->buckets4[i];
+        for (slot = 0; slot < BUCKET4_SLOTS; slot++) {
+            if (b->flows[slot] == flow) {
+                b->ips[slot] = 0;
+                b->ports[slot] = 0;
+                b->protocol[slot] = 0;
+                b->flows[slot] = NULL;
+                s->size--;
+                for (; home != i; home = (home + 1) & s->mask) {
+                    if (s->buckets4[home].overflow != G_MAXUINT8)
+                        s->buckets4[home].overflow--;
+                }
+                return;
+            }
+        }
+        if (!b->overflow)
+            return;
+        i = (i + 1) & s->mask;
+    }
+}
+
+/* Cuckoo engine: each flow lives in one of two buckets, so a lookup reads
+ * at most two cache lines. The second bucket comes from an independent mix
+ * of the hash and is forced to differ from the first.
+ */
+static inline void cuckoo_buckets(struct bucket_array *s, guint64 hash, guint64 * b1,
+                                  guint64 * b2)
+{
+    *b1 = bucket_mix(hash) >> s->shift;
+    *b2 = hash_fmix64(hash) & s->mask;
+    if (*b2 == *b1)
+        *b2 ^= 1;
+}
+
+static GInetFlow *cuckoo_lookup(struct bucket_array *s, GInetFlow * packet)
+{
+    guint8 tag = bucket_tag(bucket_mix(packet->hash));
+    guint64 b[2];
+    int i;
+
+    cuckoo_buckets(s, packet->hash, &b[0], &b[1]);
+    __builtin_prefetch(&s->buckets[b[1]]);
+    for (i = 0; i < 2; i++) {
+        struct flow_bucket *bucket = &s->buckets[b[i]];
+        guint m = bucket_match(bucket, tag);
+        while (m) {
+            GInetFlow *f = bucket->flows[__builtin_ctz(m)];
+            if (flow_compare(f, packet))
+                return f;
+            m &= m - 1;
+        }
+    }
+    return NULL;
+}
+
+static inline void cuckoo_move(struct bucket_array *s, guint64 from, int from_slot,
+                               guint64 to, int to_slot)
+{
+    s->buckets[to].tags[to_slot] = s->buckets[from].tags[from_slot];
+    s->buckets[to].flows[to_slot] = s->buckets[from].flows[from_slot];
+    s->buckets[from].tags[from_slot] = 0;
+    s->buckets[from].flows[from_slot] = NULL;
+}
+
+/* Breadth first search for a chain of moves that frees a slot in one of the
+ * flow's buckets. The search is bounded and only moves entries once a free
+ * slot has been found, so a full table fails cleanly and unchanged.
+ */
+static gboolean cuckoo_insert(struct bucket_array *s, GInetFlow * flow)
+{
+    struct {
+        guint64 bucket;
+        int parent;
+        int slot;
+        int depth;
+    } node[CUCKOO_SEARCH_MAX];
+    int head = 0;
+    int tail = 0;
+    guint64 b1;
+    guint64 b2;
+
+    cuckoo_buckets(s, flow->hash, &b1, &b2);
+    node[tail++] = (typeof(node[0])) {b1, -1, -1, 1};
+    node[tail++] = (typeof(node[0])) {b2, -1, -1, 1};
+    while (head < tail) {
+        int n = head++;
+        struct flow_bucket *bucket = &s->buckets[node[n].bucket];
+        guint m = bucket_match(bucket, 0);
+        int slot;
+
+        if (m) {
+            /* Shift each entry on the path into the slot freed after it */
+            int free_slot = __builtin_ctz(m);
+            for (; node[n].parent >= 0; n = node[n].parent) {
+                int p = node[n].parent;
+                cuckoo_move(s, node[p].bucket, node[n].slot, node[n].bucket, free_slot);
+                free_slot = node[n].slot;
+            }
+            bucket = &s->buckets[node[n].bucket];
+            bucket->tags[free_slot] = bucket_tag(bucket_mix(flow->hash));
+            bucket->flows[free_slot] = flow;
+            s->size++;
+            return TRUE;
+        }
+        if (node[n].depth == CUCKOO_DEPTH_MAX)
+            continue;
+        for (slot = 0; slot < BUCKET_SLOTS && tail < CUCKOO_SEARCH_MAX; slot++) {
+            guint64 alt1;
+            guint64 alt2;
+            guint64 alt;
+            int p;
+
+            cuckoo_buckets(s, bucket->flows[slot]->hash, &alt1, &alt2);
+            alt = alt1 == node[n].bucket ? alt2 : alt1;
+            /* A bucket already on this path would have its slots reused */
+            for (p = n; p >= 0 && node[p].bucket != alt; p = node[p].parent);
+            if (p >= 0)
+                continue;
+            node[tail++] = (typeof(node[0])) {alt, n, slot, node[n].depth + 1};
+        }
+    }
+    return FALSE;
+}
+
+static void cuckoo_remove(struct bucket_array *s, GInetFlow * flow)
+{
+    guint8 tag = bucket_tag(bucket_mix(flow->hash));
+    guint64 b[2];
+    int i;
+
+    cuckoo_buckets(s, flow->hash, &b[0], &b[1]);
+    for (i = 0; i < 2; i++) {
+        struct flow_bucket *bucket = &s->buckets[b[i]];
+        guint m = bucket_match(bucket, tag);
+        while (m) {
+            int slot = __builtin_ctz(m);
+            if (bucket->flows[slot] == flow) {
+                bucket->tags[slot] = 0;
+                bucket->flows[slot] = NULL;
+                s->size--;
+                return;
+            }
+            m &= m - 1;
+        }
+    }
+}
+
+/* Buckets needed for capacity flows at 7/8 of the slots, as a power of 2 */
+static guint64 buckets_for_capacity(guint64 capacity)
+{
+    guint64 nbuckets = SWISS_MIN_BUCKETS;
+
+    while (nbuckets * BUCKET_SLOTS * 7 < capacity * 8)
+        nbuckets *= 2;
+    return nbuckets;
+}
+
+/* Compact buckets needed for capacity IPv4 flows at 3/4 of the slots */
+static guint64 buckets4_for_capacity(guint64 capacity)
+{
+    guint64 nbuckets = SWISS_MIN_BUCKETS;
+
+    while (nbuckets * BUCKET4_SLOTS * 3 < capacity * 4)
+        nbuckets *= 2;
+    return nbuckets;
+}
+
+/* Readers may still be probing the old array, so it is retired rather
+ * than freed
+ */
+static void swiss_insert_shared(GInetFlowTable * table, GInetFlow * flow)
+{
+    if (swiss_full(&table->buckets)) {
+        struct bucket_array *old = g_new(struct bucket_array, 1);
+
+        swiss_grow(&table->buckets, old);
+        table->retiring_mem = g_list_prepend(table->retiring_mem, old);
+    }
+    swiss_place(&table->buckets, flow);
+}
+
+/* Flow index, backed by the engine chosen when the table was created. The
+ * dual engine keeps IPv6 and other flows in a Swiss index.
+ */
+static GInetFlow *flow_index_lookup(GInetFlowTable * table, GInetFlow * packet)
+{
+    switch (table->engine) {
+    case G_INET_FLOW_TABLE_ENGINE_DUAL:
+        if (packet->family == G_SOCKET_FAMILY_IPV4)
+            return compact_lookup(&table->buckets4, packet);
+        /* fall through */
+    case G_INET_FLOW_TABLE_ENGINE_SWISS:
+        if (table->incremental)
+            return swiss_lookup_incremental(table, packet);
+        return swiss_lookup(&table->buckets, packet);
+    case G_INET_FLOW_TABLE_ENGINE_CUCKOO:
+        return cuckoo_lookup(&table->buckets, packet);
+    case G_INET_FLOW_TABLE_ENGINE_GHASH:
+    default:
+        return (GInetFlow *) g_hash_table_lookup(table->table, packet);
+    }
+}
+
+/* Only the cuckoo engine can fail, when no room can be made for the flow */
+static gboolean flow_index_insert(GInetFlowTable * table, GInetFlow * flow)
+{
+    switch (table->engine) {
+    case G_INET_FLOW_TABLE_ENGINE_DUAL:
+        if (flow->family == G_SOCKET_FAMILY_IPV4) {
+            compact_insert(&table->buckets4, flow);
+            return TRUE;
+        }
+        /* fall through */
+    case G_INET_FLOW_TABLE_ENGINE_SWISS:
+        if (table->incremental)
+            swiss_insert_incremental(table, flow);
+        else if (table->lock_free)
+            swiss_insert_shared(table, flow);
+        else
+            swiss_insert(&table->buckets, flow);
+        return TRUE;
+    case G_INET_FLOW_TABLE_ENGINE_CUCKOO:
+        return cuckoo_insert(&table->buckets, flow);
+    case G_INET_FLOW_TABLE_ENGINE_GHASH:
+    default:
+        g_hash_table_replace(table->table, (gpointer) flow, (gpointer) flow);
+        return TRUE;
+    }
+}
+
+static void flow_index_remove(GInetFlowTable * table, GInetFlow * flow)
+{
+    switch (table->engine) {
+    case G_INET_FLOW_TABLE_ENGINE_DUAL:
+        if (flow->family == G_SOCKET_FAMILY_IPV4) {
+            compact_remove(&table->buckets4, flow);
+            break;
+        }
+        /* fall through */
+    case G_INET_FLOW_TABLE_ENGINE_SWISS:
+        if (table->incremental)
+            swiss_remove_incremental(table, flow);
+        else
+            swiss_remove(&table->buckets, flow);
+        break;
+    case G_INET_FLOW_TABLE_ENGINE_CUCKOO:
+        cuckoo_remove(&table->buckets, flow);
+        break;
+    case G_INET_FLOW_TABLE_ENGINE_GHASH:
+    default:
+        g_hash_table_remove(table->table, flow);
+        break;
+    }
+}
+
+static guint64 flow_index_size(GInetFlowTable * table)
+{
+    switch (table->engine) {
+    case G_INET_FLOW_TABLE_ENGINE_SWISS:
+    case G_INET_FLOW_TABLE_ENGINE_DUAL:
+        return table->buckets4.size + table->buckets.size + table->migrating.size;
+    case G_INET_FLOW_TABLE_ENGINE_CUCKOO:
+        return table->buckets.size;
+    case G_INET_FLOW_TABLE_ENGINE_GHASH:
+    default:
+        return g_hash_table_size(table->table);
+    }
+}
+
+/* Direct mapped cache of the flows last seen, checked before the index so
+ * bursts of packets from one flow skip the probe. It holds no references,
+ * flows are dropped from it when they leave the index.
+ */
+static inline struct flow_cache_entry *flow_cache_entry(GInetFlowTable * table,
+                                                        guint64 hash)
+{
+    return &table->cache[bucket_mix(hash) >> table->cache_shift];
+}
+
+static GInetFlow *flow_cache_lookup(GInetFlowTable * table, GInetFlow * packet)
+{
+    struct flow_cache_entry *entry = flow_cache_entry(table, packet->hash);
+
+    table->cache_lookups++;
+    if (entry->hash == packet->hash && entry->flow && flow_compare(entry->flow, packet)) {
+        table->cache_hits++;
+        /* Hits skip the index, so they move a pending migration on too */
+        if (table->migrating.buckets)
+            swiss_migrate(table, SWISS_MIGRATE_STEP);
+        return entry->flow;
+    }
+    return NULL;
+}
+
+static inline void flow_cache_store(GInetFlowTable * table, GInetFlow * flow)
+{
+    struct flow_cache_entry *entry = flow_cache_entry(table, flow->hash);
+
+    entry->hash = flow->hash;
+    entry->flow = flow;
+}
+
+static inline void flow_cache_forget(GInetFlowTable * table, GInetFlow * flow)
+{
+    struct flow_cache_entry *entry = flow_cache_entry(table, flow->hash);
+
+    if (entry->flow == flow)
+        entry->flow = NULL;
+}
+
+/* Statistics of a concurrent table are summed over its stripes, read
+ * without their locks
+ */
+static guint64 flow_table_size(GInetFlowTable * table)
+{
+    guint64 size = 0;
+    guint i;
+
+    if (!table->stripes)
+        return flow_index_size(table);
+    for (i = 0; i < table->nstripes; i++)
+        size += flow_index_size(table->stripes[i]);
+    return size;
+}
+
+static guint64 flow_table_sum(GInetFlowTable * table, glong offset)
+{
+    guint64 sum = 0;
+    guint i;
+
+    if (!table->stripes)
+        return G_STRUCT_MEMBER(guint64, table, offset);
+    for (i = 0; i < table->nstripes; i++)
+        sum += G_STRUCT_MEMBER(guint64, table->stripes[i], offset);
+    return sum;
+}
+
+#define FLOW_TABLE_SUM(__t, __field) \
+    flow_table_sum((__t), G_STRUCT_OFFSET(GInetFlowTable, __field))
+
+static guint64 flow_table_count(GInetFlowTable * table, gboolean misses)
+{
+    guint64 sum = 0;
+    int i;
+
+    if (!table->counters)
+        return misses ? table->misses : table->hits;
+    for (i = 0; i < COUNTER_SLOTS; i++) {
+        struct flow_counters *c = &table->counters[i];
+        sum += __atomic_load_n(misses ? &c->misses : &c->hits, __ATOMIC_RELAXED);
+    }
+    return sum;
+}
+
+/* Tuples are stored lower end first whatever the packet direction. With
+ * traffic arriving in both directions these orderings are coin flips, so
+ * they are made with selects rather than branches.
+ */
+static inline guint8 tuple_order_ports(GInetFlow * f, guint16 sport, guint16 dport)
+{
+    f->tuple.lower_port = MIN(sport, dport);
+    f->tuple.upper_port = MAX(sport, dport);
+    return sport < dport;
+}
+
+/* Compare the addresses as unsigned host order values, matching the baseline ordering */
+static inline void tuple_order_ipv4(GInetFlow * f, guint32 saddr, guint32 daddr)
+{
+    guint32 mask = 0U - (GUINT32_FROM_BE(saddr) < GUINT32_FROM_BE(daddr));
+
+    f->tuple.lower_ip[0] = (saddr & mask) | (daddr & ~mask);
+    f->tuple.upper_ip[0] = (daddr & mask) | (saddr & ~mask);
+}
+
+/* Addresses order as memcmp would, by their big endian halves */
+static inline void tuple_order_ipv6(GInetFlow * f, const guint8 * saddr,
+                                    const guint8 * daddr)
+{
+    guint64 s[2], d[2];
+    guint64 shi, dhi;
+    guint64 mask;
+
+    memcpy(s, saddr, 16);
+    memcpy(d, daddr, 16);
+    shi = GUINT64_FROM_BE(s[0]);
+    dhi = GUINT64_FROM_BE(d[0]);
+    mask = 0ULL - ((shi < dhi) | ((shi == dhi) &
+                                  (GUINT64_FROM_BE(s[1]) < GUINT64_FROM_BE(d[1]))));
+#if defined(__SSE2__)
+    {
+        __m128i vs = _mm_loadu_si128((const __m128i *) saddr);
+        __m128i vd = _mm_loadu_si128((const __m128i *) daddr);
+        __m128i m = _mm_set1_epi64x(mask);
+
+        _mm_storeu_si128((__m128i *) f->tuple.lower_ip,
+                         _mm_or_si128(_mm_and_si128(m, vs), _mm_andnot_si128(m, vd)));
+        _mm_storeu_si128((__m128i *) f->tuple.upper_ip,
+                         _mm_or_si128(_mm_and_si128(m, vd), _mm_andnot_si128(m, vs)));
+    }
+#else
+    {
+        guint64 lower[2], upper[2];
+        int i;
+
+        for (i = 0; i < 2; i++) {
+            lower[i] = (s[i] & mask) | (d[i] & ~mask);
+            upper[i] = (d[i] & mask) | (s[i] & ~mask);
+        }
+        memcpy(f->tuple.lower_ip, lower, 16);
+        memcpy(f->tuple.upper_ip, upper, 16);
+    }
+#endif
+}
+
+static gboolean flow_parse_tcp(GInetFlow * f, const guint8 * data, guint32 length)
+{
+    tcp_hdr_t *tcp = (tcp_hdr_t *) data;
+    if (length < sizeof(tcp_hdr_t))
+        return FALSE;
+    guint16 sport = GUINT16_FROM_BE(tcp->source);
+    guint16 dport = GUINT16_FROM_BE(tcp->destination);
+    f->direction = tuple_order_ports(f, sport, dport);
+    f->flags = GUINT16_FROM_BE(tcp->flags);
+    return TRUE;
+}
+
+static gboolean flow_parse_udp(GInetFlow * f, const guint8 * data, guint32 length)
+{
+    udp_hdr_t *udp = (udp_hdr_t *) data;
+    if (length < sizeof(udp_hdr_t))
+        return FALSE;
+    guint16 sport = GUINT16_FROM_BE(udp->source);
+    guint16 dport = GUINT16_FROM_BE(udp->destination);
+    f->direction = tuple_order_ports(f, sport, dport);
+    return TRUE;
+}
+
+static gboolean flow_parse_sctp(GInetFlow * f, const guint8 * data, guint32 length)
+{
+    sctp_hdr_t *sctp = (sctp_hdr_t *) data;
+    if (length < sizeof(sctp_hdr_t))
+        return FALSE;
+    guint16 sport = GUINT16_FROM_BE(sctp->source);
+    guint16 dport = GUINT16_FROM_BE(sctp->destination);
+    tuple_order_ports(f, sport, dport);
+    return TRUE;
+}
+
+static gboolean flow_parse_ipv4(GInetFlow * f, const guint8 * data, guint32 length,
+                                GInetFlowTable * table)
+{
+    ip_hdr_t *iph = (ip_hdr_t *) data;
+    if (length < sizeof(ip_hdr_t))
+        return FALSE;
+    tuple_order_ipv4(f, iph->saddr, iph->daddr);
+    f->tuple.protocol = iph->protocol;
+
+    /* Non-first IP fragments (frag_offset is non-zero) will need a look-up
+     * to find sport and dport
+     */
+    if ((GUINT16_FROM_BE(iph->frag_off) & 0x1FFF) != 0)
+        return find_frag_info(table, f, iph->id,
+                              (GUINT16_FROM_BE(iph->frag_off) & 0x2000) == 0);
+
+    switch (iph->protocol) {
+    case IP_PROTOCOL_TCP:
+        if (!flow_parse_tcp(f, data + sizeof(ip_hdr_t), length - sizeof(ip_hdr_t)))
+            return FALSE;
+        break;
+    case IP_PROTOCOL_UDP:
+        if (!flow_parse_udp(f, data + sizeof(ip_hdr_t), length - sizeof(ip_hdr_t)))
+            return FALSE;
+        break;
+    case IP_PROTOCOL_ICMP:
+    default:
+        f->tuple.lower_port = 0;
+        f->tuple.upper_port = 0;
+        break;
+    }
+
+    /* Store ID and tuple if the packet is a first IP fragment (MF set and frag_off is zero) */
+    if (((GUINT16_FROM_BE(iph->frag_off) & 0x2000) != 0) &&
+        ((GUINT16_FROM_BE(iph->frag_off) & 0x1FFF) == 0)) {
+        return store_frag_info(table, f, iph->id);
+    }
+
+    return TRUE;
+}
+
+static gboolean flow_parse_ipv6(GInetFlow * f, const guint8 * data, guint32 length,
+                                GInetFlowTable * table)
+{
+    ip6_hdr_t *iph = (ip6_hdr_t *) data;
+    frag_hdr_t *fragment_hdr = NULL;
+    auth_hdr_t *auth_hdr;
+    ipv6_partial_ext_hdr_t *ipv6_part_hdr;
+
+    if (length < sizeof(ip6_hdr_t))
+        return FALSE;
+    tuple_order_ipv6(f, iph->saddr, iph->daddr);
+    f->tuple.protocol = iph->next_hdr;
+    data += sizeof(ip6_hdr_t);
     length -= sizeof(ip6_hdr_t);
 
   next_header:
@@ -529,27 +2249,9 @@ static gboolean flow_parse_ipv6(GInetFlow * f, const guint8 * data, guint32 leng
         /* Non-first IP fragments (frag_offset is non-zero) will need a look-up
          * to find sport and dport
          */
-        if ((GUINT16_FROM_BE(fragment_hdr->fo_res_mflag) & 0xFFF8) != 0) {
-            struct frag_info entry = { };
-            entry.id = fragment_hdr->id;
-            memcpy(&(entry.tuple), &(f->tuple), sizeof(struct tuple));
-
-            GList *match =
-                g_list_find_custom(table->frag_info_list, &entry, find_flow_by_frag_info);
-            if (!match)
-                return FALSE;
-
-            struct frag_info *found_flow = match->data;
-            f->tuple.lower_port = found_flow->tuple.lower_port;
-            f->tuple.upper_port = found_flow->tuple.upper_port;
-
-            /* If this is the last IP fragment (MF is unset), clean up the list */
-            if ((GUINT16_FROM_BE(fragment_hdr->fo_res_mflag) & 0x1) == 0) {
-                table->frag_info_list = g_list_remove(table->frag_info_list, found_flow);
-                free(found_flow);
-            }
-            return TRUE;
-        }
+        if ((GUINT16_FROM_BE(fragment_hdr->fo_res_mflag) & 0xFFF8) != 0)
+            return find_frag_info(table, f, fragment_hdr->id,
+                                  (GUINT16_FROM_BE(fragment_hdr->fo_res_mflag) & 0x1) == 0);
         goto next_header;
     case IP_PROTOCOL_AUTH:
         if (length < sizeof(auth_hdr_t))
@@ -581,7 +2283,7 @@ static gboolean flow_parse_ipv6(GInetFlow * f, const guint8 * data, guint32 leng
 }
 
 static gboolean flow_parse_ip(GInetFlow * f, const guint8 * data, guint32 length,
-                              guint16 hash, GInetFlowTable * table)
+                              guint64 hash, GInetFlowTable * table)
 {
     guint8 version;
 
@@ -607,7 +2309,7 @@ static gboolean flow_parse_ip(GInetFlow * f, const guint8 * data, guint32 length
     }
 }
 
-static gboolean flow_parse(GInetFlow * f, const guint8 * data, guint32 length, guint16 hash,
+static gboolean flow_parse(GInetFlow * f, const guint8 * data, guint32 length, guint64 hash,
                            GInetFlowTable * table)
 {
     ethernet_hdr_t *e;
@@ -685,50 +2387,271 @@ static gboolean flow_parse(GInetFlow * f, const guint8 * data, guint32 length, g
         DEBUG("Unsupported ethernet protocol: 0x%04x\n", type);
         return FALSE;
     }
-    return TRUE;
+    return TRUE;
+}
+
+enum {
+    FLOW_STATE = 1,
+    FLOW_PACKETS,
+    FLOW_HASH,
+    FLOW_PROTOCOL,
+    FLOW_LPORT,
+    FLOW_UPORT,
+    FLOW_LIP,
+    FLOW_UIP,
+    FLOW_HASH64,
+};
+
+static inline guint64 flow_deadline(GInetFlow * flow)
+{
+    return flow->timestamp + (guint64) flow->lifetime * TIMESTAMP_RESOLUTION_US;
+}
+
+static inline GList **wheel_list(struct timing_wheel *w, guint slot)
+{
+    return slot == WHEEL_DUE ? &w->due : &w->slots[slot - 1];
+}
+
+static inline void wheel_push(GList ** list, GInetFlow * flow)
+{
+    flow->list.prev = NULL;
+    flow->list.next = *list;
+    if (*list)
+        (*list)->prev = &flow->list;
+    *list = &flow->list;
+}
+
+static inline gboolean wheel_empty(struct timing_wheel *w)
+{
+    guint level;
+
+    for (level = 0; level < WHEEL_LEVELS; level++) {
+        if (w->occupied[level])
+            return FALSE;
+    }
+    return TRUE;
+}
+
+/* The level is picked by how far off the expiry tick is and the slot by
+ * the bits of the tick itself, so each slot is reached by the time its
+ * flows are due or need placing again on a lower level.
+ */
+static void wheel_place(struct timing_wheel *w, GInetFlow * flow)
+{
+    guint64 tick = flow_deadline(flow) >> WHEEL_TICK_BITS;
+    guint level = 0;
+    guint slot;
+
+    if (tick < w->now) {
+        flow->wheel_slot = WHEEL_DUE;
+    } else {
+        guint64 delta = tick - w->now;
+
+        while (level < WHEEL_LEVELS - 1 && delta >> (WHEEL_BITS * (level + 1)))
+            level++;
+        if (delta >> (WHEEL_BITS * WHEEL_LEVELS))
+            tick = w->now + (G_GUINT64_CONSTANT(1) << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+        slot = (tick >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+        w->occupied[level] |= G_GUINT64_CONSTANT(1) << slot;
+        flow->wheel_slot = level * WHEEL_SLOTS + slot + 1;
+    }
+    wheel_push(wheel_list(w, flow->wheel_slot), flow);
+}
+
+/* Ready times are on the monotonic clock and deadlines on the table's */
+static void aging_source_ready(struct flow_aging_source *aging, guint64 deadline)
+{
+    guint64 now = get_time_us();
+
+    if (deadline == G_MAXUINT64)
+        g_source_set_ready_time(&aging->source, -1);
+    else if (deadline <= now)
+        g_source_set_ready_time(&aging->source, 0);
+    else
+        g_source_set_ready_time(&aging->source, g_get_monotonic_time() + (deadline - now));
+}
+
+static inline void aging_source_wake(GSource * source, guint64 deadline)
+{
+    struct flow_aging_source *aging = (struct flow_aging_source *) source;
+
+    if (deadline >= __atomic_load_n(&aging->wake, __ATOMIC_RELAXED))
+        return;
+    g_mutex_lock(&aging->lock);
+    if (deadline < aging->wake) {
+        __atomic_store_n(&aging->wake, deadline, __ATOMIC_RELAXED);
+        aging_source_ready(aging, deadline);
+    }
+    g_mutex_unlock(&aging->lock);
+}
+
+/* Caller timestamps need not follow the clock, so an empty wheel restarts
+ * from the time of the first flow put on it
+ */
+static void wheel_insert(GInetFlowTable * table, GInetFlow * flow)
+{
+    GInetFlowTable *root = table->owner ? : table;
+
+    if (wheel_empty(&table->wheel))
+        table->wheel.now = flow->timestamp >> WHEEL_TICK_BITS;
+    wheel_place(&table->wheel, flow);
+    if (root->aging)
+        aging_source_wake(root->aging, flow_deadline(flow));
+}
+
+static void wheel_remove(GInetFlowTable * table, GInetFlow * flow)
+{
+    struct timing_wheel *w = &table->wheel;
+    guint slot = flow->wheel_slot;
+    GList **list;
+
+    if (!slot)
+        return;
+    list = wheel_list(w, slot);
+    *list = g_list_remove_link(*list, &flow->list);
+    if (!*list && slot != WHEEL_DUE)
+        w->occupied[(slot - 1) / WHEEL_SLOTS] &=
+            ~(G_GUINT64_CONSTANT(1) << ((slot - 1) % WHEEL_SLOTS));
+    flow->wheel_slot = 0;
+}
+
+/* Empty a slot, moving its flows to the due list or placing them again.
+ * Flows whose expiry moved later since they were placed are placed again
+ * rather than made due.
+ */
+static void wheel_clear_slot(struct timing_wheel *w, guint level, guint slot,
+                             gboolean due)
+{
+    GList *list = w->slots[level * WHEEL_SLOTS + slot];
+    GList *next;
+
+    w->slots[level * WHEEL_SLOTS + slot] = NULL;
+    w->occupied[level] &= ~(G_GUINT64_CONSTANT(1) << slot);
+    for (; list; list = next) {
+        GInetFlow *flow = (GInetFlow *) list->data;
+
+        next = list->next;
+        if (due && flow_deadline(flow) >> WHEEL_TICK_BITS <= w->now) {
+            flow->wheel_slot = WHEEL_DUE;
+            wheel_push(&w->due, flow);
+        } else {
+            wheel_place(w, flow);
+        }
+    }
+}
+
+/* First tick after now at which a slot comes due or must be placed again */
+static guint64 wheel_next(struct timing_wheel *w)
+{
+    guint64 next = G_MAXUINT64;
+    guint level;
+
+    for (level = 0; level < WHEEL_LEVELS; level++) {
+        guint64 cur = w->now >> (WHEEL_BITS * level);
+        guint64 bits = w->occupied[level];
+        guint r = (cur + 1) & (WHEEL_SLOTS - 1);
+
+        if (!bits)
+            continue;
+        bits = (bits >> r) | (bits << ((WHEEL_SLOTS - r) & (WHEEL_SLOTS - 1)));
+        next = MIN(next, (cur + __builtin_ctzll(bits) + 1) << (WHEEL_BITS * level));
+    }
+    return next;
+}
+
+/* Turn the wheel to tick, skipping straight over empty slots so a jump
+ * costs only the slots that hold flows
+ */
+static void wheel_advance(struct timing_wheel *w, guint64 tick)
+{
+    guint level;
+
+    while (w->now < tick) {
+        wheel_clear_slot(w, 0, w->now & (WHEEL_SLOTS - 1), TRUE);
+        w->now = MIN(wheel_next(w), tick);
+        for (level = 1; level < WHEEL_LEVELS; level++) {
+            guint shift = WHEEL_BITS * level;
+
+            if (w->now & ((G_GUINT64_CONSTANT(1) << shift) - 1))
+                break;
+            wheel_clear_slot(w, level, (w->now >> shift) & (WHEEL_SLOTS - 1), FALSE);
+        }
+    }
 }
 
-enum {
-    FLOW_STATE = 1,
-    FLOW_PACKETS,
-    FLOW_HASH,
-    FLOW_PROTOCOL,
-    FLOW_LPORT,
-    FLOW_UPORT,
-    FLOW_LIP,
-    FLOW_UIP,
-};
-
-static int find_expiry_index(GInetFlowTable * table, guint64 lifetime)
+/* Adds up to max flows due by ts to out, noting in more if any are left */
+static guint wheel_collect(struct timing_wheel *w, guint64 ts, guint max, GPtrArray * out,
+                           gboolean * more)
 {
-    int i;
+    GList *iter;
+    guint n = 0;
+    int pass;
 
-    for (i = 0; i < LIFETIME_COUNT; i++) {
-        if (lifetime == lifetime_values[i]) {
-            return i;
+    wheel_advance(w, ts >> WHEEL_TICK_BITS);
+    iter = w->due;
+    for (pass = 0; pass < 2; pass++) {
+        for (; iter; iter = iter->next) {
+            if (flow_deadline(iter->data) > ts)
+                continue;
+            if (n == max) {
+                *more = TRUE;
+                return n;
+            }
+            g_ptr_array_add(out, iter->data);
+            n++;
         }
+        if (w->now != ts >> WHEEL_TICK_BITS)
+            break;
+        iter = w->slots[w->now & (WHEEL_SLOTS - 1)];
     }
-    return 0;
+    return n;
 }
 
-static void remove_flow_by_expiry(GInetFlowTable * table, GInetFlow * flow,
-                                  guint64 lifetime)
+/* Earliest deadline of a flow on the wheel, or G_MAXUINT64 if there are
+ * none. Flows due or in the current tick are checked one by one and the
+ * rest are bounded by the tick of the next slot to come round.
+ */
+static guint64 wheel_next_deadline(struct timing_wheel *w)
 {
-    int index = find_expiry_index(table, lifetime);
-    table->list[index] = g_list_remove_link(table->list[index], &flow->list);
+    guint64 next = wheel_next(w);
+    GList *iter;
+
+    if (next != G_MAXUINT64)
+        next <<= WHEEL_TICK_BITS;
+    for (iter = w->due; iter; iter = iter->next)
+        next = MIN(next, flow_deadline(iter->data));
+    for (iter = w->slots[w->now & (WHEEL_SLOTS - 1)]; iter; iter = iter->next)
+        next = MIN(next, flow_deadline(iter->data));
+    return next;
 }
 
-static void insert_flow_by_expiry(GInetFlowTable * table, GInetFlow * flow,
-                                  guint64 lifetime)
+/* A due flow stays on the wheel until it is released */
+static GInetFlow *wheel_expired(struct timing_wheel *w, guint64 ts)
 {
-    int index = find_expiry_index(table, lifetime);
-    table->list[index] = g_list_concat(&flow->list, table->list[index]);
+    GList *iter;
+
+    wheel_advance(w, ts >> WHEEL_TICK_BITS);
+    for (iter = w->due; iter; iter = iter->next) {
+        if (flow_deadline(iter->data) <= ts)
+            return (GInetFlow *) iter->data;
+    }
+    /* Flows due in the current tick are checked one by one */
+    if (w->now == ts >> WHEEL_TICK_BITS) {
+        for (iter = w->slots[w->now & (WHEEL_SLOTS - 1)]; iter; iter = iter->next) {
+            if (flow_deadline(iter->data) <= ts)
+                return (GInetFlow *) iter->data;
+        }
+    }
+    return NULL;
 }
 
 static void g_inet_flow_get_property(GObject * object, guint prop_id,
                                      GValue * value, GParamSpec * pspec)
 {
     GInetFlow *flow = G_INET_FLOW(object);
+    /* Wrappers read through to their record */
+    if (flow->record)
+        flow = flow->record;
     switch (prop_id) {
     case FLOW_STATE:
         g_value_set_uint(value, flow->state);
@@ -737,7 +2660,10 @@ static void g_inet_flow_get_property(GObject * object, guint prop_id,
         g_value_set_uint64(value, flow->packets);
         break;
     case FLOW_HASH:
-        g_value_set_uint(value, flow->hash);
+        g_value_set_uint(value, (guint16) flow->hash);
+        break;
+    case FLOW_HASH64:
+        g_value_set_uint64(value, flow->hash);
         break;
     case FLOW_PROTOCOL:
         g_value_set_uint(value, flow->tuple.protocol);
@@ -772,12 +2698,135 @@ static void g_inet_flow_get_property(GObject * object, guint prop_id,
     }
 }
 
+/* Linked flows are always on the wheel, so unlinking twice is harmless */
+static void flow_unlink(GInetFlow * flow)
+{
+    if (!flow->wheel_slot)
+        return;
+    wheel_remove(flow->table, flow);
+    flow_index_remove(flow->table, flow);
+    if (flow->table->cache)
+        flow_cache_forget(flow->table, flow);
+    flow->table->in_use--;
+}
+
+/* Free list of released flows, threaded through their expiry list links */
+static void pool_push(GInetFlowTable * table, GInetFlow * flow)
+{
+    flow->list.data = flow;
+    flow->list.next = table->pool;
+    table->pool = &flow->list;
+    table->free++;
+}
+
+static GInetFlow *pool_pop(GInetFlowTable * table)
+{
+    GInetFlow *flow = (GInetFlow *) table->pool->data;
+
+    table->pool = table->pool->next;
+    flow->list.next = NULL;
+    table->free--;
+    return flow;
+}
+
+/* Reset a released flow to its initial state and put it on the free list */
+static void flow_recycle(GInetFlowTable * table, GInetFlow * flow)
+{
+    memset(&flow->table, 0, sizeof(GInetFlow) - G_STRUCT_OFFSET(GInetFlow, table));
+    flow->state = FLOW_NEW;
+    pool_push(table, flow);
+}
+
+/* Retired flows go back to the pool, or are finally unreferenced, once
+ * the readers that might hold them have moved on. With all set everything
+ * retired is freed, for tables that are going away.
+ */
+static void epoch_reclaim(GInetFlowTable * table, gboolean all)
+{
+    GList *iter;
+    GList *next;
+
+    if ((table->retired || table->retired_mem) &&
+        (all || epoch_min_active() > table->retired_epoch)) {
+        for (iter = table->retired; iter; iter = next) {
+            GInetFlow *flow = (GInetFlow *) iter->data;
+
+            next = iter->next;
+            if (table->records || table->recycle) {
+                flow_recycle(table, flow);
+            } else {
+                flow->table = NULL;
+                g_object_unref(flow);
+            }
+        }
+        for (iter = table->retired_mem; iter; iter = iter->next) {
+            buckets_free((struct bucket_array *) iter->data);
+            g_free(iter->data);
+        }
+        g_list_free(table->retired_mem);
+        table->retired = NULL;
+        table->retired_mem = NULL;
+    }
+    if (!table->retired && !table->retired_mem) {
+        table->retired = table->retiring;
+        table->retired_mem = table->retiring_mem;
+        table->retiring = NULL;
+        table->retiring_mem = NULL;
+        table->retiring_count = 0;
+        if (table->retired || table->retired_mem)
+            table->retired_epoch = __atomic_fetch_add(&epoch_global, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+/* Give up an unlinked flow, threaded through its expiry list link */
+static void flow_release(GInetFlowTable * table, GInetFlow * flow)
+{
+    if (!table->lock_free) {
+        flow_recycle(table, flow);
+        return;
+    }
+    flow->list.data = flow;
+    flow->list.next = table->retiring;
+    table->retiring = &flow->list;
+    if (++table->retiring_count >= EPOCH_BATCH)
+        epoch_reclaim(table, FALSE);
+}
+
+/* Flows of a recycling table are not freed but reset and put back in the
+ * pool, which takes over the last reference. Object data set on the flow
+ * is kept, so users must clear it before releasing the flow. Lock-free
+ * tables hold on to every released flow until no reader can see it.
+ */
+static void g_inet_flow_dispose(GObject * object)
+{
+    GInetFlow *flow = G_INET_FLOW(object);
+    GInetFlowTable *table = flow->table;
+
+    if (table && (table->recycle || table->lock_free)) {
+        stripe_lock(table);
+        flow_unlink(flow);
+        flow_release(table, flow);
+        stripe_unlock(table);
+        G_OBJECT_CLASS(g_inet_flow_parent_class)->dispose(object);
+        g_object_ref(object);
+        return;
+    }
+    G_OBJECT_CLASS(g_inet_flow_parent_class)->dispose(object);
+}
+
 static void g_inet_flow_finalize(GObject * object)
 {
     GInetFlow *flow = G_INET_FLOW(object);
-    int index = find_expiry_index(flow->table, flow->lifetime);
-    flow->table->list[index] = g_list_remove_link(flow->table->list[index], &flow->list);
-    g_hash_table_remove(flow->table->table, flow);
+    GInetFlowTable *table = flow->table;
+
+    /* Flows left in a pool and record wrappers belong to no table */
+    if (table) {
+        stripe_lock(table);
+        flow_unlink(flow);
+        stripe_unlock(table);
+    }
+    if (flow->record)
+        flow->record->object = NULL;
     G_OBJECT_CLASS(g_inet_flow_parent_class)->finalize(object);
 }
 
@@ -785,6 +2834,7 @@ static void g_inet_flow_class_init(GInetFlowClass * class)
 {
     GObjectClass *object_class = G_OBJECT_CLASS(class);
     object_class->get_property = g_inet_flow_get_property;
+    object_class->dispose = g_inet_flow_dispose;
     g_object_class_install_property(object_class, FLOW_STATE,
                                     g_param_spec_uint("state", "State",
                                                       "State of the flow",
@@ -799,6 +2849,11 @@ static void g_inet_flow_class_init(GInetFlowClass * class)
                                     g_param_spec_uint("hash", "Hash",
                                                       "Tuple hash for the flow",
                                                       0, G_MAXUINT16, 0, G_PARAM_READABLE));
+    g_object_class_install_property(object_class, FLOW_HASH64,
+                                    g_param_spec_uint64("hash64", "Hash64",
+                                                        "64 bit tuple hash for the flow",
+                                                        0, G_MAXUINT64, 0,
+                                                        G_PARAM_READABLE));
     g_object_class_install_property(object_class, FLOW_PROTOCOL,
                                     g_param_spec_uint("protocol", "Protocol",
                                                       "IP Protocol for the flow",
@@ -822,39 +2877,49 @@ static void g_inet_flow_class_init(GInetFlowClass * class)
     object_class->finalize = g_inet_flow_finalize;
 }
 
+/* The flow's table picks the timeout class for its protocol and new state */
+static void flow_state_set(GInetFlow * flow, GInetFlowState state)
+{
+    GInetFlowTable *table = flow->table;
+
+    flow->state = state;
+    if (!table) {
+        flow->timeout_class = state;
+        flow->lifetime = default_timeouts[state];
+        return;
+    }
+    flow->timeout_class = table->timeout_select[(guint8) flow->tuple.protocol][state];
+    flow->lifetime = table->timeouts[flow->timeout_class];
+}
+
 void g_inet_flow_update_tcp(GInetFlow * flow, GInetFlow * packet)
 {
     /* FIN */
     if (CHECK_BIT(packet->flags, 0)) {
         /* ACK */
         if (CHECK_BIT(packet->flags, 4)) {
-            flow->state = FLOW_CLOSED;
-            flow->lifetime = G_INET_FLOW_DEFAULT_CLOSED_TIMEOUT;
+            flow_state_set(flow, FLOW_CLOSED);
         }
     }
     /* SYN */
     else if (CHECK_BIT(packet->flags, 1)) {
         /* ACK */
         if (CHECK_BIT(packet->flags, 4)) {
-            flow->state = FLOW_OPEN;
-            flow->lifetime = G_INET_FLOW_DEFAULT_OPEN_TIMEOUT;
+            flow_state_set(flow, FLOW_OPEN);
         } else {
-            flow->state = FLOW_NEW;
-            flow->lifetime = G_INET_FLOW_DEFAULT_NEW_TIMEOUT;
+            flow_state_set(flow, FLOW_NEW);
         }
     }
     /* RST */
     else if (CHECK_BIT(packet->flags, 2)) {
-        flow->state = FLOW_CLOSED;
-        flow->lifetime = G_INET_FLOW_DEFAULT_CLOSED_TIMEOUT;
+        flow_state_set(flow, FLOW_CLOSED);
     }
 }
 
 void g_inet_flow_update_udp(GInetFlow * flow, GInetFlow * packet)
 {
     if (packet->direction != flow->direction) {
-        flow->state = FLOW_OPEN;
-        flow->lifetime = G_INET_FLOW_DEFAULT_OPEN_TIMEOUT;
+        flow_state_set(flow, FLOW_OPEN);
     }
 }
 
@@ -867,88 +2932,584 @@ void g_inet_flow_update(GInetFlow * flow, GInetFlow * packet)
     }
 }
 
-static void g_inet_flow_init(GInetFlow * flow)
+static void g_inet_flow_init(GInetFlow * flow)
+{
+    flow->state = FLOW_NEW;
+}
+
+static GInetFlow *flow_expire(GInetFlowTable * table, guint64 ts)
+{
+    GInetFlow *flow;
+    guint i;
+
+    for (i = 0; i < table->nstripes; i++) {
+        GInetFlowTable *stripe = table->stripes[i];
+
+        /* Unlinked before the lock is dropped, so no other thread finds it */
+        g_mutex_lock(&stripe->lock);
+        flow = flow_expire(stripe, ts);
+        if (flow)
+            flow_unlink(flow);
+        g_mutex_unlock(&stripe->lock);
+        if (flow)
+            return flow;
+    }
+    return wheel_expired(&table->wheel, ts);
+}
+
+GInetFlow *g_inet_flow_expire(GInetFlowTable * table, guint64 ts)
+{
+    g_return_val_if_fail(!table->records, NULL);
+    return flow_expire(table, ts);
+}
+
+GInetFlow *g_inet_flow_get(GInetFlowTable * table, const guint8 * frame, guint length)
+{
+    return g_inet_flow_get_full(table, frame, length, 0, 0, FALSE, TRUE);
+}
+
+static gboolean flow_packet_parse(GInetFlowTable * table, GInetFlow * packet,
+                                  const guint8 * frame, guint length, guint64 hash,
+                                  gboolean l2)
+{
+    if (l2)
+        return flow_parse(packet, frame, length, hash, table);
+    return flow_parse_ip(packet, frame, length, hash, table);
+}
+
+/* Records are carved from slabs that stay with the table until it is
+ * finalized, released records go back on its free list. Huge page tables
+ * use slabs of a whole 2MB page so the records form a dense arena.
+ */
+#define RECORD_SLAB_SIZE    256
+static void record_slab_grow(GInetFlowTable * table)
+{
+    struct bucket_array *slab = g_new0(struct bucket_array, 1);
+    gsize size = table->huge ? HUGE_PAGE_2MB : RECORD_SLAB_SIZE * FLOW_STRIDE + 63;
+    guint8 *base;
+    int i;
+
+    slab->huge = table->huge;
+    slab->node = table->node;
+    slab->mem = flow_mem_alloc(slab->huge, slab->node, size, &slab->length,
+                               &slab->page_size);
+    if (!slab->mem)
+        g_error("Failed to allocate %" G_GSIZE_FORMAT " bytes of flow records", size);
+    base = (guint8 *) (((guintptr) slab->mem + 63) & ~(guintptr) 63);
+    table->slabs = g_list_prepend(table->slabs, slab);
+    for (i = (size - 63) / FLOW_STRIDE - 1; i >= 0; i--)
+        pool_push(table, (GInetFlow *) (base + i * FLOW_STRIDE));
+}
+
+static void record_slab_free(gpointer data)
+{
+    struct bucket_array *slab = (struct bucket_array *) data;
+
+    buckets_free(slab);
+    g_free(slab);
+}
+
+/* Smallest page size backing the index and record slabs */
+static gsize flow_page_size(GInetFlowTable * table)
+{
+    gsize size = G_MAXSIZE;
+    GList *iter;
+    guint i;
+
+    for (i = 0; i < table->nstripes; i++)
+        size = MIN(size, flow_page_size(table->stripes[i]));
+    if (table->buckets.mem)
+        size = MIN(size, table->buckets.page_size);
+    if (table->buckets4.mem)
+        size = MIN(size, table->buckets4.page_size);
+    for (iter = table->slabs; iter; iter = iter->next)
+        size = MIN(size, ((struct bucket_array *) iter->data)->page_size);
+    return size == G_MAXSIZE ? (gsize) sysconf(_SC_PAGESIZE) : size;
+}
+
+/* Find or create the flow for a parsed and hashed packet */
+static GInetFlow *flow_packet_get(GInetFlowTable * table, GInetFlow * packet,
+                                  gboolean update)
+{
+    guint64 timestamp = packet->timestamp;
+    GInetFlow *flow;
+
+    flow = table->cache ? flow_cache_lookup(table, packet) : NULL;
+    if (!flow) {
+        flow = flow_index_lookup(table, packet);
+        if (flow && table->cache)
+            flow_cache_store(table, flow);
+    }
+    if (flow) {
+        if (update) {
+            guint64 deadline = flow_deadline(flow);
+
+            g_inet_flow_update(flow, packet);
+            /* Picks up any change to the timeout of the flow's class */
+            flow->lifetime = table->timeouts[flow->timeout_class];
+            flow->timestamp = timestamp ? : get_time_us();
+            /* Flows only move on the wheel when expiry comes sooner */
+            if (flow_deadline(flow) < deadline || flow->wheel_slot == WHEEL_DUE) {
+                wheel_remove(table, flow);
+                wheel_insert(table, flow);
+            }
+            flow->packets++;
+        }
+        FLOW_COUNT(table, hits);
+    } else {
+        /* Check if max table size is reached */
+        if (table->max > 0 && flow_index_size(table) >= table->max)
+            return NULL;
+
+        if (table->lock_free && !table->pool)
+            epoch_reclaim(table, FALSE);
+        if (table->records && !table->pool)
+            record_slab_grow(table);
+        if (table->pool) {
+            flow = pool_pop(table);
+        } else {
+            flow = (GInetFlow *) g_object_new(G_INET_TYPE_FLOW, NULL);
+        }
+        flow->table = table;
+        flow->list.data = flow;
+        flow->family = packet->family;
+        flow->direction = packet->direction;
+        flow->hash = packet->hash;
+        flow->tuple = packet->tuple;
+        /* Start in the new state's class, the packet may move the flow on */
+        flow_state_set(flow, FLOW_NEW);
+        if (!flow_index_insert(table, flow)) {
+            /* Not yet indexed or on an expiry list, so there is nothing to unlink */
+            if (table->records || table->recycle) {
+                flow_recycle(table, flow);
+            } else {
+                flow->table = NULL;
+                g_object_unref(flow);
+            }
+            return NULL;
+        }
+        if (table->cache)
+            flow_cache_store(table, flow);
+        FLOW_COUNT(table, misses);
+        if (++table->in_use > table->high_water)
+            table->high_water = table->in_use;
+        flow->timestamp = timestamp ? : get_time_us();
+        g_inet_flow_update(flow, packet);
+        wheel_insert(table, flow);
+        flow->packets++;
+    }
+    return flow;
+}
+
+/* Concurrent tables hand the packet to the stripe for its hash */
+static GInetFlow *flow_table_get(GInetFlowTable * table, GInetFlow * packet,
+                                 gboolean update)
+{
+    GInetFlow *flow;
+
+    if (!table->stripes)
+        return flow_packet_get(table, packet, update);
+    table = stripe_for_hash(table, packet->hash);
+    /* Found flows stay valid until the reader drops its read lock */
+    if (table->lock_free && !update && epoch_reading()) {
+        flow = swiss_lookup_shared(&table->buckets, packet);
+        if (flow) {
+            FLOW_COUNT(table, hits);
+            return flow;
+        }
+    }
+    g_mutex_lock(&table->lock);
+    flow = flow_packet_get(table, packet, update);
+    g_mutex_unlock(&table->lock);
+    return flow;
+}
+
+GInetFlow *g_inet_flow_get_full64(GInetFlowTable * table,
+                                  const guint8 * frame, guint length,
+                                  guint64 hash, guint64 timestamp, gboolean update,
+                                  gboolean l2)
+{
+    GInetFlow packet = {.timestamp = timestamp };
+
+    g_return_val_if_fail(!table->records, NULL);
+    if (!flow_packet_parse(table, &packet, frame, length, hash, l2))
+        return NULL;
+    flow_hash64(table, &packet);
+    return flow_table_get(table, &packet, update);
+}
+
+/* A 16 bit hash, such as the "hash" property or a NIC's, is extended the
+ * way the CRC16 hash is so that it finds the flows the table hashed itself
+ */
+GInetFlow *g_inet_flow_get_full(GInetFlowTable * table,
+                                const guint8 * frame, guint length,
+                                guint16 hash, guint64 timestamp, gboolean update,
+                                gboolean l2)
+{
+    GInetFlow packet = {.timestamp = timestamp };
+
+    g_return_val_if_fail(!table->records, NULL);
+    if (!flow_packet_parse(table, &packet, frame, length, hash, l2))
+        return NULL;
+    if (hash)
+        packet.hash = hash_extend16(&packet.tuple, hash);
+    flow_hash64(table, &packet);
+    return flow_table_get(table, &packet, update);
+}
+
+guint g_inet_flow_get_batch(GInetFlowTable * table, const guint8 ** frames,
+                            const guint * lengths, const guint64 * hashes,
+                            const guint64 * timestamps, guint count, gboolean update,
+                            gboolean l2, GInetFlow ** flows)
+{
+    GInetFlow packets[FLOW_BATCH_MAX];
+    GInetFlow *unhashed[FLOW_BATCH_MAX];
+    gboolean parsed[FLOW_BATCH_MAX];
+    guint found = 0;
+    guint done;
+    guint n;
+    guint i;
+
+    g_return_val_if_fail(!table->records, 0);
+    for (done = 0; done < count; done += n) {
+        guint pending = 0;
+
+        /* Parse the whole chunk first so the hashes can be computed together */
+        n = MIN(count - done, FLOW_BATCH_MAX);
+        for (i = 0; i < n; i++) {
+            GInetFlow *packet = &packets[i];
+
+            memset(packet, 0, sizeof(GInetFlow));
+            packet->timestamp = timestamps ? timestamps[done + i] : 0;
+            parsed[i] = flow_packet_parse(table, packet, frames[done + i],
+                                          lengths[done + i], hashes ? hashes[done + i] : 0,
+                                          l2);
+            if (parsed[i] && !packet->hash)
+                unhashed[pending++] = packet;
+        }
+        table->hash_batch_fn(table, unhashed, pending);
+
+        for (i = 0; i < n; i++) {
+            GInetFlow *flow = NULL;
+
+            if (parsed[i])
+                flow = flow_table_get(table, &packets[i], update);
+            if (flow)
+                found++;
+            flows[done + i] = flow;
+        }
+    }
+    return found;
+}
+
+/* Flow records are flows without the GObject: a table created with
+ * "records" set allocates them as plain structs, skipping type instance
+ * setup and reference counting on every new flow. The table owns them
+ * until they are released.
+ */
+#define RECORD_FLOW(r)      ((GInetFlow *) (r))
+
+GInetFlowRecord *g_inet_flow_record_get_full(GInetFlowTable * table,
+                                             const guint8 * frame, guint length,
+                                             guint64 hash, guint64 timestamp,
+                                             gboolean update, gboolean l2)
+{
+    GInetFlow packet = {.timestamp = timestamp };
+
+    g_return_val_if_fail(table->records, NULL);
+    if (!flow_packet_parse(table, &packet, frame, length, hash, l2))
+        return NULL;
+    flow_hash64(table, &packet);
+    return (GInetFlowRecord *) flow_table_get(table, &packet, update);
+}
+
+GInetFlowRecord *g_inet_flow_record_expire(GInetFlowTable * table, guint64 ts)
+{
+    g_return_val_if_fail(table->records, NULL);
+    return (GInetFlowRecord *) flow_expire(table, ts);
+}
+
+/* Due flows are gathered first and handed over with no stripe locked, so
+ * the callback can release them. Each is handed over once per call.
+ */
+static guint flow_expire_batch(GInetFlowTable * table, guint64 ts, guint max,
+                               GFunc callback, gpointer user_data, gboolean * more)
+{
+    GPtrArray *flows = g_ptr_array_new();
+    gboolean left = FALSE;
+    guint n = 0;
+    guint i;
+
+    for (i = 0; i < table->nstripes; i++) {
+        GInetFlowTable *stripe = table->stripes[i];
+        guint first = flows->len;
+        guint j;
+
+        /* Unlinked before the lock is dropped, so no other thread can find
+         * the flows or hand them to a second callback
+         */
+        g_mutex_lock(&stripe->lock);
+        n += wheel_collect(&stripe->wheel, ts, max - n, flows, &left);
+        for (j = first; j < flows->len; j++)
+            flow_unlink(flows->pdata[j]);
+        g_mutex_unlock(&stripe->lock);
+    }
+    if (!table->nstripes)
+        n = wheel_collect(&table->wheel, ts, max, flows, &left);
+    for (i = 0; i < flows->len; i++)
+        callback(flows->pdata[i], user_data);
+    g_ptr_array_free(flows, TRUE);
+    if (more)
+        *more = left;
+    return n;
+}
+
+guint g_inet_flow_expire_batch(GInetFlowTable * table, guint64 ts, guint max,
+                               GIFFunc callback, gpointer user_data, gboolean * more)
+{
+    g_return_val_if_fail(!table->records, 0);
+    return flow_expire_batch(table, ts, max, (GFunc) callback, user_data, more);
+}
+
+guint g_inet_flow_record_expire_batch(GInetFlowTable * table, guint64 ts, guint max,
+                                      GIFRecordFunc callback, gpointer user_data,
+                                      gboolean * more)
+{
+    g_return_val_if_fail(table->records, 0);
+    return flow_expire_batch(table, ts, max, (GFunc) callback, user_data, more);
+}
+
+static guint64 flow_next_deadline(GInetFlowTable * table)
+{
+    guint64 next = G_MAXUINT64;
+    guint i;
+
+    for (i = 0; i < table->nstripes; i++) {
+        GInetFlowTable *stripe = table->stripes[i];
+
+        g_mutex_lock(&stripe->lock);
+        next = MIN(next, wheel_next_deadline(&stripe->wheel));
+        g_mutex_unlock(&stripe->lock);
+    }
+    return MIN(next, wheel_next_deadline(&table->wheel));
+}
+
+/* Flows put on the wheel while the next deadline is worked out lower wake,
+ * so the source is never set to run later than they are due. Flows still
+ * due by ts after a dispatch were kept by the callback, and are handed over
+ * again a tick later rather than the source spinning on them.
+ */
+static void aging_source_schedule(struct flow_aging_source *aging, gboolean more,
+                                  guint64 ts)
+{
+    guint64 next = 0;
+
+    if (!more) {
+        g_mutex_lock(&aging->lock);
+        __atomic_store_n(&aging->wake, G_MAXUINT64, __ATOMIC_RELAXED);
+        g_mutex_unlock(&aging->lock);
+        next = flow_next_deadline(aging->table);
+        if (ts && next <= ts)
+            next = ts + (G_GUINT64_CONSTANT(1) << WHEEL_TICK_BITS);
+    }
+    g_mutex_lock(&aging->lock);
+    next = MIN(next, aging->wake);
+    __atomic_store_n(&aging->wake, next, __ATOMIC_RELAXED);
+    aging_source_ready(aging, next);
+    g_mutex_unlock(&aging->lock);
+}
+
+static gboolean aging_source_dispatch(GSource * source, GSourceFunc callback,
+                                      gpointer user_data)
+{
+    struct flow_aging_source *aging = (struct flow_aging_source *) source;
+    guint64 ts = get_time_us();
+    gboolean more = FALSE;
+
+    if (!callback) {
+        g_warning("Flow aging source dispatched without a callback");
+        return G_SOURCE_REMOVE;
+    }
+    flow_expire_batch(aging->table, ts, aging->budget, (GFunc) callback, user_data, &more);
+    aging_source_schedule(aging, more, ts);
+    return G_SOURCE_CONTINUE;
+}
+
+/* Stripes put flows on their wheels under their locks */
+static void aging_source_set(GInetFlowTable * table, GSource * source)
+{
+    guint i;
+
+    for (i = 0; i < table->nstripes; i++)
+        g_mutex_lock(&table->stripes[i]->lock);
+    table->aging = source;
+    for (i = 0; i < table->nstripes; i++)
+        g_mutex_unlock(&table->stripes[i]->lock);
+}
+
+static void aging_source_finalize(GSource * source)
+{
+    struct flow_aging_source *aging = (struct flow_aging_source *) source;
+
+    aging_source_set(aging->table, NULL);
+    g_mutex_clear(&aging->lock);
+    g_object_unref(aging->table);
+}
+
+static GSourceFuncs aging_source_funcs = {
+    NULL,
+    NULL,
+    aging_source_dispatch,
+    aging_source_finalize,
+};
+
+GSource *g_inet_flow_aging_source_new(GInetFlowTable * table, guint budget)
+{
+    struct flow_aging_source *aging;
+    GSource *source;
+
+    g_return_val_if_fail(budget > 0, NULL);
+    if (table->aging) {
+        g_warning("Flow table already has an aging source");
+        return NULL;
+    }
+    source = g_source_new(&aging_source_funcs, sizeof(struct flow_aging_source));
+    g_source_set_name(source, "GInetFlowAgingSource");
+    aging = (struct flow_aging_source *) source;
+    aging->table = g_object_ref(table);
+    aging->budget = budget;
+    g_mutex_init(&aging->lock);
+    aging->wake = G_MAXUINT64;
+    aging_source_set(table, source);
+    aging_source_schedule(aging, FALSE, 0);
+    return source;
+}
+
+/* A wrapper still held by the caller keeps a snapshot of the record */
+static void record_free(GInetFlowTable * table, GInetFlow * flow)
+{
+    GInetFlow *object = flow->object;
+
+    if (object) {
+        memcpy(&object->table, &flow->table,
+               sizeof(GInetFlow) - G_STRUCT_OFFSET(GInetFlow, table));
+        object->table = NULL;
+        object->list.data = object;
+        object->list.next = object->list.prev = NULL;
+        object->object = NULL;
+        object->record = NULL;
+    }
+    flow_release(table, flow);
+}
+
+void g_inet_flow_record_release(GInetFlowRecord * record)
+{
+    GInetFlow *flow = RECORD_FLOW(record);
+    GInetFlowTable *table = flow->table;
+
+    stripe_lock(table);
+    flow_unlink(flow);
+    record_free(table, flow);
+    stripe_unlock(table);
+}
+
+/* The wrapper is created on first use and shared until its last unref */
+GInetFlow *g_inet_flow_record_object(GInetFlowRecord * record)
+{
+    GInetFlow *flow = RECORD_FLOW(record);
+
+    if (flow->object)
+        return (GInetFlow *) g_object_ref(flow->object);
+    flow->object = (GInetFlow *) g_object_new(G_INET_TYPE_FLOW, NULL);
+    flow->object->record = flow;
+    return flow->object;
+}
+
+GInetFlowState g_inet_flow_record_state(const GInetFlowRecord * record)
+{
+    return RECORD_FLOW(record)->state;
+}
+
+guint64 g_inet_flow_record_packets(const GInetFlowRecord * record)
+{
+    return RECORD_FLOW(record)->packets;
+}
+
+guint64 g_inet_flow_record_timestamp(const GInetFlowRecord * record)
 {
-    flow->state = FLOW_NEW;
+    return RECORD_FLOW(record)->timestamp;
 }
 
-GInetFlow *g_inet_flow_expire(GInetFlowTable * table, guint64 ts)
+guint64 g_inet_flow_record_hash(const GInetFlowRecord * record)
 {
-    GList *iter;
-    int i;
+    return RECORD_FLOW(record)->hash;
+}
 
-    for (i = 0; i < LIFETIME_COUNT; i++) {
-        guint64 timeout = (lifetime_values[i] * TIMESTAMP_RESOLUTION_US);
-        GList *first = g_list_first(table->list[i]);
-        if (first) {
-            GInetFlow *flow = (GInetFlow *) first->data;
-            if (flow->timestamp + timeout <= ts) {
-                return flow;
-            }
-        }
-    }
-    return NULL;
+guint g_inet_flow_record_family(const GInetFlowRecord * record)
+{
+    return RECORD_FLOW(record)->family;
 }
 
-GInetFlow *g_inet_flow_get(GInetFlowTable * table, const guint8 * frame, guint length)
+guint16 g_inet_flow_record_protocol(const GInetFlowRecord * record)
 {
-    return g_inet_flow_get_full(table, frame, length, 0, 0, FALSE, TRUE);
+    return RECORD_FLOW(record)->tuple.protocol;
 }
 
-GInetFlow *g_inet_flow_get_full(GInetFlowTable * table,
-                                const guint8 * frame, guint length,
-                                guint16 hash, guint64 timestamp, gboolean update,
-                                gboolean l2)
+guint16 g_inet_flow_record_lport(const GInetFlowRecord * record)
 {
-    GInetFlow packet = {.timestamp = timestamp };
-    GInetFlow *flow;
+    return RECORD_FLOW(record)->tuple.lower_port;
+}
 
-    if (l2) {
-        if (!flow_parse(&packet, frame, length, hash, table)) {
-            return NULL;
-        }
-    } else if (!flow_parse_ip(&packet, frame, length, hash, table)) {
-        return NULL;
-    }
+guint16 g_inet_flow_record_uport(const GInetFlowRecord * record)
+{
+    return RECORD_FLOW(record)->tuple.upper_port;
+}
 
-    flow = (GInetFlow *) g_hash_table_lookup(table->table, &packet);
-    if (flow) {
-        if (update) {
-            remove_flow_by_expiry(table, flow, flow->lifetime);
-            g_inet_flow_update(flow, &packet);
-            insert_flow_by_expiry(table, flow, flow->lifetime);
-            flow->timestamp = timestamp ? : get_time_us();
-            flow->packets++;
-        }
-        table->hits++;
-    } else {
-        /* Check if max table size is reached */
-        if (table->max > 0 && g_hash_table_size(table->table) >= table->max)
-            return NULL;
+const guint8 *g_inet_flow_record_lip(const GInetFlowRecord * record)
+{
+    return (const guint8 *) RECORD_FLOW(record)->tuple.lower_ip;
+}
 
-        flow = (GInetFlow *) g_object_new(G_INET_TYPE_FLOW, NULL);
-        flow->table = table;
-        flow->list.data = flow;
-        /* Set default lifetime before processing further - this may be over written */
-        flow->lifetime = G_INET_FLOW_DEFAULT_NEW_TIMEOUT;
-        flow->family = packet.family;
-        flow->direction = packet.direction;
-        flow->hash = packet.hash;
-        flow->tuple = packet.tuple;
-        g_hash_table_replace(table->table, (gpointer) flow, (gpointer) flow);
-        table->misses++;
-        flow->timestamp = timestamp ? : get_time_us();
-        g_inet_flow_update(flow, &packet);
-        insert_flow_by_expiry(table, flow, flow->lifetime);
-        flow->packets++;
-    }
-    return flow;
+const guint8 *g_inet_flow_record_uip(const GInetFlowRecord * record)
+{
+    return (const guint8 *) RECORD_FLOW(record)->tuple.upper_ip;
 }
 
 static void g_inet_flow_table_finalize(GObject * object)
 {
     GInetFlowTable *table = G_INET_FLOW_TABLE(object);
-    g_hash_table_destroy(table->table);
+    guint i;
+
+    for (i = 0; i < table->nstripes; i++)
+        g_object_unref(table->stripes[i]);
+    table->nstripes = 0;
+    g_free(table->stripes);
+    if (table->owner)
+        g_mutex_clear(&table->lock);
+    else
+        free(table->counters);
+    if (table->records) {
+        GInetFlow *flow;
+        while ((flow = flow_expire(table, G_MAXUINT64)))
+            g_inet_flow_record_release((GInetFlowRecord *) flow);
+        epoch_reclaim(table, TRUE);
+        epoch_reclaim(table, TRUE);
+        g_list_free_full(table->slabs, record_slab_free);
+        table->pool = NULL;
+    }
+    /* The table is only finalized once no reader can be using it */
+    epoch_reclaim(table, TRUE);
+    epoch_reclaim(table, TRUE);
+    while (table->pool)
+        g_object_unref(pool_pop(table));
+    if (table->table)
+        g_hash_table_destroy(table->table);
+    buckets_free(&table->buckets);
+    buckets_free(&table->buckets4);
+    buckets_free(&table->migrating);
+    g_free(table->cache);
+    g_free(table->timeouts);
+    g_free(table->toeplitz);
     G_OBJECT_CLASS(g_inet_flow_table_parent_class)->finalize(object);
 }
 
@@ -956,35 +3517,256 @@ enum {
     TABLE_SIZE = 1,
     TABLE_HITS,
     TABLE_MISSES,
-    TABLE_MAX
+    TABLE_MAX,
+    TABLE_HASH_TYPE,
+    TABLE_HASH_IMPL,
+    TABLE_HASH_FIELDS,
+    TABLE_ENGINE,
+    TABLE_CAPACITY,
+    TABLE_INCREMENTAL_RESIZE,
+    TABLE_RECORDS,
+    TABLE_RECYCLE,
+    TABLE_IN_USE,
+    TABLE_FREE,
+    TABLE_HIGH_WATER,
+    TABLE_HUGE_PAGES,
+    TABLE_PAGE_SIZE,
+    TABLE_NUMA_NODE,
+    TABLE_STRIPES,
+    TABLE_LOCK_FREE_LOOKUPS,
+    TABLE_CACHE_SIZE,
+    TABLE_CACHE_HIT_RATE,
 };
 
+static void g_inet_flow_table_set_property(GObject * object, guint prop_id,
+                                           const GValue * value, GParamSpec * pspec)
+{
+    GInetFlowTable *table = G_INET_FLOW_TABLE(object);
+    guint i;
+
+    switch (prop_id) {
+    case TABLE_HASH_TYPE:
+        if (!g_inet_flow_table_hash_set(table, g_value_get_uint(value)))
+            g_warning("Cannot change the hash of a table that holds flows");
+        break;
+    case TABLE_HASH_FIELDS:
+        if (!g_inet_flow_table_hash_fields_set(table, g_value_get_uint(value)))
+            g_warning("Cannot change the hash of a table that holds flows");
+        break;
+    case TABLE_ENGINE:
+        table->engine = g_value_get_uint(value);
+        break;
+    case TABLE_CAPACITY:
+        table->capacity = g_value_get_uint64(value);
+        break;
+    case TABLE_INCREMENTAL_RESIZE:
+        table->incremental = g_value_get_boolean(value);
+        break;
+    case TABLE_RECORDS:
+        table->records = g_value_get_boolean(value);
+        break;
+    case TABLE_RECYCLE:
+        table->recycle = g_value_get_boolean(value);
+        for (i = 0; i < table->nstripes; i++)
+            table->stripes[i]->recycle = table->recycle;
+        break;
+    case TABLE_HUGE_PAGES:
+        table->huge = g_value_get_boolean(value);
+        break;
+    case TABLE_NUMA_NODE:
+        table->node = g_value_get_int(value);
+        break;
+    case TABLE_STRIPES:
+        table->nstripes = g_value_get_uint(value);
+        break;
+    case TABLE_LOCK_FREE_LOOKUPS:
+        table->lock_free = g_value_get_boolean(value);
+        break;
+    case TABLE_CACHE_SIZE:
+        table->cache_size = g_value_get_uint(value);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID(table, prop_id, pspec);
+        break;
+    }
+}
+
 static void g_inet_flow_table_get_property(GObject * object, guint prop_id,
                                            GValue * value, GParamSpec * pspec)
 {
     GInetFlowTable *table = G_INET_FLOW_TABLE(object);
+    guint64 lookups;
+
     switch (prop_id) {
     case TABLE_SIZE:
-        g_value_set_uint64(value, g_hash_table_size(table->table));
+        g_value_set_uint64(value, flow_table_size(table));
         break;
     case TABLE_HITS:
-        g_value_set_uint64(value, table->hits);
+        g_value_set_uint64(value, flow_table_count(table, FALSE));
         break;
     case TABLE_MISSES:
-        g_value_set_uint64(value, table->misses);
+        g_value_set_uint64(value, flow_table_count(table, TRUE));
         break;
     case TABLE_MAX:
         g_value_set_uint64(value, table->max);
         break;
+    case TABLE_HASH_TYPE:
+        g_value_set_uint(value, table->hash_type);
+        break;
+    case TABLE_HASH_IMPL:
+        g_value_set_string(value, flow_hash_name(table));
+        break;
+    case TABLE_HASH_FIELDS:
+        g_value_set_uint(value, table->hash_fields);
+        break;
+    case TABLE_ENGINE:
+        g_value_set_uint(value, table->engine);
+        break;
+    case TABLE_CAPACITY:
+        g_value_set_uint64(value, table->capacity);
+        break;
+    case TABLE_INCREMENTAL_RESIZE:
+        g_value_set_boolean(value, table->incremental);
+        break;
+    case TABLE_RECORDS:
+        g_value_set_boolean(value, table->records);
+        break;
+    case TABLE_RECYCLE:
+        g_value_set_boolean(value, table->recycle);
+        break;
+    case TABLE_IN_USE:
+        g_value_set_uint64(value, FLOW_TABLE_SUM(table, in_use));
+        break;
+    case TABLE_FREE:
+        g_value_set_uint64(value, FLOW_TABLE_SUM(table, free));
+        break;
+    case TABLE_HIGH_WATER:
+        g_value_set_uint64(value, FLOW_TABLE_SUM(table, high_water));
+        break;
+    case TABLE_HUGE_PAGES:
+        g_value_set_boolean(value, table->huge);
+        break;
+    case TABLE_PAGE_SIZE:
+        g_value_set_uint64(value, flow_page_size(table));
+        break;
+    case TABLE_NUMA_NODE:
+        g_value_set_int(value, table->node);
+        break;
+    case TABLE_STRIPES:
+        g_value_set_uint(value, table->nstripes);
+        break;
+    case TABLE_LOCK_FREE_LOOKUPS:
+        g_value_set_boolean(value, table->lock_free);
+        break;
+    case TABLE_CACHE_SIZE:
+        g_value_set_uint(value, table->cache_size);
+        break;
+    case TABLE_CACHE_HIT_RATE:
+        lookups = FLOW_TABLE_SUM(table, cache_lookups);
+        g_value_set_double(value, lookups ?
+                           (gdouble) FLOW_TABLE_SUM(table, cache_hits) / lookups : 0.0);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID(table, prop_id, pspec);
         break;
     }
 }
 
+/* Stripes are built like the table they make up, each sized for an even
+ * share of its capacity. The table itself has no index.
+ */
+static void stripes_init(GInetFlowTable * table)
+{
+    gpointer counters;
+    guint nstripes = 1;
+    guint i;
+
+    while (nstripes < table->nstripes)
+        nstripes *= 2;
+    table->nstripes = nstripes;
+    if (table->engine == G_INET_FLOW_TABLE_ENGINE_CUCKOO && !table->capacity)
+        table->capacity = CUCKOO_DEFAULT_CAPACITY;
+    if (posix_memalign(&counters, 64, COUNTER_SLOTS * sizeof(struct flow_counters)) != 0)
+        g_error("Failed to allocate flow counters");
+    memset(counters, 0, COUNTER_SLOTS * sizeof(struct flow_counters));
+    table->counters = counters;
+    table->stripes = g_new0(GInetFlowTable *, nstripes);
+    for (i = 0; i < nstripes; i++) {
+        GInetFlowTable *stripe = g_object_new(G_INET_TYPE_FLOW_TABLE,
+                                              "engine", table->engine,
+                                              "capacity",
+                                              (table->capacity + nstripes - 1) / nstripes,
+                                              "incremental-resize", table->incremental,
+                                              "records", table->records,
+                                              "recycle", table->recycle,
+                                              "huge-pages", table->huge,
+                                              "numa-node", table->node,
+                                              "cache-size", table->cache_size, NULL);
+        g_mutex_init(&stripe->lock);
+        stripe->owner = table;
+        stripe->counters = table->counters;
+        stripe->lock_free = table->lock_free;
+        table->stripes[i] = stripe;
+    }
+}
+
+/* The index can only be built once the construct-only engine is known */
+static void g_inet_flow_table_constructed(GObject * object)
+{
+    GInetFlowTable *table = G_INET_FLOW_TABLE(object);
+
+    /* Only the Swiss index publishes its arrays safely for readers */
+    if (table->lock_free && (!table->nstripes || table->incremental ||
+                             table->engine != G_INET_FLOW_TABLE_ENGINE_SWISS)) {
+        g_warning("Lock-free lookups need a striped Swiss table");
+        table->lock_free = FALSE;
+    }
+    if (table->cache_size) {
+        guint size = 2;
+
+        while (size < table->cache_size)
+            size *= 2;
+        table->cache_size = size;
+        table->cache_shift = 64 - g_bit_nth_msf(size, -1);
+    }
+    if (table->nstripes) {
+        stripes_init(table);
+        G_OBJECT_CLASS(g_inet_flow_table_parent_class)->constructed(object);
+        return;
+    }
+    if (table->cache_size)
+        table->cache = g_new0(struct flow_cache_entry, table->cache_size);
+    table->buckets.huge = table->buckets4.huge = table->huge;
+    table->buckets.node = table->buckets4.node = table->node;
+    switch (table->engine) {
+    case G_INET_FLOW_TABLE_ENGINE_SWISS:
+        buckets_init(&table->buckets, buckets_for_capacity(table->capacity));
+        break;
+    case G_INET_FLOW_TABLE_ENGINE_DUAL:
+        /* Capacity sizes the IPv4 index, IPv6 flows are few and grow their own */
+        buckets_init(&table->buckets4, buckets4_for_capacity(table->capacity));
+        buckets_init(&table->buckets, SWISS_MIN_BUCKETS);
+        break;
+    case G_INET_FLOW_TABLE_ENGINE_CUCKOO:
+        /* Never resized, so lookups and inserts stay bounded */
+        if (!table->capacity)
+            table->capacity = CUCKOO_DEFAULT_CAPACITY;
+        buckets_init(&table->buckets, buckets_for_capacity(table->capacity));
+        break;
+    case G_INET_FLOW_TABLE_ENGINE_GHASH:
+    default:
+        table->table = g_hash_table_new((GHashFunc) flow_hash, (GEqualFunc) flow_compare);
+        break;
+    }
+    G_OBJECT_CLASS(g_inet_flow_table_parent_class)->constructed(object);
+}
+
 static void g_inet_flow_table_class_init(GInetFlowTableClass * class)
 {
     GObjectClass *object_class = G_OBJECT_CLASS(class);
+    hash_init();
+    object_class->constructed = g_inet_flow_table_constructed;
+    object_class->set_property = g_inet_flow_table_set_property;
     object_class->get_property = g_inet_flow_table_get_property;
     g_object_class_install_property(object_class, TABLE_SIZE,
                                     g_param_spec_uint64("size", "Size",
@@ -1002,12 +3784,133 @@ static void g_inet_flow_table_class_init(GInetFlowTableClass * class)
                                     g_param_spec_uint64("max", "Max",
                                                         "Maximum number of flows allowed in the table",
                                                         0, 0, 0, G_PARAM_READABLE));
+    g_object_class_install_property(object_class, TABLE_HASH_TYPE,
+                                    g_param_spec_uint("hash-type", "Hash type",
+                                                      "Algorithm used to hash flow tuples",
+                                                      G_INET_FLOW_HASH_CRC16,
+                                                      G_INET_FLOW_HASH_SIPHASH,
+                                                      G_INET_FLOW_HASH_CRC16,
+                                                      G_PARAM_READWRITE));
+    g_object_class_install_property(object_class, TABLE_HASH_IMPL,
+                                    g_param_spec_string("hash-impl", "Hash implementation",
+                                                        "Implementation of the hash in use",
+                                                        NULL, G_PARAM_READABLE));
+    g_object_class_install_property(object_class, TABLE_HASH_FIELDS,
+                                    g_param_spec_uint("hash-fields", "Hash fields",
+                                                      "Fields covered by the Toeplitz hash",
+                                                      G_INET_FLOW_HASH_FIELDS_4TUPLE,
+                                                      G_INET_FLOW_HASH_FIELDS_2TUPLE,
+                                                      G_INET_FLOW_HASH_FIELDS_4TUPLE,
+                                                      G_PARAM_READWRITE));
+    g_object_class_install_property(object_class, TABLE_ENGINE,
+                                    g_param_spec_uint("engine", "Engine",
+                                                      "Data structure indexing the flows",
+                                                      G_INET_FLOW_TABLE_ENGINE_GHASH,
+                                                      G_INET_FLOW_TABLE_ENGINE_DUAL,
+                                                      G_INET_FLOW_TABLE_ENGINE_GHASH,
+                                                      G_PARAM_READWRITE |
+                                                      G_PARAM_CONSTRUCT_ONLY));
+    g_object_class_install_property(object_class, TABLE_CAPACITY,
+                                    g_param_spec_uint64("capacity", "Capacity",
+                                                        "Number of flows the index is sized for up front",
+                                                        0, G_MAXUINT64, 0,
+                                                        G_PARAM_READWRITE |
+                                                        G_PARAM_CONSTRUCT_ONLY));
+    g_object_class_install_property(object_class, TABLE_INCREMENTAL_RESIZE,
+                                    g_param_spec_boolean("incremental-resize",
+                                                         "Incremental resize",
+                                                         "Grow the Swiss index a few buckets at a time",
+                                                         FALSE,
+                                                         G_PARAM_READWRITE |
+                                                         G_PARAM_CONSTRUCT_ONLY));
+    g_object_class_install_property(object_class, TABLE_RECORDS,
+                                    g_param_spec_boolean("records", "Records",
+                                                         "Hold plain flow records rather than flow objects",
+                                                         FALSE,
+                                                         G_PARAM_READWRITE |
+                                                         G_PARAM_CONSTRUCT_ONLY));
+    g_object_class_install_property(object_class, TABLE_RECYCLE,
+                                    g_param_spec_boolean("recycle", "Recycle",
+                                                         "Reuse released flows, which keep their object data",
+                                                         FALSE, G_PARAM_READWRITE));
+    g_object_class_install_property(object_class, TABLE_IN_USE,
+                                    g_param_spec_uint64("in-use", "In use",
+                                                        "Number of flows allocated to the table",
+                                                        0, G_MAXUINT64, 0,
+                                                        G_PARAM_READABLE));
+    g_object_class_install_property(object_class, TABLE_FREE,
+                                    g_param_spec_uint64("free", "Free",
+                                                        "Number of flows on the free list",
+                                                        0, G_MAXUINT64, 0,
+                                                        G_PARAM_READABLE));
+    g_object_class_install_property(object_class, TABLE_HIGH_WATER,
+                                    g_param_spec_uint64("high-water", "High water",
+                                                        "Most flows ever allocated to the table at once",
+                                                        0, G_MAXUINT64, 0,
+                                                        G_PARAM_READABLE));
+    g_object_class_install_property(object_class, TABLE_HUGE_PAGES,
+                                    g_param_spec_boolean("huge-pages", "Huge pages",
+                                                         "Back the index and record slabs with huge pages",
+                                                         FALSE,
+                                                         G_PARAM_READWRITE |
+                                                         G_PARAM_CONSTRUCT_ONLY));
+    g_object_class_install_property(object_class, TABLE_PAGE_SIZE,
+                                    g_param_spec_uint64("page-size", "Page size",
+                                                        "Page size backing the index and record slabs",
+                                                        0, G_MAXUINT64, 0,
+                                                        G_PARAM_READABLE));
+    g_object_class_install_property(object_class, TABLE_NUMA_NODE,
+                                    g_param_spec_int("numa-node", "NUMA node",
+                                                     "Node the index and record slabs are allocated on, or -1 for first touch",
+                                                     -1, NUMA_NODES_MAX - 1, -1,
+                                                     G_PARAM_READWRITE |
+                                                     G_PARAM_CONSTRUCT_ONLY));
+    g_object_class_install_property(object_class, TABLE_STRIPES,
+                                    g_param_spec_uint("stripes", "Stripes",
+                                                      "Number of separately locked stripes for use from many threads, 0 for none",
+                                                      0, TABLE_STRIPES_MAX, 0,
+                                                      G_PARAM_READWRITE |
+                                                      G_PARAM_CONSTRUCT_ONLY));
+    g_object_class_install_property(object_class, TABLE_LOCK_FREE_LOOKUPS,
+                                    g_param_spec_boolean("lock-free-lookups",
+                                                         "Lock-free lookups",
+                                                         "Let lookups that do not update flows run without the stripe locks",
+                                                         FALSE,
+                                                         G_PARAM_READWRITE |
+                                                         G_PARAM_CONSTRUCT_ONLY));
+    g_object_class_install_property(object_class, TABLE_CACHE_SIZE,
+                                    g_param_spec_uint("cache-size", "Cache size",
+                                                      "Entries in the exact match cache checked before the index, 0 for none",
+                                                      0, FLOW_CACHE_MAX, 0,
+                                                      G_PARAM_READWRITE |
+                                                      G_PARAM_CONSTRUCT_ONLY));
+    g_object_class_install_property(object_class, TABLE_CACHE_HIT_RATE,
+                                    g_param_spec_double("cache-hit-rate", "Cache hit rate",
+                                                        "Fraction of lookups answered by the exact match cache",
+                                                        0.0, 1.0, 0.0, G_PARAM_READABLE));
     object_class->finalize = g_inet_flow_table_finalize;
 }
 
 static void g_inet_flow_table_init(GInetFlowTable * table)
 {
-    table->table = g_hash_table_new((GHashFunc) flow_hash, (GEqualFunc) flow_compare);
+    guint i;
+
+    table->node = -1;
+    table->timeouts = g_new(guint32, FLOW_STATES);
+    memcpy(table->timeouts, default_timeouts, sizeof(default_timeouts));
+    table->ntimeouts = FLOW_STATES;
+    for (i = 0; i < 256; i++) {
+        table->timeout_select[i][FLOW_NEW] = FLOW_NEW;
+        table->timeout_select[i][FLOW_OPEN] = FLOW_OPEN;
+        table->timeout_select[i][FLOW_CLOSED] = FLOW_CLOSED;
+    }
+    table->hash_type = G_INET_FLOW_HASH_CRC16;
+    table->hash_fn = flow_hash_crc16;
+    table->hash_batch_fn = flow_hash_batch_scalar;
+    table->hash_fields = G_INET_FLOW_HASH_FIELDS_4TUPLE;
+    memcpy(table->hash_key, toeplitz_default_key, G_INET_FLOW_HASH_KEY_MAX);
+    table->sip_key[0] = ((guint64) g_random_int() << 32) | g_random_int();
+    table->sip_key[1] = ((guint64) g_random_int() << 32) | g_random_int();
 }
 
 GInetFlowTable *g_inet_flow_table_new(void)
@@ -1015,16 +3918,380 @@ GInetFlowTable *g_inet_flow_table_new(void)
     return (GInetFlowTable *) g_object_new(G_INET_TYPE_FLOW_TABLE, NULL);
 }
 
+GInetFlowTable *g_inet_flow_table_new_with_engine(GInetFlowTableEngine engine)
+{
+    return (GInetFlowTable *) g_object_new(G_INET_TYPE_FLOW_TABLE, "engine", engine, NULL);
+}
+
+/* The index and every flow are allocated here, and max is set to the
+ * capacity, so steady state packet processing does not allocate.
+ */
+GInetFlowTable *g_inet_flow_table_new_sized(guint64 capacity)
+{
+    GInetFlowTable *table;
+    guint64 i;
+
+    table = (GInetFlowTable *) g_object_new(G_INET_TYPE_FLOW_TABLE,
+                                            "engine", G_INET_FLOW_TABLE_ENGINE_SWISS,
+                                            "capacity", capacity, "recycle", TRUE, NULL);
+    table->max = capacity;
+    for (i = 0; i < capacity; i++)
+        pool_push(table, (GInetFlow *) g_object_new(G_INET_TYPE_FLOW, NULL));
+    return table;
+}
+
 void g_inet_flow_table_max_set(GInetFlowTable * table, guint64 value)
 {
+    guint i;
+
     table->max = value;
+    /* Stripes each take an even share */
+    for (i = 0; i < table->nstripes; i++)
+        table->stripes[i]->max = (value + table->nstripes - 1) / table->nstripes;
+}
+
+gboolean g_inet_flow_table_hash_set(GInetFlowTable * table, GInetFlowHash type)
+{
+    /* Existing flows would be filed under the old hash */
+    if (flow_table_size(table) != 0)
+        return FALSE;
+
+    table->hash_batch_fn = flow_hash_batch_scalar;
+    switch (type) {
+    case G_INET_FLOW_HASH_CRC16:
+        table->hash_fn = flow_hash_crc16;
+        break;
+    case G_INET_FLOW_HASH_CRC32C:
+        table->hash_fn = crc32c_impl;
+        table->hash_batch_fn = crc32c_batch_impl;
+        break;
+    case G_INET_FLOW_HASH_TOEPLITZ:
+        toeplitz_init(table);
+        table->hash_fn = flow_hash_toeplitz;
+        break;
+    case G_INET_FLOW_HASH_SIPHASH:
+        table->hash_fn = flow_hash_siphash;
+        table->hash_batch_fn = siphash_batch_impl;
+        break;
+    default:
+        return FALSE;
+    }
+    table->hash_type = type;
+    return TRUE;
+}
+
+gboolean g_inet_flow_table_hash_key_set(GInetFlowTable * table, const guint8 * key,
+                                        gsize length)
+{
+    if (flow_table_size(table) != 0 || length > G_INET_FLOW_HASH_KEY_MAX)
+        return FALSE;
+
+    /* A public RSS key must not replace the secret SipHash key */
+    if (table->hash_type == G_INET_FLOW_HASH_SIPHASH) {
+        guint8 sip[sizeof(table->sip_key)] = { };
+
+        memcpy(sip, key, MIN(length, sizeof(sip)));
+        memcpy(table->sip_key, sip, sizeof(sip));
+        table->sip_key[0] = GUINT64_FROM_LE(table->sip_key[0]);
+        table->sip_key[1] = GUINT64_FROM_LE(table->sip_key[1]);
+        return TRUE;
+    }
+    memset(table->hash_key, 0, G_INET_FLOW_HASH_KEY_MAX);
+    memcpy(table->hash_key, key, length);
+    if (table->toeplitz)
+        toeplitz_init(table);
+    return TRUE;
+}
+
+gboolean g_inet_flow_table_hash_fields_set(GInetFlowTable * table,
+                                           GInetFlowHashFields fields)
+{
+    if (flow_table_size(table) != 0 || fields > G_INET_FLOW_HASH_FIELDS_2TUPLE)
+        return FALSE;
+
+    table->hash_fields = fields;
+    return TRUE;
+}
+
+/* Stripes keep their own copy of their table's timeout classes */
+gint g_inet_flow_table_timeout_class_add(GInetFlowTable * table, guint seconds)
+{
+    guint i;
+
+    if (table->ntimeouts >= TIMEOUT_CLASSES_MAX)
+        return -1;
+    for (i = 0; i < table->nstripes; i++) {
+        g_mutex_lock(&table->stripes[i]->lock);
+        g_inet_flow_table_timeout_class_add(table->stripes[i], seconds);
+        g_mutex_unlock(&table->stripes[i]->lock);
+    }
+    table->timeouts = g_renew(guint32, table->timeouts, table->ntimeouts + 1);
+    table->timeouts[table->ntimeouts] = seconds;
+    return table->ntimeouts++;
+}
+
+gboolean g_inet_flow_table_timeout_class_set(GInetFlowTable * table, guint timeout_class,
+                                             guint seconds)
+{
+    guint i;
+
+    if (timeout_class >= table->ntimeouts)
+        return FALSE;
+    for (i = 0; i < table->nstripes; i++) {
+        g_mutex_lock(&table->stripes[i]->lock);
+        table->stripes[i]->timeouts[timeout_class] = seconds;
+        g_mutex_unlock(&table->stripes[i]->lock);
+    }
+    table->timeouts[timeout_class] = seconds;
+    return TRUE;
+}
+
+gboolean g_inet_flow_table_timeout_select(GInetFlowTable * table, guint8 protocol,
+                                          GInetFlowState state, guint timeout_class)
+{
+    guint i;
+
+    if (state >= FLOW_STATES || timeout_class >= table->ntimeouts)
+        return FALSE;
+    for (i = 0; i < table->nstripes; i++) {
+        g_mutex_lock(&table->stripes[i]->lock);
+        table->stripes[i]->timeout_select[protocol][state] = timeout_class;
+        g_mutex_unlock(&table->stripes[i]->lock);
+    }
+    table->timeout_select[protocol][state] = timeout_class;
+    return TRUE;
 }
 
 void g_inet_flow_foreach(GInetFlowTable * table, GIFFunc func, gpointer user_data)
 {
-    int i;
+    guint i;
+
+    g_return_if_fail(!table->records);
+    for (i = 0; i < table->nstripes; i++) {
+        g_mutex_lock(&table->stripes[i]->lock);
+        g_inet_flow_foreach(table->stripes[i], func, user_data);
+        g_mutex_unlock(&table->stripes[i]->lock);
+    }
+    for (i = 0; i < WHEEL_LEVELS * WHEEL_SLOTS; i++)
+        g_list_foreach(table->wheel.slots[i], (GFunc) func, user_data);
+    g_list_foreach(table->wheel.due, (GFunc) func, user_data);
+}
+
+/** GInetFlowShardedTable */
+struct _GInetFlowShardedTable {
+    GObject parent;
+    GInetFlowTableEngine engine;
+    guint64 capacity;
+    int node;
+    guint cache_size;
+    guint nshards;
+    GInetFlowTable **shards;
+};
+struct _GInetFlowShardedTableClass {
+    GObjectClass parent;
+};
+G_DEFINE_TYPE(GInetFlowShardedTable, g_inet_flow_sharded_table, G_TYPE_OBJECT);
+
+#define SHARDS_MAX          256
+
+enum {
+    SHARDED_SIZE = 1,
+    SHARDED_HITS,
+    SHARDED_MISSES,
+    SHARDED_SHARDS,
+    SHARDED_ENGINE,
+    SHARDED_CAPACITY,
+    SHARDED_NUMA_NODE,
+    SHARDED_CACHE_SIZE,
+};
+
+static void g_inet_flow_sharded_table_finalize(GObject * object)
+{
+    GInetFlowShardedTable *table = G_INET_FLOW_SHARDED_TABLE(object);
+    guint i;
 
-    for (i = 0; i < LIFETIME_COUNT; i++) {
-        g_list_foreach(table->list[i], (GFunc) func, user_data);
+    for (i = 0; i < table->nshards; i++)
+        g_object_unref(table->shards[i]);
+    g_free(table->shards);
+    G_OBJECT_CLASS(g_inet_flow_sharded_table_parent_class)->finalize(object);
+}
+
+static void g_inet_flow_sharded_table_set_property(GObject * object, guint prop_id,
+                                                   const GValue * value,
+                                                   GParamSpec * pspec)
+{
+    GInetFlowShardedTable *table = G_INET_FLOW_SHARDED_TABLE(object);
+    switch (prop_id) {
+    case SHARDED_SHARDS:
+        table->nshards = g_value_get_uint(value);
+        break;
+    case SHARDED_ENGINE:
+        table->engine = g_value_get_uint(value);
+        break;
+    case SHARDED_CAPACITY:
+        table->capacity = g_value_get_uint64(value);
+        break;
+    case SHARDED_NUMA_NODE:
+        table->node = g_value_get_int(value);
+        break;
+    case SHARDED_CACHE_SIZE:
+        table->cache_size = g_value_get_uint(value);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID(table, prop_id, pspec);
+        break;
+    }
+}
+
+/* Totals are summed over the shards without stopping their owners */
+static void g_inet_flow_sharded_table_get_property(GObject * object, guint prop_id,
+                                                   GValue * value, GParamSpec * pspec)
+{
+    GInetFlowShardedTable *table = G_INET_FLOW_SHARDED_TABLE(object);
+    guint64 sum = 0;
+    guint i;
+
+    switch (prop_id) {
+    case SHARDED_SIZE:
+        for (i = 0; i < table->nshards; i++)
+            sum += flow_table_size(table->shards[i]);
+        g_value_set_uint64(value, sum);
+        break;
+    case SHARDED_HITS:
+    case SHARDED_MISSES:
+        for (i = 0; i < table->nshards; i++)
+            sum += flow_table_count(table->shards[i], prop_id == SHARDED_MISSES);
+        g_value_set_uint64(value, sum);
+        break;
+    case SHARDED_SHARDS:
+        g_value_set_uint(value, table->nshards);
+        break;
+    case SHARDED_ENGINE:
+        g_value_set_uint(value, table->engine);
+        break;
+    case SHARDED_CAPACITY:
+        g_value_set_uint64(value, table->capacity);
+        break;
+    case SHARDED_NUMA_NODE:
+        g_value_set_int(value, table->node);
+        break;
+    case SHARDED_CACHE_SIZE:
+        g_value_set_uint(value, table->cache_size);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID(table, prop_id, pspec);
+        break;
+    }
+}
+
+/* Every shard is a table of its own, sized for an even share */
+static void g_inet_flow_sharded_table_constructed(GObject * object)
+{
+    GInetFlowShardedTable *table = G_INET_FLOW_SHARDED_TABLE(object);
+    guint i;
+
+    table->shards = g_new0(GInetFlowTable *, table->nshards);
+    for (i = 0; i < table->nshards; i++) {
+        table->shards[i] = g_object_new(G_INET_TYPE_FLOW_TABLE, "engine", table->engine,
+                                        "capacity",
+                                        (table->capacity + table->nshards - 1) /
+                                        table->nshards, "numa-node", table->node,
+                                        "cache-size", table->cache_size, NULL);
+    }
+    G_OBJECT_CLASS(g_inet_flow_sharded_table_parent_class)->constructed(object);
+}
+
+static void g_inet_flow_sharded_table_class_init(GInetFlowShardedTableClass * class)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS(class);
+    object_class->constructed = g_inet_flow_sharded_table_constructed;
+    object_class->set_property = g_inet_flow_sharded_table_set_property;
+    object_class->get_property = g_inet_flow_sharded_table_get_property;
+    g_object_class_install_property(object_class, SHARDED_SIZE,
+                                    g_param_spec_uint64("size", "Size",
+                                                        "Total number of flows in all shards",
+                                                        0, G_MAXUINT64, 0,
+                                                        G_PARAM_READABLE));
+    g_object_class_install_property(object_class, SHARDED_HITS,
+                                    g_param_spec_uint64("hits", "Hits",
+                                                        "Total number of packets that matched an existing flow",
+                                                        0, G_MAXUINT64, 0,
+                                                        G_PARAM_READABLE));
+    g_object_class_install_property(object_class, SHARDED_MISSES,
+                                    g_param_spec_uint64("misses", "Misses",
+                                                        "Total number of packets that did not match an existing flow",
+                                                        0, G_MAXUINT64, 0,
+                                                        G_PARAM_READABLE));
+    g_object_class_install_property(object_class, SHARDED_SHARDS,
+                                    g_param_spec_uint("shards", "Shards",
+                                                      "Number of independent tables",
+                                                      1, SHARDS_MAX, 1,
+                                                      G_PARAM_READWRITE |
+                                                      G_PARAM_CONSTRUCT_ONLY));
+    g_object_class_install_property(object_class, SHARDED_ENGINE,
+                                    g_param_spec_uint("engine", "Engine",
+                                                      "Data structure indexing the flows of each shard",
+                                                      G_INET_FLOW_TABLE_ENGINE_GHASH,
+                                                      G_INET_FLOW_TABLE_ENGINE_DUAL,
+                                                      G_INET_FLOW_TABLE_ENGINE_GHASH,
+                                                      G_PARAM_READWRITE |
+                                                      G_PARAM_CONSTRUCT_ONLY));
+    g_object_class_install_property(object_class, SHARDED_CAPACITY,
+                                    g_param_spec_uint64("capacity", "Capacity",
+                                                        "Number of flows the shards are sized for between them",
+                                                        0, G_MAXUINT64, 0,
+                                                        G_PARAM_READWRITE |
+                                                        G_PARAM_CONSTRUCT_ONLY));
+    g_object_class_install_property(object_class, SHARDED_NUMA_NODE,
+                                    g_param_spec_int("numa-node", "NUMA node",
+                                                     "Node the shards are allocated on, or -1 for first touch",
+                                                     -1, NUMA_NODES_MAX - 1, -1,
+                                                     G_PARAM_READWRITE |
+                                                     G_PARAM_CONSTRUCT_ONLY));
+    g_object_class_install_property(object_class, SHARDED_CACHE_SIZE,
+                                    g_param_spec_uint("cache-size", "Cache size",
+                                                      "Entries in the exact match cache of each shard, 0 for none",
+                                                      0, FLOW_CACHE_MAX, 0,
+                                                      G_PARAM_READWRITE |
+                                                      G_PARAM_CONSTRUCT_ONLY));
+    object_class->finalize = g_inet_flow_sharded_table_finalize;
+}
+
+static void g_inet_flow_sharded_table_init(GInetFlowShardedTable * table)
+{
+    table->nshards = 1;
+    table->node = -1;
+}
+
+GInetFlowShardedTable *g_inet_flow_sharded_table_new(guint shards)
+{
+    return (GInetFlowShardedTable *) g_object_new(G_INET_TYPE_FLOW_SHARDED_TABLE,
+                                                  "shards", shards, NULL);
+}
+
+/* Frames are routed by addresses and protocol alone, so both directions
+ * and every fragment of a flow reach the shard holding its fragment state.
+ * A non-zero hash is used as given instead.
+ */
+gint g_inet_flow_sharded_table_shard_for_frame(GInetFlowShardedTable * table,
+                                               const guint8 * frame, guint length,
+                                               guint64 hash, gboolean l2)
+{
+    GInetFlow packet = { };
+
+    if (!hash) {
+        if (!flow_packet_parse(NULL, &packet, frame, length, 0, l2))
+            return -1;
+        packet.tuple.lower_port = packet.tuple.upper_port = 0;
+        hash = tuple_mix64(&packet.tuple);
     }
+    /* Folded so a 32 bit RSS value spreads as well as a 64 bit hash */
+    return (gint) (((guint64) (guint32) (hash ^ (hash >> 32)) * table->nshards) >> 32);
+}
+
+GInetFlowTable *g_inet_flow_sharded_table_get_shard(GInetFlowShardedTable * table,
+                                                    guint shard)
+{
+    g_return_val_if_fail(shard < table->nshards, NULL);
+    return table->shards[shard];
 }
@@ -31,6 +31,11 @@ typedef struct _GInetFlowTable GInetFlowTable;
 typedef struct _GInetFlowTableClass GInetFlowTableClass;
 #define G_INET_FLOW_TABLE(o)        (G_TYPE_CHECK_INSTANCE_CAST ((o), G_INET_TYPE_FLOW_TABLE, GInetFlowTable))
 
+#define G_INET_TYPE_FLOW_SHARDED_TABLE  (g_inet_flow_sharded_table_get_type ())
+typedef struct _GInetFlowShardedTable GInetFlowShardedTable;
+typedef struct _GInetFlowShardedTableClass GInetFlowShardedTableClass;
+#define G_INET_FLOW_SHARDED_TABLE(o)    (G_TYPE_CHECK_INSTANCE_CAST ((o), G_INET_TYPE_FLOW_SHARDED_TABLE, GInetFlowShardedTable))
+
 /* Flow states */
 typedef enum {
     FLOW_NEW,
@@ -38,21 +43,157 @@ typedef enum {
     FLOW_CLOSED,
 } GInetFlowState;
 
+/* Flow hash algorithms */
+typedef enum {
+    G_INET_FLOW_HASH_CRC16,
+    G_INET_FLOW_HASH_CRC32C,
+    G_INET_FLOW_HASH_TOEPLITZ,
+    G_INET_FLOW_HASH_SIPHASH,
+} GInetFlowHash;
+
+/* Tuple fields covered by the Toeplitz hash */
+typedef enum {
+    G_INET_FLOW_HASH_FIELDS_4TUPLE,
+    G_INET_FLOW_HASH_FIELDS_2TUPLE,
+} GInetFlowHashFields;
+
+/* Longest hash key. Toeplitz needs 40 bytes to cover IPv6 with ports and
+ * SipHash uses the first 16 bytes. A key set while the table hashes with
+ * SipHash replaces its random SipHash key, otherwise it is the Toeplitz key.
+ */
+#define G_INET_FLOW_HASH_KEY_MAX                52
+
+/* Data structures that can index a flow table. DUAL keeps IPv4 flows in a
+ * compact index of their own and everything else in a Swiss index.
+ */
+typedef enum {
+    G_INET_FLOW_TABLE_ENGINE_GHASH,
+    G_INET_FLOW_TABLE_ENGINE_SWISS,
+    G_INET_FLOW_TABLE_ENGINE_CUCKOO,
+    G_INET_FLOW_TABLE_ENGINE_DUAL,
+} GInetFlowTableEngine;
+
 /* Default timeouts */
 #define G_INET_FLOW_DEFAULT_NEW_TIMEOUT         30
 #define G_INET_FLOW_DEFAULT_OPEN_TIMEOUT        300
 #define G_INET_FLOW_DEFAULT_CLOSED_TIMEOUT      10
 
 GInetFlowTable *g_inet_flow_table_new(void);
+GInetFlowTable *g_inet_flow_table_new_with_engine(GInetFlowTableEngine engine);
+
+/* Object recycling is opt-in. Tables with the "recycle" property set, and
+ * sized tables, which set it, reset released flows and hand them out again
+ * as new flows rather than freeing them. Data attached with
+ * g_object_set_data() survives the reset and would turn up on an unrelated
+ * flow, so users must clear it before releasing a flow. Record tables hold
+ * no object state and recycle safely.
+ */
+GInetFlowTable *g_inet_flow_table_new_sized(guint64 capacity);
 GInetFlow *g_inet_flow_get(GInetFlowTable * table, const guint8 * frame, guint length);
 GInetFlow *g_inet_flow_get_full(GInetFlowTable * table, const guint8 * frame,
                                 guint length, guint16 hash, guint64 timestamp,
                                 gboolean update, gboolean l2);
+GInetFlow *g_inet_flow_get_full64(GInetFlowTable * table, const guint8 * frame,
+                                  guint length, guint64 hash, guint64 timestamp,
+                                  gboolean update, gboolean l2);
+guint g_inet_flow_get_batch(GInetFlowTable * table, const guint8 ** frames,
+                            const guint * lengths, const guint64 * hashes,
+                            const guint64 * timestamps, guint count, gboolean update,
+                            gboolean l2, GInetFlow ** flows);
 GInetFlow *g_inet_flow_expire(GInetFlowTable * table, guint64 ts);
 
+/* Plain flow records, from tables created with the "records" property set.
+ * A record stays valid until released and g_inet_flow_record_object()
+ * wraps it in a GInetFlow only when one is needed.
+ */
+typedef struct _GInetFlowRecord GInetFlowRecord;
+GInetFlowRecord *g_inet_flow_record_get_full(GInetFlowTable * table,
+                                             const guint8 * frame, guint length,
+                                             guint64 hash, guint64 timestamp,
+                                             gboolean update, gboolean l2);
+GInetFlowRecord *g_inet_flow_record_expire(GInetFlowTable * table, guint64 ts);
+typedef void (*GIFRecordFunc) (GInetFlowRecord * record, gpointer user_data);
+guint g_inet_flow_record_expire_batch(GInetFlowTable * table, guint64 ts, guint max,
+                                      GIFRecordFunc callback, gpointer user_data,
+                                      gboolean * more);
+void g_inet_flow_record_release(GInetFlowRecord * record);
+GInetFlow *g_inet_flow_record_object(GInetFlowRecord * record);
+GInetFlowState g_inet_flow_record_state(const GInetFlowRecord * record);
+guint64 g_inet_flow_record_packets(const GInetFlowRecord * record);
+guint64 g_inet_flow_record_timestamp(const GInetFlowRecord * record);
+guint64 g_inet_flow_record_hash(const GInetFlowRecord * record);
+guint g_inet_flow_record_family(const GInetFlowRecord * record);
+guint16 g_inet_flow_record_protocol(const GInetFlowRecord * record);
+guint16 g_inet_flow_record_lport(const GInetFlowRecord * record);
+guint16 g_inet_flow_record_uport(const GInetFlowRecord * record);
+const guint8 *g_inet_flow_record_lip(const GInetFlowRecord * record);
+const guint8 *g_inet_flow_record_uip(const GInetFlowRecord * record);
+
+/* Tables created with the "stripes" property set can be used from many
+ * threads at once. Expiry unlinks a flow under its stripe's lock before
+ * handing it over, so no other thread can find it or be handed it again.
+ * Other flows must only be released once no other thread can still be
+ * looking them up, and never from a foreach callback.
+ *
+ * Read-side sections for tables created with "lock-free-lookups". Inside
+ * one, lookups that do not update flows take no locks, and the flows they
+ * find stay valid until the section ends even if released meanwhile.
+ * Sections may nest.
+ */
+void g_inet_flow_read_lock(void);
+void g_inet_flow_read_unlock(void);
+
 typedef void (*GIFFunc) (GInetFlow * flow, gpointer user_data);
 void g_inet_flow_foreach(GInetFlowTable * table, GIFFunc func, gpointer user_data);
+
+/* Hands at most max flows due by ts to the callback, which is expected to
+ * release them, and returns how many it handed over. more, if given, is
+ * set when flows due by ts remain. Flows the callback keeps are handed
+ * over again by the next call, except on tables with stripes, which unlink
+ * each flow before handing it over.
+ */
+guint g_inet_flow_expire_batch(GInetFlowTable * table, guint64 ts, guint max,
+                               GIFFunc callback, gpointer user_data, gboolean * more);
+
+/* A source that ages the table from a GMainContext. Each dispatch hands at
+ * most budget due flows to the callback, a GIFFunc or for record tables a
+ * GIFRecordFunc set with g_source_set_callback(), which is expected to
+ * release them. Flows the callback keeps are handed over again about 65ms
+ * later, except on tables with stripes. The source runs when the next flow
+ * is due, going by the library clock as used for flows got with no
+ * timestamp. A table has at most one aging source, which holds a reference
+ * to it.
+ */
+GSource *g_inet_flow_aging_source_new(GInetFlowTable * table, guint budget);
 void g_inet_flow_table_max_set(GInetFlowTable * table, guint64 value);
+gboolean g_inet_flow_table_hash_set(GInetFlowTable * table, GInetFlowHash type);
+gboolean g_inet_flow_table_hash_key_set(GInetFlowTable * table, const guint8 * key,
+                                        gsize length);
+gboolean g_inet_flow_table_hash_fields_set(GInetFlowTable * table,
+                                           GInetFlowHashFields fields);
+
+/* Timeout classes. A table starts with one class per flow state, in state
+ * order, holding the default timeouts. Classes can be added and retimed and
+ * each protocol picks a class for every state. Flows take up a new timeout
+ * with their next packet.
+ */
+gint g_inet_flow_table_timeout_class_add(GInetFlowTable * table, guint seconds);
+gboolean g_inet_flow_table_timeout_class_set(GInetFlowTable * table, guint timeout_class,
+                                             guint seconds);
+gboolean g_inet_flow_table_timeout_select(GInetFlowTable * table, guint8 protocol,
+                                          GInetFlowState state, guint timeout_class);
+
+/* A sharded table is a set of independent tables, each meant to be owned
+ * by one thread. A dispatcher finds the shard for a frame and hands it to
+ * the owner, which then uses the shard as any other table.
+ */
+GType g_inet_flow_sharded_table_get_type(void);
+GInetFlowShardedTable *g_inet_flow_sharded_table_new(guint shards);
+gint g_inet_flow_sharded_table_shard_for_frame(GInetFlowShardedTable * table,
+                                               const guint8 * frame, guint length,
+                                               guint64 hash, gboolean l2);
+GInetFlowTable *g_inet_flow_sharded_table_get_shard(GInetFlowShardedTable * table,
+                                                    guint shard);
 
 G_END_DECLS
 #endif                          /* __G_INET_FLOW_H__ */
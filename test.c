@@ -1202,6 +1202,59 @@ void test_flow_expired_only_once()
     g_object_unref(table);
 }
 
+void test_flow_table_timeout_classes()
+{
+    guint64 now = get_time_us();
+    GInetFlowTable *table;
+    GInetFlow *udp, *tcp;
+    guint len;
+    gint dns;
+    int i;
+
+    setup_test();
+    NP_ASSERT_NOT_NULL((table = g_inet_flow_table_new()));
+    NP_ASSERT_EQUAL((dns = g_inet_flow_table_timeout_class_add(table, 2)), FLOW_CLOSED + 1);
+    NP_ASSERT(g_inet_flow_table_timeout_select(table, IP_PROTOCOL_UDP, FLOW_NEW, dns));
+    NP_ASSERT_FALSE(g_inet_flow_table_timeout_select(table, IP_PROTOCOL_UDP, FLOW_OPEN, 4));
+
+    /* UDP flows take the short class, TCP keeps the defaults */
+    len = make_pkt(test_buffer, ETH_PROTOCOL_IP, IP_PROTOCOL_UDP);
+    udp = g_inet_flow_get_full(table, test_buffer, len, 0, now, TRUE, TRUE);
+    NP_ASSERT_EQUAL(udp->timeout_class, dns);
+    NP_ASSERT_EQUAL(udp->lifetime, 2);
+    len = make_pkt(test_buffer, ETH_PROTOCOL_IP, IP_PROTOCOL_TCP);
+    tcp = g_inet_flow_get_full(table, test_buffer, len, 0, now, TRUE, TRUE);
+    NP_ASSERT_EQUAL(tcp->lifetime, G_INET_FLOW_DEFAULT_NEW_TIMEOUT);
+    NP_ASSERT(g_inet_flow_expire(table, now + 2000000) == udp);
+    g_object_unref(udp);
+    NP_ASSERT_NULL(g_inet_flow_expire(table, now + 2000000));
+
+    /* Retimed classes apply from the flow's next packet */
+    NP_ASSERT(g_inet_flow_table_timeout_class_set(table, FLOW_NEW, 5));
+    NP_ASSERT_FALSE(g_inet_flow_table_timeout_class_set(table, dns + 1, 5));
+    NP_ASSERT(tcp == g_inet_flow_get_full(table, test_buffer, len, 0, now, TRUE, TRUE));
+    NP_ASSERT_EQUAL(tcp->lifetime, 5);
+    NP_ASSERT(g_inet_flow_expire(table, now + 5000000) == tcp);
+    g_object_unref(tcp);
+
+    /* Classes are numbered by a byte in the flow */
+    for (i = dns + 1; i < TIMEOUT_CLASSES_MAX; i++)
+        NP_ASSERT_EQUAL(g_inet_flow_table_timeout_class_add(table, i), i);
+    NP_ASSERT_EQUAL(g_inet_flow_table_timeout_class_add(table, 1), -1);
+    g_object_unref(table);
+
+    /* Stripes follow their table */
+    NP_ASSERT_NOT_NULL((table = g_object_new(G_INET_TYPE_FLOW_TABLE, "stripes", 2, NULL)));
+    dns = g_inet_flow_table_timeout_class_add(table, 2);
+    g_inet_flow_table_timeout_select(table, IP_PROTOCOL_UDP, FLOW_OPEN, dns);
+    for (i = 0; i < 2; i++) {
+        NP_ASSERT_EQUAL(table->stripes[i]->ntimeouts, dns + 1);
+        NP_ASSERT_EQUAL(table->stripes[i]->timeouts[dns], 2);
+        NP_ASSERT_EQUAL(table->stripes[i]->timeout_select[IP_PROTOCOL_UDP][FLOW_OPEN], dns);
+    }
+    g_object_unref(table);
+}
+
 void test_flow_tcp_new()
 {
     GInetFlowTable *table;
@@ -1776,3 +1829,1807 @@ void test_clear_expired_frag_info()
     g_object_unref(flow1);
     g_object_unref(table);
 }
+
+static guint16 crc16_bitwise(guint16 iv, guint64 p)
+{
+    int i;
+    int j;
+    guint32 b;
+    guint16 poly = 0x1021;
+    for (i = 7; i >= 0; i--) {
+        b = (p >> (i * 8)) & 0xff;
+        for (j = 7; j >= 0; j--) {
+            iv = ((iv << 1) ^ ((((iv >> 15) & 1) ^ ((b >> j) & 1)) ? poly : 0))
+                & 0xffff;
+        }
+    }
+    return iv;
+}
+
+static guint16 flow_hash_bitwise(GInetFlow * f)
+{
+    guint32 *lip = f->tuple.lower_ip;
+    guint32 *uip = f->tuple.upper_ip;
+    guint16 src_crc = 0xffff;
+    guint16 dst_crc = 0xffff;
+    guint16 prot_crc = 0xffff;
+    src_crc = crc16_bitwise(src_crc, ((guint64) lip[0]) << 32 | lip[1]);
+    src_crc = crc16_bitwise(src_crc, ((guint64) lip[2]) << 32 | lip[3]);
+    src_crc = crc16_bitwise(src_crc, ((guint64) f->tuple.lower_port) << 48);
+    dst_crc = crc16_bitwise(dst_crc, ((guint64) uip[0]) << 32 | uip[1]);
+    dst_crc = crc16_bitwise(dst_crc, ((guint64) uip[2]) << 32 | uip[3]);
+    dst_crc = crc16_bitwise(dst_crc, ((guint64) f->tuple.upper_port) << 48);
+    prot_crc = crc16_bitwise(prot_crc, ((guint64) f->tuple.protocol) << 56);
+    return src_crc ^ dst_crc ^ prot_crc;
+}
+
+void test_flow_hash_crc16_table()
+{
+    GInetFlowTable *table;
+    guint64 p = 0;
+    int i;
+
+    setup_test();
+    /* Class initialisation builds the CRC tables */
+    NP_ASSERT_NOT_NULL((table = g_inet_flow_table_new()));
+    for (i = 0; i < 100000; i++) {
+        guint16 iv = g_random_int();
+        p = ((guint64) g_random_int() << 32) | g_random_int();
+        NP_ASSERT_EQUAL(crc16(iv, p), crc16_bitwise(iv, p));
+        NP_ASSERT_EQUAL(crc16(iv, p << 48), crc16_bitwise(iv, p << 48));
+    }
+    g_object_unref(table);
+}
+
+void test_flow_hash_crc16_compatible()
+{
+    GInetFlowTable *table;
+    guint len;
+
+    setup_test();
+    NP_ASSERT_NOT_NULL((table = g_inet_flow_table_new()));
+
+    len = make_pkt(test_buffer, ETH_PROTOCOL_IP, IP_PROTOCOL_TCP);
+    NP_ASSERT(flow_parse(&test_flow, test_buffer, len, 0, table));
+    NP_ASSERT_EQUAL((guint16) flow_hash64(table, &test_flow),
+                    flow_hash_bitwise(&test_flow));
+    NP_ASSERT_EQUAL((guint16) test_flow.hash, 0x5b94);
+
+    setup_test();
+    len = make_pkt(test_buffer, ETH_PROTOCOL_IPV6, IP_PROTOCOL_UDP);
+    NP_ASSERT(flow_parse(&test_flow, test_buffer, len, 0, table));
+    NP_ASSERT_EQUAL((guint16) flow_hash64(table, &test_flow),
+                    flow_hash_bitwise(&test_flow));
+    NP_ASSERT_EQUAL((guint16) test_flow.hash, 0x1a2a);
+
+    g_object_unref(table);
+}
+
+void test_flow_hash64()
+{
+    GInetFlowTable *table;
+    GInetFlow *flow1, *flow2;
+    guint64 hash64;
+    guint hash;
+
+    setup_test();
+    NP_ASSERT_NOT_NULL((table = g_inet_flow_table_new()));
+
+    /* Computed hash keeps the CRC16 in the low bits and uses the rest */
+    guint len = make_pkt(test_buffer, ETH_PROTOCOL_IP, IP_PROTOCOL_TCP);
+    NP_ASSERT_NOT_NULL((flow1 =
+                        g_inet_flow_get_full(table, test_buffer, len, 0, 0, TRUE, TRUE)));
+    g_object_get(flow1, "hash", &hash, "hash64", &hash64, NULL);
+    NP_ASSERT_EQUAL(hash, 0x5b94);
+    NP_ASSERT_EQUAL(hash64 & 0xffff, 0x5b94);
+    NP_ASSERT(hash64 >> 16);
+
+    /* Its 16 bit hash handed back finds the same flow */
+    NP_ASSERT(flow1 == g_inet_flow_get_full(table, test_buffer, len, hash, 0, TRUE, TRUE));
+    g_object_get(table, "size", &hash64, NULL);
+    NP_ASSERT_EQUAL(hash64, 1);
+
+    /* Caller supplied 64 bit hash is stored as is */
+    len = make_pkt(test_buffer, ETH_PROTOCOL_IP, IP_PROTOCOL_UDP);
+    NP_ASSERT_NOT_NULL((flow2 =
+                        g_inet_flow_get_full64(table, test_buffer, len,
+                                               G_GUINT64_CONSTANT(0x0123456789abcdef), 0,
+                                               TRUE, TRUE)));
+    g_object_get(flow2, "hash", &hash, "hash64", &hash64, NULL);
+    NP_ASSERT_EQUAL(hash, 0xcdef);
+    NP_ASSERT_EQUAL(hash64, G_GUINT64_CONSTANT(0x0123456789abcdef));
+    NP_ASSERT(flow2 == g_inet_flow_get_full64(table, test_buffer, len,
+                                              G_GUINT64_CONSTANT(0x0123456789abcdef), 0,
+                                              TRUE, TRUE));
+
+    g_object_unref(flow1);
+    g_object_unref(flow2);
+    g_object_unref(table);
+}
+
+void test_flow_hash_crc32c()
+{
+    GInetFlowTable *table;
+    struct tuple t = { };
+    int i;
+
+    setup_test();
+    NP_ASSERT_NOT_NULL((table = g_inet_flow_table_new()));
+
+    /* RFC 3720 test vector: 32 bytes of zeroes */
+    guint32 crc = 0xffffffff;
+    for (i = 0; i < 4; i++)
+        crc = crc32c_u64_sw(crc, 0);
+    NP_ASSERT_EQUAL(~crc, 0x8a9136aa);
+
+    /* Hardware and software paths agree */
+    for (i = 0; i < 10000; i++) {
+        t.protocol = g_random_int_range(0, 256);
+        t.lower_port = g_random_int();
+        t.upper_port = g_random_int();
+        t.lower_ip[i % 4] = g_random_int();
+        t.upper_ip[(i + 1) % 4] = g_random_int();
+        NP_ASSERT_EQUAL(crc32c_impl(table, &t, G_SOCKET_FAMILY_IPV6),
+                        flow_hash_crc32c_sw(table, &t, G_SOCKET_FAMILY_IPV6));
+    }
+    g_object_unref(table);
+}
+
+void test_flow_table_hash_type()
+{
+    GInetFlowTable *table;
+    GInetFlow *flow1, *flow2;
+    guint type;
+    gchar *impl;
+    guint64 hash64;
+
+    setup_test();
+    NP_ASSERT_NOT_NULL((table = g_inet_flow_table_new()));
+    g_object_get(table, "hash-type", &type, "hash-impl", &impl, NULL);
+    NP_ASSERT_EQUAL(type, G_INET_FLOW_HASH_CRC16);
+    NP_ASSERT_STR_EQUAL(impl, "crc16");
+    g_free(impl);
+
+    NP_ASSERT(g_inet_flow_table_hash_set(table, G_INET_FLOW_HASH_CRC32C));
+    g_object_get(table, "hash-type", &type, "hash-impl", &impl, NULL);
+    NP_ASSERT_EQUAL(type, G_INET_FLOW_HASH_CRC32C);
+    NP_ASSERT(g_str_has_prefix(impl, "crc32c"));
+    g_free(impl);
+
+    guint len = make_pkt(test_buffer, ETH_PROTOCOL_IPV6, IP_PROTOCOL_TCP);
+    NP_ASSERT_NOT_NULL((flow1 =
+                        g_inet_flow_get_full(table, test_buffer, len, 0, 0, TRUE, TRUE)));
+    g_object_get(flow1, "hash64", &hash64, NULL);
+    NP_ASSERT_EQUAL(hash64, flow_hash_crc32c_sw(table, &flow1->tuple, flow1->family));
+    len = make_pkt_reverse(test_buffer, ETH_PROTOCOL_IPV6, IP_PROTOCOL_TCP);
+    NP_ASSERT_NOT_NULL((flow2 =
+                        g_inet_flow_get_full(table, test_buffer, len, 0, 0, TRUE, TRUE)));
+    NP_ASSERT(flow1 == flow2);
+
+    /* Flows are filed under the current hash so it is now fixed */
+    NP_ASSERT_FALSE(g_inet_flow_table_hash_set(table, G_INET_FLOW_HASH_CRC16));
+    g_object_unref(flow1);
+    NP_ASSERT(g_inet_flow_table_hash_set(table, G_INET_FLOW_HASH_CRC16));
+    g_object_unref(table);
+}
+
+/* Verification key and vectors from the Microsoft RSS specification */
+static const guint8 rss_key[40] = {
+    0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2, 0x41, 0x67,
+    0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0, 0xd0, 0xca, 0x2b, 0xcb,
+    0xae, 0x7b, 0x30, 0xb4, 0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30,
+    0xf2, 0x0c, 0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
+};
+
+void test_flow_hash_toeplitz_vectors()
+{
+    GInetFlowTable *table;
+    struct tuple t = { };
+
+    setup_test();
+    NP_ASSERT_NOT_NULL((table = g_inet_flow_table_new()));
+    NP_ASSERT(g_inet_flow_table_hash_key_set(table, rss_key, sizeof(rss_key)));
+    NP_ASSERT(g_inet_flow_table_hash_set(table, G_INET_FLOW_HASH_TOEPLITZ));
+
+    /* Source 66.9.149.187:2794, destination 161.142.100.80:1766 */
+    inet_pton(AF_INET, "66.9.149.187", t.lower_ip);
+    inet_pton(AF_INET, "161.142.100.80", t.upper_ip);
+    t.lower_port = 2794;
+    t.upper_port = 1766;
+    NP_ASSERT_EQUAL(flow_hash_toeplitz(table, &t, G_SOCKET_FAMILY_IPV4), 0x51ccc178);
+
+    /* Source 3ffe:2501:200:1fff::7:2794, destination 3ffe:2501:200:3::1:1766 */
+    inet_pton(AF_INET6, "3ffe:2501:200:1fff::7", t.lower_ip);
+    inet_pton(AF_INET6, "3ffe:2501:200:3::1", t.upper_ip);
+    NP_ASSERT_EQUAL(flow_hash_toeplitz(table, &t, G_SOCKET_FAMILY_IPV6), 0x40207d3d);
+
+    NP_ASSERT(g_inet_flow_table_hash_fields_set(table, G_INET_FLOW_HASH_FIELDS_2TUPLE));
+    NP_ASSERT_EQUAL(flow_hash_toeplitz(table, &t, G_SOCKET_FAMILY_IPV6), 0x2cc18cd5);
+    memset(&t, 0, sizeof(t));
+    inet_pton(AF_INET, "66.9.149.187", t.lower_ip);
+    inet_pton(AF_INET, "161.142.100.80", t.upper_ip);
+    NP_ASSERT_EQUAL(flow_hash_toeplitz(table, &t, G_SOCKET_FAMILY_IPV4), 0x323e8fc2);
+
+    /* Keys longer than the maximum are refused */
+    NP_ASSERT_FALSE(g_inet_flow_table_hash_key_set(table, test_buffer,
+                                                   G_INET_FLOW_HASH_KEY_MAX + 1));
+    g_object_unref(table);
+}
+
+void test_flow_hash_toeplitz_symmetric()
+{
+    GInetFlowTable *table;
+    GInetFlow *flow1, *flow2;
+    struct tuple t = { };
+    guint64 hash64;
+    guint fields;
+    guint32 ip;
+
+    setup_test();
+    NP_ASSERT_NOT_NULL((table = g_inet_flow_table_new()));
+    g_object_set(table, "hash-type", G_INET_FLOW_HASH_TOEPLITZ, NULL);
+    g_object_get(table, "hash-fields", &fields, NULL);
+    NP_ASSERT_EQUAL(fields, G_INET_FLOW_HASH_FIELDS_4TUPLE);
+
+    /* The default key hashes both directions alike, even when not canonical */
+    t.lower_ip[0] = g_random_int();
+    t.upper_ip[0] = g_random_int();
+    t.lower_port = g_random_int();
+    t.upper_port = g_random_int();
+    hash64 = flow_hash_toeplitz(table, &t, G_SOCKET_FAMILY_IPV4);
+    ip = t.lower_ip[0];
+    t.lower_ip[0] = t.upper_ip[0];
+    t.upper_ip[0] = ip;
+    NP_ASSERT_EQUAL(flow_hash_toeplitz(table, &t, G_SOCKET_FAMILY_IPV4), hash64);
+
+    /* The 32 bit RSS value is stored as is so a NIC hash finds the same flow */
+    guint len = make_pkt(test_buffer, ETH_PROTOCOL_IPV6, IP_PROTOCOL_UDP);
+    NP_ASSERT_NOT_NULL((flow1 =
+                        g_inet_flow_get_full(table, test_buffer, len, 0, 0, TRUE, TRUE)));
+    g_object_get(flow1, "hash64", &hash64, NULL);
+    NP_ASSERT_EQUAL(hash64 >> 32, 0);
+    len = make_pkt_reverse(test_buffer, ETH_PROTOCOL_IPV6, IP_PROTOCOL_UDP);
+    NP_ASSERT_NOT_NULL((flow2 =
+                        g_inet_flow_get_full64(table, test_buffer, len, hash64, 0, TRUE,
+                                               TRUE)));
+    NP_ASSERT(flow1 == flow2);
+    NP_ASSERT(flow2 == g_inet_flow_get_full(table, test_buffer, len, 0, 0, TRUE, TRUE));
+
+    NP_ASSERT_FALSE(g_inet_flow_table_hash_fields_set(table,
+                                                      G_INET_FLOW_HASH_FIELDS_2TUPLE));
+    g_object_unref(flow1);
+    g_object_unref(table);
+}
+
+void test_flow_hash_siphash()
+{
+    GInetFlowTable *table1, *table2;
+    guint64 key[2] = { 0, 0 };
+    guint64 sip_key[2];
+    guint64 m[5];
+    struct tuple t = { };
+    gchar *impl;
+    int i;
+
+    /* Reference vectors for the key 00..0f and the message 00..07 */
+    key[0] = G_GUINT64_CONSTANT(0x0706050403020100);
+    key[1] = G_GUINT64_CONSTANT(0x0f0e0d0c0b0a0908);
+    NP_ASSERT_EQUAL(siphash(key, m, 0, 2, 4), G_GUINT64_CONSTANT(0x726fdb47dd0e0e31));
+    m[0] = G_GUINT64_CONSTANT(0x0706050403020100);
+    NP_ASSERT_EQUAL(siphash(key, m, 1, 2, 4), G_GUINT64_CONSTANT(0x93f5f5799a932462));
+
+    /* SipHash-1-3 with a zero key over the bytes 00..27 */
+    for (i = 0; i < 5; i++)
+        m[i] = G_GUINT64_CONSTANT(0x0706050403020100) +
+            i * G_GUINT64_CONSTANT(0x0808080808080808);
+    key[0] = key[1] = 0;
+    NP_ASSERT_EQUAL(siphash(key, m, 5, 1, 3), G_GUINT64_CONSTANT(0x95bc321ab41d8206));
+
+    setup_test();
+    NP_ASSERT_NOT_NULL((table1 = g_inet_flow_table_new()));
+    NP_ASSERT_NOT_NULL((table2 = g_inet_flow_table_new()));
+    g_object_set(table1, "hash-type", G_INET_FLOW_HASH_SIPHASH, NULL);
+    g_object_set(table2, "hash-type", G_INET_FLOW_HASH_SIPHASH, NULL);
+    g_object_get(table1, "hash-impl", &impl, NULL);
+    NP_ASSERT_STR_EQUAL(impl, "siphash13");
+    g_free(impl);
+
+    /* Each table gets its own random seed */
+    t.protocol = IP_PROTOCOL_UDP;
+    t.lower_port = 53;
+    t.upper_port = 1024;
+    NP_ASSERT_NOT_EQUAL(flow_hash_siphash(table1, &t, G_SOCKET_FAMILY_IPV4),
+                        flow_hash_siphash(table2, &t, G_SOCKET_FAMILY_IPV4));
+
+    /* A Toeplitz key leaves the SipHash key alone */
+    memcpy(sip_key, table1->sip_key, sizeof(sip_key));
+    g_object_set(table1, "hash-type", G_INET_FLOW_HASH_TOEPLITZ, NULL);
+    NP_ASSERT(g_inet_flow_table_hash_key_set(table1, rss_key, sizeof(rss_key)));
+    g_object_set(table1, "hash-type", G_INET_FLOW_HASH_SIPHASH, NULL);
+    NP_ASSERT(memcmp(sip_key, table1->sip_key, sizeof(sip_key)) == 0);
+
+    /* A configured seed is reproducible */
+    for (i = 0; i < 16; i++)
+        test_buffer[i] = i;
+    NP_ASSERT(g_inet_flow_table_hash_key_set(table1, test_buffer, 16));
+    NP_ASSERT(g_inet_flow_table_hash_key_set(table2, test_buffer, 16));
+    NP_ASSERT_EQUAL(flow_hash_siphash(table1, &t, G_SOCKET_FAMILY_IPV4),
+                    flow_hash_siphash(table2, &t, G_SOCKET_FAMILY_IPV4));
+
+    /* Both directions still find the same flow */
+    guint len = make_pkt(test_buffer, ETH_PROTOCOL_IP, IP_PROTOCOL_TCP);
+    GInetFlow *flow = g_inet_flow_get_full(table1, test_buffer, len, 0, 0, TRUE, TRUE);
+    NP_ASSERT_NOT_NULL(flow);
+    len = make_pkt_reverse(test_buffer, ETH_PROTOCOL_IP, IP_PROTOCOL_TCP);
+    NP_ASSERT(flow == g_inet_flow_get_full(table1, test_buffer, len, 0, 0, TRUE, TRUE));
+    NP_ASSERT_FALSE(g_inet_flow_table_hash_key_set(table1, test_buffer, 16));
+
+    g_object_unref(flow);
+    g_object_unref(table1);
+    g_object_unref(table2);
+}
+
+static void check_hash_batch(GInetFlowTable * table, flow_hash_batch_fn batch_fn)
+{
+    GInetFlow flows[37] = { };
+    GInetFlow *batch[37];
+    int i;
+    int j;
+
+    for (i = 0; i < 37; i++) {
+        flows[i].family = (i & 1) ? G_SOCKET_FAMILY_IPV4 : G_SOCKET_FAMILY_IPV6;
+        flows[i].tuple.protocol = g_random_int_range(0, 256);
+        flows[i].tuple.lower_port = g_random_int();
+        flows[i].tuple.upper_port = g_random_int();
+        for (j = 0; j < ((i & 1) ? 1 : 4); j++) {
+            flows[i].tuple.lower_ip[j] = g_random_int();
+            flows[i].tuple.upper_ip[j] = g_random_int();
+        }
+        batch[i] = &flows[i];
+    }
+    batch_fn(table, batch, 37);
+    for (i = 0; i < 37; i++)
+        NP_ASSERT_EQUAL(flows[i].hash,
+                        table->hash_fn(table, &flows[i].tuple, flows[i].family));
+}
+
+void test_flow_hash_batch()
+{
+    GInetFlowTable *table;
+    GInetFlowHash type;
+
+    setup_test();
+    NP_ASSERT_NOT_NULL((table = g_inet_flow_table_new()));
+    for (type = G_INET_FLOW_HASH_CRC16; type <= G_INET_FLOW_HASH_SIPHASH; type++) {
+        NP_ASSERT(g_inet_flow_table_hash_set(table, type));
+        check_hash_batch(table, table->hash_batch_fn);
+        check_hash_batch(table, flow_hash_batch_scalar);
+    }
+#if defined(__x86_64__)
+    /* Every vector width agrees with the scalar hash */
+    if (__builtin_cpu_supports("avx2"))
+        check_hash_batch(table, flow_hash_batch_siphash_avx2);
+    if (__builtin_cpu_supports("avx512f"))
+        check_hash_batch(table, flow_hash_batch_siphash_avx512);
+    NP_ASSERT(g_inet_flow_table_hash_set(table, G_INET_FLOW_HASH_CRC32C));
+    if (__builtin_cpu_supports("sse4.2"))
+        check_hash_batch(table, flow_hash_batch_crc32c_sse42);
+#endif
+    g_object_unref(table);
+}
+
+void test_flow_get_batch()
+{
+    GInetFlowTable *table;
+    guint8 buffers[4][1500];
+    const guint8 *frames[4];
+    guint lengths[4];
+    guint64 timestamps[4] = { 1, 2, 3, 4 };
+    GInetFlow *flows[4];
+    guint64 hash64;
+    guint64 size;
+    int i;
+
+    setup_test();
+    NP_ASSERT_NOT_NULL((table = g_inet_flow_table_new()));
+    g_object_set(table, "hash-type", G_INET_FLOW_HASH_SIPHASH, NULL);
+    lengths[0] = make_pkt(buffers[0], ETH_PROTOCOL_IP, IP_PROTOCOL_TCP);
+    lengths[1] = make_pkt_reverse(buffers[1], ETH_PROTOCOL_IP, IP_PROTOCOL_TCP);
+    lengths[2] = make_pkt(buffers[2], 0x0806, IP_PROTOCOL_ICMP);
+    lengths[3] = make_pkt(buffers[3], ETH_PROTOCOL_IPV6, IP_PROTOCOL_UDP);
+    for (i = 0; i < 4; i++)
+        frames[i] = buffers[i];
+
+    /* Both directions land on one flow and unparsable frames give NULL */
+    NP_ASSERT_EQUAL(g_inet_flow_get_batch(table, frames, lengths, NULL, timestamps, 4,
+                                          TRUE, TRUE, flows), 3);
+    NP_ASSERT_NOT_NULL(flows[0]);
+    NP_ASSERT(flows[0] == flows[1]);
+    NP_ASSERT_NULL(flows[2]);
+    NP_ASSERT_NOT_NULL(flows[3]);
+    g_object_get(table, "size", &size, NULL);
+    NP_ASSERT_EQUAL(size, 2);
+    g_object_get(flows[0], "hash64", &hash64, NULL);
+    NP_ASSERT_EQUAL(hash64, flow_hash_siphash(table, &flows[0]->tuple, flows[0]->family));
+
+    /* The batch and single frame paths find the same flows */
+    NP_ASSERT(flows[3] == g_inet_flow_get_full(table, frames[3], lengths[3], 0, 5, TRUE,
+                                               TRUE));
+    g_object_unref(flows[0]);
+    g_object_unref(flows[3]);
+    g_object_unref(table);
+}
+
+/* The IPv4 parser before the ordering went branchless */
+static void tuple_order_ipv4_branchy(GInetFlow * f, guint32 saddr, guint32 daddr)
+{
+    guint32 sip = GINT32_FROM_BE(saddr);
+    guint32 dip = GINT32_FROM_BE(daddr);
+    if (sip < dip) {
+        f->tuple.lower_ip[0] = saddr;
+        f->tuple.upper_ip[0] = daddr;
+    } else {
+        f->tuple.upper_ip[0] = saddr;
+        f->tuple.lower_ip[0] = daddr;
+    }
+}
+
+void test_flow_tuple_order()
+{
+    GInetFlow f = { };
+    GInetFlow ref = { };
+    guint8 s6[16], d6[16];
+    guint32 sip, dip;
+    guint16 sport, dport;
+    int i;
+    int j;
+
+    /* Addresses either side of 128.0.0.0 order as unsigned numbers */
+    inet_pton(AF_INET, "192.168.1.1", &sip);
+    inet_pton(AF_INET, "10.1.2.3", &dip);
+    tuple_order_ipv4(&f, sip, dip);
+    NP_ASSERT_EQUAL(f.tuple.lower_ip[0], dip);
+    NP_ASSERT_EQUAL(f.tuple.upper_ip[0], sip);
+
+    for (i = 0; i < 10000; i++) {
+        sip = g_random_int();
+        dip = (i & 1) ? sip : g_random_int();
+        /* Often only one of the pair has the top bit set */
+        if (i & 8) {
+            sip = GUINT32_TO_BE(GUINT32_FROM_BE(sip) & 0x7fffffff);
+            dip = GUINT32_TO_BE(GUINT32_FROM_BE(dip) | 0x80000000);
+        }
+        tuple_order_ipv4(&f, sip, dip);
+        tuple_order_ipv4_branchy(&ref, sip, dip);
+        NP_ASSERT_EQUAL(f.tuple.lower_ip[0], ref.tuple.lower_ip[0]);
+        NP_ASSERT_EQUAL(f.tuple.upper_ip[0], ref.tuple.upper_ip[0]);
+
+        sport = g_random_int_range(0, 65536);
+        dport = (i & 2) ? sport : g_random_int_range(0, 65536);
+        NP_ASSERT_EQUAL(tuple_order_ports(&f, sport, dport), sport < dport);
+        NP_ASSERT_EQUAL(f.tuple.lower_port, sport < dport ? sport : dport);
+        NP_ASSERT_EQUAL(f.tuple.upper_port, sport < dport ? dport : sport);
+
+        /* Addresses often share a prefix, so differ in a single byte */
+        for (j = 0; j < 16; j++)
+            s6[j] = d6[j] = g_random_int();
+        if (i & 4)
+            d6[g_random_int_range(0, 16)] = g_random_int();
+        tuple_order_ipv6(&f, s6, d6);
+        NP_ASSERT(memcmp(f.tuple.lower_ip, memcmp(s6, d6, 16) < 0 ? s6 : d6, 16) == 0);
+        NP_ASSERT(memcmp(f.tuple.upper_ip, memcmp(s6, d6, 16) < 0 ? d6 : s6, 16) == 0);
+    }
+}
+
+void test_flow_compare_vector()
+{
+    GInetFlow a = { };
+    GInetFlow b;
+    int i;
+    int j;
+
+    for (i = 0; i < 10000; i++) {
+        a.tuple.protocol = g_random_int_range(0, 256);
+        a.tuple.lower_port = g_random_int_range(0, 65536);
+        a.tuple.upper_port = g_random_int_range(0, 65536);
+        for (j = 0; j < 4; j++) {
+            a.tuple.lower_ip[j] = g_random_int();
+            a.tuple.upper_ip[j] = g_random_int();
+        }
+        b = a;
+        /* Padding after the ports is not part of the key */
+        ((guint8 *) & b.tuple)[6] = g_random_int();
+        switch (i % 6) {
+        case 1:
+            b.tuple.protocol ^= 1 << g_random_int_range(0, 8);
+            break;
+        case 2:
+            b.tuple.lower_port ^= 1 << g_random_int_range(0, 16);
+            break;
+        case 3:
+            b.tuple.upper_port ^= 1 << g_random_int_range(0, 16);
+            break;
+        case 4:
+            ((guint8 *) b.tuple.lower_ip)[g_random_int_range(0, 16)] ^= 0x80;
+            break;
+        case 5:
+            ((guint8 *) b.tuple.upper_ip)[g_random_int_range(0, 16)] ^= 0x01;
+            break;
+        }
+        NP_ASSERT_EQUAL(flow_compare(&a, &b), i % 6 == 0);
+        NP_ASSERT_EQUAL(flow_compare(&a, &b), flow_compare_scalar(&a, &b));
+    }
+}
+
+static GInetFlow *random_flows(int count, guint64 hash)
+{
+    GInetFlow *flows = g_new0(GInetFlow, count);
+    int i;
+
+    for (i = 0; i < count; i++) {
+        flows[i].tuple.protocol = IP_PROTOCOL_UDP;
+        flows[i].tuple.lower_port = i;
+        flows[i].tuple.upper_port = i >> 16;
+        flows[i].tuple.lower_ip[0] = g_random_int();
+        flows[i].tuple.upper_ip[0] = g_random_int();
+        flows[i].hash = hash ? : ((guint64) g_random_int() << 32) | g_random_int();
+    }
+    return flows;
+}
+
+void test_flow_table_swiss_match()
+{
+    struct flow_bucket b = { };
+    int i;
+    int j;
+
+    for (i = 0; i < 10000; i++) {
+        guint8 tag = 0x80 | g_random_int_range(0, 4);
+        for (j = 0; j < BUCKET_SLOTS; j++)
+            b.tags[j] = (g_random_int() & 1) ? 0 : 0x80 | g_random_int_range(0, 4);
+        b.overflow = g_random_int();
+        NP_ASSERT_EQUAL(bucket_match(&b, tag) & ~bucket_match_swar(&b, tag), 0);
+        NP_ASSERT_EQUAL(bucket_match(&b, 0), bucket_match_swar(&b, 0));
+    }
+    NP_ASSERT_EQUAL(sizeof(struct flow_bucket), 64);
+}
+
+void test_flow_table_swiss_index()
+{
+    struct bucket_array s = {.node = -1 };
+    GInetFlow *flows;
+    guint64 i;
+    int count;
+
+    /* Random hashes grow the table, colliding ones build long probe chains */
+    for (count = 20000; count > 0; count -= 19800) {
+        flows = random_flows(count, count == 200 ? 0x1234 : 0);
+        buckets_init(&s, SWISS_MIN_BUCKETS);
+        for (i = 0; i < count; i++) {
+            NP_ASSERT_NULL(swiss_lookup(&s, &flows[i]));
+            swiss_insert(&s, &flows[i]);
+        }
+        NP_ASSERT_EQUAL(s.size, count);
+        for (i = 0; i < count; i++)
+            NP_ASSERT(swiss_lookup(&s, &flows[i]) == &flows[i]);
+        for (i = 0; i < count; i += 2)
+            swiss_remove(&s, &flows[i]);
+        for (i = 0; i < count; i++)
+            NP_ASSERT(swiss_lookup(&s, &flows[i]) == ((i & 1) ? &flows[i] : NULL));
+        for (i = 1; i < count; i += 2)
+            swiss_remove(&s, &flows[i]);
+        NP_ASSERT_EQUAL(s.size, 0);
+
+        /* Every probe chain is unwound */
+        for (i = 0; i <= s.mask; i++)
+            NP_ASSERT_EQUAL(s.buckets[i].overflow, 0);
+        buckets_free(&s);
+        g_free(flows);
+    }
+}
+
+/* A constant hash whose flows start probing at bucket */
+static guint64 hash_for_bucket(struct bucket_array *s, guint64 bucket)
+{
+    guint64 hash = 1;
+
+    while (bucket_mix(hash) >> s->shift != bucket)
+        hash++;
+    return hash;
+}
+
+void test_flow_table_swiss_probe_bound()
+{
+    struct bucket_array s = {.node = -1 };
+    GInetFlow *flows = random_flows(57, 0);
+    guint64 i;
+
+    /* 49 flows from bucket 0 fill the first seven buckets. Freeing bucket 0
+     * and adding 8 from bucket 6 wraps round, leaving every bucket counting
+     * flows that probed past it.
+     */
+    buckets_init(&s, SWISS_MIN_BUCKETS);
+    for (i = 0; i < 57; i++)
+        flows[i].hash = hash_for_bucket(&s, i < 49 ? 0 : 6);
+    for (i = 0; i < 49; i++)
+        swiss_insert(&s, &flows[i]);
+    for (i = 0; i < 8; i++)
+        NP_ASSERT(swiss_remove(&s, &flows[i]));
+    for (i = 49; i < 57; i++)
+        swiss_insert(&s, &flows[i]);
+    NP_ASSERT_EQUAL(s.mask + 1, SWISS_MIN_BUCKETS);
+    for (i = 0; i <= s.mask; i++)
+        NP_ASSERT_NOT_EQUAL(s.buckets[i].overflow, 0);
+
+    /* Misses still end */
+    for (i = 8; i < 57; i++)
+        NP_ASSERT(swiss_lookup(&s, &flows[i]) == &flows[i]);
+    NP_ASSERT_NULL(swiss_lookup(&s, &flows[0]));
+    NP_ASSERT_FALSE(swiss_remove(&s, &flows[0]));
+    buckets_free(&s);
+    g_free(flows);
+}
+
+void test_flow_table_swiss()
+{
+    GInetFlowTable *table;
+    GInetFlow *flow1, *flow2;
+    guint engine;
+    guint64 size;
+
+    setup_test();
+    NP_ASSERT_NOT_NULL((table = g_inet_flow_table_new_with_engine
+                        (G_INET_FLOW_TABLE_ENGINE_SWISS)));
+    g_object_get(table, "engine", &engine, NULL);
+    NP_ASSERT_EQUAL(engine, G_INET_FLOW_TABLE_ENGINE_SWISS);
+
+    guint len = make_pkt(test_buffer, ETH_PROTOCOL_IPV6, IP_PROTOCOL_TCP);
+    NP_ASSERT_NOT_NULL((flow1 =
+                        g_inet_flow_get_full(table, test_buffer, len, 0, 0, TRUE, TRUE)));
+    len = make_pkt_reverse(test_buffer, ETH_PROTOCOL_IPV6, IP_PROTOCOL_TCP);
+    NP_ASSERT_NOT_NULL((flow2 =
+                        g_inet_flow_get_full(table, test_buffer, len, 0, 0, TRUE, TRUE)));
+    NP_ASSERT(flow1 == flow2);
+    len = make_pkt(test_buffer, ETH_PROTOCOL_IP, IP_PROTOCOL_UDP);
+    NP_ASSERT_NOT_NULL((flow2 =
+                        g_inet_flow_get_full(table, test_buffer, len, 0, 0, TRUE, TRUE)));
+    NP_ASSERT(flow1 != flow2);
+    g_object_get(table, "size", &size, NULL);
+    NP_ASSERT_EQUAL(size, 2);
+
+    /* Released flows leave the index */
+    g_object_unref(flow1);
+    g_object_get(table, "size", &size, NULL);
+    NP_ASSERT_EQUAL(size, 1);
+    NP_ASSERT(flow2 == g_inet_flow_get_full(table, test_buffer, len, 0, 0, TRUE, TRUE));
+    g_object_unref(flow2);
+    g_object_unref(table);
+}
+
+void test_flow_table_dual_index()
+{
+    struct bucket_array s = {.node = -1 };
+    GInetFlow *flows;
+    GInetFlow packet;
+    guint64 i;
+    int count;
+
+    NP_ASSERT_EQUAL(sizeof(struct flow_bucket4), 64);
+    for (count = 20000; count > 0; count -= 19800) {
+        flows = random_flows(count, count == 200 ? 0x1234 : 0);
+        buckets_init(&s, SWISS_MIN_BUCKETS);
+        for (i = 0; i < count; i++) {
+            NP_ASSERT_NULL(compact_lookup(&s, &flows[i]));
+            compact_insert(&s, &flows[i]);
+        }
+        NP_ASSERT_EQUAL(s.size, count);
+
+        /* Matches on the key alone, not the flow */
+        for (i = 0; i < count; i++) {
+            packet = flows[i];
+            NP_ASSERT(compact_lookup(&s, &packet) == &flows[i]);
+            packet.tuple.protocol = IP_PROTOCOL_TCP;
+            NP_ASSERT_NULL(compact_lookup(&s, &packet));
+        }
+        for (i = 0; i < count; i += 2)
+            compact_remove(&s, &flows[i]);
+        for (i = 0; i < count; i++)
+            NP_ASSERT(compact_lookup(&s, &flows[i]) == ((i & 1) ? &flows[i] : NULL));
+        for (i = 1; i < count; i += 2)
+            compact_remove(&s, &flows[i]);
+        NP_ASSERT_EQUAL(s.size, 0);
+        for (i = 0; i <= s.mask; i++)
+            NP_ASSERT_EQUAL(s.buckets4[i].overflow, 0);
+        buckets_free(&s);
+        g_free(flows);
+    }
+}
+
+void test_flow_table_dual_probe_bound()
+{
+    struct bucket_array s = {.node = -1 };
+    GInetFlow *flows = random_flows(25, 0);
+    guint64 i;
+
+    /* 18 flows from bucket 0 fill six buckets. Freeing seven and adding 7
+     * from bucket 5 wraps round, leaving every bucket marked.
+     */
+    buckets_init(&s, SWISS_MIN_BUCKETS);
+    for (i = 0; i < 25; i++)
+        flows[i].hash = hash_for_bucket(&s, i < 18 ? 0 : 5);
+    for (i = 0; i < 18; i++)
+        compact_insert(&s, &flows[i]);
+    for (i = 0; i < 7; i++)
+        compact_remove(&s, &flows[i]);
+    for (i = 18; i < 25; i++)
+        compact_insert(&s, &flows[i]);
+    NP_ASSERT_EQUAL(s.mask + 1, SWISS_MIN_BUCKETS);
+    for (i = 0; i <= s.mask; i++)
+        NP_ASSERT_NOT_EQUAL(s.buckets4[i].overflow, 0);
+
+    /* Misses still end */
+    for (i = 7; i < 25; i++)
+        NP_ASSERT(compact_lookup(&s, &flows[i]) == &flows[i]);
+    NP_ASSERT_NULL(compact_lookup(&s, &flows[0]));
+    compact_remove(&s, &flows[0]);
+    NP_ASSERT_EQUAL(s.size, 18);
+    buckets_free(&s);
+    g_free(flows);
+}
+
+void test_flow_table_dual()
+{
+    GInetFlowTable *table;
+    GInetFlow *flow1, *flow2, *flow3;
+    guint64 size;
+
+    setup_test();
+    NP_ASSERT_NOT_NULL((table = g_inet_flow_table_new_with_engine
+                        (G_INET_FLOW_TABLE_ENGINE_DUAL)));
+    guint len = make_pkt(test_buffer, ETH_PROTOCOL_IP, IP_PROTOCOL_TCP);
+    NP_ASSERT_NOT_NULL((flow1 =
+                        g_inet_flow_get_full(table, test_buffer, len, 0, 0, TRUE, TRUE)));
+    len = make_pkt_reverse(test_buffer, ETH_PROTOCOL_IP, IP_PROTOCOL_TCP);
+    NP_ASSERT(flow1 == g_inet_flow_get_full(table, test_buffer, len, 0, 0, TRUE, TRUE));
+    len = make_pkt(test_buffer, ETH_PROTOCOL_IPV6, IP_PROTOCOL_TCP);
+    NP_ASSERT_NOT_NULL((flow2 =
+                        g_inet_flow_get_full(table, test_buffer, len, 0, 0, TRUE, TRUE)));
+    len = make_pkt_reverse(test_buffer, ETH_PROTOCOL_IPV6, IP_PROTOCOL_TCP);
+    NP_ASSERT(flow2 == g_inet_flow_get_full(table, test_buffer, len, 0, 0, TRUE, TRUE));
+    len = make_pkt(test_buffer, ETH_PROTOCOL_IP, IP_PROTOCOL_UDP);
+    NP_ASSERT_NOT_NULL((flow3 =
+                        g_inet_flow_get_full(table, test_buffer, len, 0, 0, TRUE, TRUE)));
+    NP_ASSERT(flow1 != flow3);
+    NP_ASSERT_EQUAL(table->buckets4.size, 2);
+    NP_ASSERT_EQUAL(table->buckets.size, 1);
+    g_object_get(table, "size", &size, NULL);
+    NP_ASSERT_EQUAL(size, 3);
+
+    g_object_unref(flow1);
+    g_object_unref(flow2);
+    g_object_get(table, "size", &size, NULL);
+    NP_ASSERT_EQUAL(size, 1);
+    NP_ASSERT(flow3 == g_inet_flow_get_full(table, test_buffer, len, 0, 0, TRUE, TRUE));
+    g_object_unref(flow3);
+    g_object_unref(table);
+}
+
+void test_flow_table_cuckoo_index()
+{
+    struct bucket_array s = {.node = -1 };
+    GInetFlow *flows;
+    guint64 i;
+    guint64 count;
+
+    flows = random_flows(20000, 0);
+    buckets_init(&s, buckets_for_capacity(10000));
+    for (count = 0; count < 20000; count++) {
+        if (!cuckoo_insert(&s, &flows[count]))
+            break;
+    }
+    /* Fills most slots before the bounded search gives up */
+    NP_ASSERT(count < 20000);
+    NP_ASSERT(count * 10 > (s.mask + 1) * BUCKET_SLOTS * 9);
+    NP_ASSERT_EQUAL(s.size, count);
+
+    /* A failed insert leaves every flow where lookups expect it */
+    NP_ASSERT_NULL(cuckoo_lookup(&s, &flows[count]));
+    for (i = 0; i < count; i++)
+        NP_ASSERT(cuckoo_lookup(&s, &flows[i]) == &flows[i]);
+    for (i = 0; i < count; i++)
+        cuckoo_remove(&s, &flows[i]);
+    NP_ASSERT_EQUAL(s.size, 0);
+    for (i = 0; i <= s.mask; i++)
+        NP_ASSERT_EQUAL(bucket_match(&s.buckets[i], 0), 0x7f);
+    buckets_free(&s);
+    g_free(flows);
+}
+
+void test_flow_table_cuckoo_full()
+{
+    GInetFlowTable *table;
+    GInetFlow *packets;
+    GInetFlow *flows[512];
+    guint64 capacity;
+    guint64 misses;
+    guint64 size;
+    guint count;
+    guint engine;
+    guint i;
+
+    setup_test();
+    NP_ASSERT_NOT_NULL((table = g_object_new(G_INET_TYPE_FLOW_TABLE,
+                                             "engine", G_INET_FLOW_TABLE_ENGINE_CUCKOO,
+                                             "capacity", (guint64) 8, NULL)));
+    g_object_get(table, "engine", &engine, "capacity", &capacity, NULL);
+    NP_ASSERT_EQUAL(engine, G_INET_FLOW_TABLE_ENGINE_CUCKOO);
+    NP_ASSERT_EQUAL(capacity, 8);
+
+    /* New flows are refused once no room can be made, like the max limit */
+    packets = random_flows(512, 0);
+    for (count = 0; count < 512; count++) {
+        packets[count].family = G_SOCKET_FAMILY_IPV4;
+        flows[count] = flow_packet_get(table, &packets[count], TRUE);
+        if (!flows[count])
+            break;
+    }
+    NP_ASSERT(count > 0 && count < 512);
+    g_object_get(table, "size", &size, "misses", &misses, NULL);
+    NP_ASSERT_EQUAL(size, count);
+    NP_ASSERT_EQUAL(misses, count);
+
+    /* Existing flows are still found and freed room is reused */
+    for (i = 0; i < count; i++)
+        NP_ASSERT(flow_packet_get(table, &packets[i], TRUE) == flows[i]);
+    g_object_unref(flows[0]);
+    NP_ASSERT_NOT_NULL((flows[0] = flow_packet_get(table, &packets[0], TRUE)));
+
+    for (i = 0; i < count; i++)
+        g_object_unref(flows[i]);
+    g_object_get(table, "size", &size, NULL);
+    NP_ASSERT_EQUAL(size, 0);
+    g_free(packets);
+    g_object_unref(table);
+}
+
+void test_flow_table_new_sized()
+{
+    GInetFlowTable *table;
+    GInetFlow *packets;
+    GInetFlow *flows[5];
+    GInetFlow *flow;
+    guint64 capacity;
+    guint64 max;
+    guint64 size;
+    guint64 count;
+    guint engine;
+    int i;
+
+    setup_test();
+    NP_ASSERT_NOT_NULL((table = g_inet_flow_table_new_sized(4)));
+    g_object_get(table, "engine", &engine, "capacity", &capacity, "max", &max, NULL);
+    NP_ASSERT_EQUAL(engine, G_INET_FLOW_TABLE_ENGINE_SWISS);
+    NP_ASSERT_EQUAL(capacity, 4);
+    NP_ASSERT_EQUAL(max, 4);
+
+    /* Every flow comes from the pool and the fifth is refused */
+    packets = random_flows(5, 0);
+    for (i = 0; i < 5; i++) {
+        packets[i].family = G_SOCKET_FAMILY_IPV4;
+        flows[i] = flow_packet_get(table, &packets[i], TRUE);
+    }
+    NP_ASSERT_NULL(flows[4]);
+    NP_ASSERT_NULL(table->pool);
+
+    /* A released flow goes back to the pool and is reused as new */
+    NP_ASSERT(flow_packet_get(table, &packets[2], TRUE) == flows[2]);
+    g_object_unref(flows[2]);
+    g_object_get(table, "size", &size, NULL);
+    NP_ASSERT_EQUAL(size, 3);
+    NP_ASSERT(table->pool == &flows[2]->list);
+    NP_ASSERT((flow = flow_packet_get(table, &packets[4], TRUE)) == flows[2]);
+    g_object_get(flow, "packets", &count, NULL);
+    NP_ASSERT_EQUAL(count, 1);
+    NP_ASSERT(flow->table == table);
+    NP_ASSERT(memcmp(&flow->tuple, &packets[4].tuple, sizeof(struct tuple)) == 0);
+    NP_ASSERT_NULL(flow_index_lookup(table, &packets[2]));
+    NP_ASSERT(flow_index_lookup(table, &packets[4]) == flow);
+
+    for (i = 0; i < 4; i++)
+        g_object_unref(flows[i]);
+    g_object_get(table, "size", &size, NULL);
+    NP_ASSERT_EQUAL(size, 0);
+    g_free(packets);
+    g_object_unref(table);
+}
+
+void test_flow_table_incremental_resize()
+{
+    GInetFlowTable *table;
+    GInetFlow *flows;
+    GInetFlow *flow;
+    gboolean incremental;
+    gboolean migrated = FALSE;
+    guint64 i;
+    guint64 j;
+
+    setup_test();
+    NP_ASSERT_NOT_NULL((table = g_object_new(G_INET_TYPE_FLOW_TABLE,
+                                             "engine", G_INET_FLOW_TABLE_ENGINE_SWISS,
+                                             "incremental-resize", TRUE, NULL)));
+    g_object_get(table, "incremental-resize", &incremental, NULL);
+    NP_ASSERT(incremental);
+
+    /* Flows stay reachable while they are spread over both arrays */
+    flows = random_flows(40000, 0);
+    for (i = 0; i < 20000; i++) {
+        NP_ASSERT_NULL(flow_index_lookup(table, &flows[i]));
+        NP_ASSERT(flow_index_insert(table, &flows[i]));
+        if (table->migrating.buckets) {
+            migrated = TRUE;
+            for (j = 0; j <= i; j += 97)
+                NP_ASSERT(flow_index_lookup(table, &flows[j]) == &flows[j]);
+        }
+        NP_ASSERT_EQUAL(flow_index_size(table), i + 1);
+    }
+    NP_ASSERT(migrated);
+    for (i = 0; i < 20000; i++)
+        NP_ASSERT(flow_index_lookup(table, &flows[i]) == &flows[i]);
+
+    /* Removal finds flows in whichever array holds them */
+    for (; i < 40000 && !table->migrating.buckets; i++)
+        NP_ASSERT(flow_index_insert(table, &flows[i]));
+    NP_ASSERT_NOT_NULL(table->migrating.buckets);
+    for (j = 0; j < i; j++)
+        flow_index_remove(table, &flows[j]);
+    NP_ASSERT_EQUAL(flow_index_size(table), 0);
+    for (j = 0; j < i; j++)
+        NP_ASSERT_NULL(flow_index_lookup(table, &flows[j]));
+    g_object_unref(table);
+
+    /* Packets served from the cache still move the migration on */
+    NP_ASSERT_NOT_NULL((table = g_object_new(G_INET_TYPE_FLOW_TABLE,
+                                             "engine", G_INET_FLOW_TABLE_ENGINE_SWISS,
+                                             "incremental-resize", TRUE, "cache-size", 64,
+                                             NULL)));
+    for (i = 0; !table->migrating.buckets; i++)
+        NP_ASSERT_NOT_NULL((flow = flow_packet_get(table, &flows[i], FALSE)));
+    for (j = 0; j <= table->migrating.mask && table->migrating.buckets; j++)
+        NP_ASSERT(flow_packet_get(table, &flows[i - 1], FALSE) == flow);
+    NP_ASSERT_NULL(table->migrating.buckets);
+    NP_ASSERT_EQUAL(table->cache_hits, j);
+    g_free(flows);
+    g_object_unref(table);
+}
+
+void test_flow_records()
+{
+    guint64 now = get_time_us();
+    guint64 later = now + (G_INET_FLOW_DEFAULT_OPEN_TIMEOUT * 1000000);
+    GInetFlowTable *table;
+    GInetFlowRecord *record;
+    GInetFlow *object;
+    guint64 packets;
+    guint64 size;
+    guint protocol;
+    guint len;
+
+    setup_test();
+    NP_ASSERT_NOT_NULL((table = g_object_new(G_INET_TYPE_FLOW_TABLE, "records", TRUE, NULL)));
+    len = make_pkt(test_buffer, ETH_PROTOCOL_IP, IP_PROTOCOL_UDP);
+    record = g_inet_flow_record_get_full(table, test_buffer, len, 0, now, TRUE, TRUE);
+    NP_ASSERT_NOT_NULL(record);
+    len = make_pkt_reverse(test_buffer, ETH_PROTOCOL_IP, IP_PROTOCOL_UDP);
+    NP_ASSERT(record == g_inet_flow_record_get_full(table, test_buffer, len, 0, now,
+                                                    TRUE, TRUE));
+    NP_ASSERT_EQUAL(g_inet_flow_record_packets(record), 2);
+    NP_ASSERT_EQUAL(g_inet_flow_record_state(record), FLOW_OPEN);
+    NP_ASSERT_EQUAL(g_inet_flow_record_family(record), G_SOCKET_FAMILY_IPV4);
+    NP_ASSERT_EQUAL(g_inet_flow_record_protocol(record), IP_PROTOCOL_UDP);
+    NP_ASSERT_EQUAL(g_inet_flow_record_timestamp(record), now);
+    NP_ASSERT(g_inet_flow_record_lport(record) < g_inet_flow_record_uport(record));
+
+    /* The wrapper is shared and reads through to the record */
+    NP_ASSERT_NOT_NULL((object = g_inet_flow_record_object(record)));
+    NP_ASSERT(object == g_inet_flow_record_object(record));
+    g_object_unref(object);
+    g_inet_flow_record_get_full(table, test_buffer, len, 0, now, TRUE, TRUE);
+    g_object_get(object, "packets", &packets, NULL);
+    NP_ASSERT_EQUAL(packets, 3);
+
+    /* Released records leave the table, a held wrapper keeps their values */
+    NP_ASSERT(record == g_inet_flow_record_expire(table, later));
+    g_inet_flow_record_release(record);
+    g_object_get(table, "size", &size, NULL);
+    NP_ASSERT_EQUAL(size, 0);
+    g_object_get(object, "packets", &packets, "protocol", &protocol, NULL);
+    NP_ASSERT_EQUAL(packets, 3);
+    NP_ASSERT_EQUAL(protocol, IP_PROTOCOL_UDP);
+    g_object_unref(object);
+
+    /* Records still held are freed with the table */
+    len = make_pkt(test_buffer, ETH_PROTOCOL_IPV6, IP_PROTOCOL_TCP);
+    record = g_inet_flow_record_get_full(table, test_buffer, len, 0, now, TRUE, TRUE);
+    NP_ASSERT_NOT_NULL(record);
+    object = g_inet_flow_record_object(record);
+    g_object_unref(table);
+    g_object_get(object, "packets", &packets, NULL);
+    NP_ASSERT_EQUAL(packets, 1);
+    g_object_unref(object);
+}
+
+static void check_pool(GInetFlowTable * table, guint64 in_use, guint64 free,
+                       guint64 high_water)
+{
+    guint64 value[3];
+
+    g_object_get(table, "in-use", &value[0], "free", &value[1], "high-water", &value[2],
+                 NULL);
+    NP_ASSERT_EQUAL(value[0], in_use);
+    NP_ASSERT_EQUAL(value[1], free);
+    NP_ASSERT_EQUAL(value[2], high_water);
+}
+
+void test_flow_table_recycle()
+{
+    GInetFlowTable *table;
+    GInetFlow *packets;
+    GInetFlow *flows[3];
+    GInetFlowRecord *record;
+    gboolean recycle;
+    int i;
+
+    setup_test();
+    packets = random_flows(4, 0);
+
+    /* Objects are only recycled when asked for, so data never carries over */
+    NP_ASSERT_NOT_NULL((table = g_inet_flow_table_new()));
+    g_object_get(table, "recycle", &recycle, NULL);
+    NP_ASSERT_FALSE(recycle);
+    flows[0] = flow_packet_get(table, &packets[0], TRUE);
+    g_object_set_data((GObject *) flows[0], "test", table);
+    g_object_unref(flows[0]);
+    flows[0] = flow_packet_get(table, &packets[1], TRUE);
+    NP_ASSERT_NULL(g_object_get_data((GObject *) flows[0], "test"));
+    g_object_unref(flows[0]);
+    g_object_unref(table);
+
+    NP_ASSERT_NOT_NULL((table = g_object_new(G_INET_TYPE_FLOW_TABLE, "recycle", TRUE, NULL)));
+    for (i = 0; i < 3; i++)
+        flows[i] = flow_packet_get(table, &packets[i], TRUE);
+    check_pool(table, 3, 0, 3);
+
+    /* Released flows wait on the free list for the next miss */
+    g_object_unref(flows[1]);
+    check_pool(table, 2, 1, 3);
+    NP_ASSERT(flow_packet_get(table, &packets[3], TRUE) == flows[1]);
+    NP_ASSERT_NULL(flow_index_lookup(table, &packets[1]));
+    check_pool(table, 3, 0, 3);
+    for (i = 0; i < 3; i++)
+        g_object_unref(flows[i]);
+    check_pool(table, 0, 3, 3);
+    g_object_unref(table);
+
+    /* Records come from slabs */
+    NP_ASSERT_NOT_NULL((table = g_object_new(G_INET_TYPE_FLOW_TABLE, "records", TRUE, NULL)));
+    record = (GInetFlowRecord *) flow_packet_get(table, &packets[0], TRUE);
+    check_pool(table, 1, RECORD_SLAB_SIZE - 1, 1);
+    g_inet_flow_record_release(record);
+    check_pool(table, 0, RECORD_SLAB_SIZE, 1);
+    NP_ASSERT(record == (GInetFlowRecord *) flow_packet_get(table, &packets[1], TRUE));
+    flow_packet_get(table, &packets[2], TRUE);
+    check_pool(table, 2, RECORD_SLAB_SIZE - 2, 2);
+    g_object_unref(table);
+    g_free(packets);
+}
+
+void test_flow_table_cache()
+{
+    GInetFlowTable *table;
+    GInetFlow *packets;
+    GInetFlow *flows[3];
+    guint cache_size;
+    gdouble rate;
+    int i;
+
+    setup_test();
+    NP_ASSERT_NOT_NULL((table = g_object_new(G_INET_TYPE_FLOW_TABLE, "engine",
+                                             G_INET_FLOW_TABLE_ENGINE_SWISS,
+                                             "cache-size", 1000, NULL)));
+    g_object_get(table, "cache-size", &cache_size, "cache-hit-rate", &rate, NULL);
+    NP_ASSERT_EQUAL(cache_size, 1024);
+    NP_ASSERT_EQUAL(rate, 0.0);
+
+    /* Flows sharing a hash share a cache entry but are told apart */
+    packets = random_flows(3, 0);
+    packets[1].hash = packets[0].hash;
+    for (i = 0; i < 3; i++)
+        flows[i] = flow_packet_get(table, &packets[i], TRUE);
+    NP_ASSERT(flow_packet_get(table, &packets[2], FALSE) == flows[2]);
+    NP_ASSERT(flow_packet_get(table, &packets[0], FALSE) == flows[0]);
+    NP_ASSERT(flow_packet_get(table, &packets[0], FALSE) == flows[0]);
+    NP_ASSERT(flow_packet_get(table, &packets[1], FALSE) == flows[1]);
+    NP_ASSERT_EQUAL(table->cache_hits, 2);
+    NP_ASSERT_EQUAL(table->cache_lookups, 7);
+
+    /* Expired flows are dropped from the cache as they are released */
+    for (i = 0; i < 3; i++)
+        g_object_unref(flow_expire(table, G_MAXUINT64));
+    for (i = 0; i < 3; i++)
+        NP_ASSERT_NULL(flow_cache_entry(table, packets[i].hash)->flow);
+    g_object_unref(table);
+
+    /* Each stripe caches its own flows */
+    g_free(packets);
+    packets = random_flows(3, 0);
+    NP_ASSERT_NOT_NULL((table = g_object_new(G_INET_TYPE_FLOW_TABLE, "engine",
+                                             G_INET_FLOW_TABLE_ENGINE_SWISS, "stripes", 4,
+                                             "cache-size", 64, NULL)));
+    NP_ASSERT_NULL(table->cache);
+    for (i = 0; i < 3; i++)
+        flows[i] = flow_table_get(table, &packets[i], TRUE);
+    for (i = 0; i < 3; i++)
+        NP_ASSERT(flow_table_get(table, &packets[i], TRUE) == flows[i]);
+    g_object_get(table, "cache-hit-rate", &rate, NULL);
+    NP_ASSERT_EQUAL(rate, 0.5);
+    for (i = 0; i < 3; i++)
+        g_object_unref(flows[i]);
+    g_object_unref(table);
+    g_free(packets);
+}
+
+#define WHEEL_TEST_FLOWS    1000
+#define WHEEL_TEST_DAY      (24 * 3600 * 1000000ULL)
+void test_flow_expiry_wheel()
+{
+    GInetFlowTable *table;
+    GInetFlow *packets;
+    GInetFlow *flows[WHEEL_TEST_FLOWS];
+    gboolean live[WHEEL_TEST_FLOWS];
+    guint64 base = 1500000000000000ULL;
+    guint64 ts = base;
+    GInetFlow *flow;
+    int step;
+    int i;
+    int j;
+
+    setup_test();
+    NP_ASSERT_NOT_NULL((table = g_inet_flow_table_new()));
+    packets = random_flows(WHEEL_TEST_FLOWS, 0);
+    for (i = 0; i < WHEEL_TEST_FLOWS; i++) {
+        packets[i].timestamp = base + g_random_int_range(0, 10000000);
+        flows[i] = flow_packet_get(table, &packets[i], TRUE);
+        live[i] = TRUE;
+        /* Lifetimes from seconds to beyond the reach of the wheel */
+        wheel_remove(table, flows[i]);
+        switch (i % 4) {
+        case 0:
+            flows[i]->lifetime = g_random_int_range(0, 10);
+            break;
+        case 1:
+            flows[i]->lifetime = g_random_int_range(10, 600);
+            break;
+        case 2:
+            flows[i]->lifetime = g_random_int_range(3600, 2 * 24 * 3600);
+            break;
+        case 3:
+            flows[i]->lifetime = g_random_int_range(20 * 24 * 3600, 60 * 24 * 3600);
+            break;
+        }
+        wheel_insert(table, flows[i]);
+    }
+
+    for (step = 0; step <= 300; step++) {
+        if (step == 300)
+            ts = G_MAXUINT64;
+        else if (step % 50 == 25)
+            ts -= g_random_int_range(0, 10000000);
+        else if (step % 20 == 0)
+            ts += g_random_int_range(0, 3 * 24 * 3600) * 1000000ULL;
+        else
+            ts += g_random_int_range(0, 3000000);
+
+        /* Some flows see packets and are rescheduled */
+        for (i = 0; i < 10; i++) {
+            j = g_random_int_range(0, WHEEL_TEST_FLOWS);
+            if (live[j] && step < 300 && ts > flows[j]->timestamp) {
+                packets[j].timestamp = ts;
+                NP_ASSERT(flow_packet_get(table, &packets[j], TRUE) == flows[j]);
+            }
+        }
+
+        while ((flow = g_inet_flow_expire(table, ts))) {
+            NP_ASSERT(flow_deadline(flow) <= ts);
+            for (j = 0; flows[j] != flow; j++);
+            live[j] = FALSE;
+            g_object_unref(flow);
+        }
+        for (j = 0; j < WHEEL_TEST_FLOWS; j++)
+            NP_ASSERT(!live[j] || flow_deadline(flows[j]) > ts);
+    }
+    for (j = 0; j < WHEEL_TEST_FLOWS; j++)
+        NP_ASSERT(!live[j]);
+    NP_ASSERT(wheel_empty(&table->wheel));
+    g_object_unref(table);
+    g_free(packets);
+}
+
+static void expire_batch_release(GInetFlow * flow, gpointer user_data)
+{
+    (*(guint *) user_data)++;
+    g_object_unref(flow);
+}
+
+static void expire_batch_keep(GInetFlow * flow, gpointer user_data)
+{
+    (*(guint *) user_data)++;
+}
+
+static void expire_batch_hold(GInetFlow * flow, gpointer user_data)
+{
+    g_ptr_array_add((GPtrArray *) user_data, flow);
+}
+
+static void expire_batch_record(GInetFlowRecord * record, gpointer user_data)
+{
+    (*(guint *) user_data)++;
+    g_inet_flow_record_release(record);
+}
+
+void test_flow_expire_batch()
+{
+    GInetFlowTable *table;
+    GInetFlow *packets;
+    guint64 now = 1000000000;
+    guint64 size;
+    GPtrArray *held;
+    gboolean more;
+    guint calls;
+    int stripes;
+    int i;
+
+    setup_test();
+    packets = random_flows(15, 0);
+    for (stripes = 0; stripes <= 4; stripes += 4) {
+        NP_ASSERT_NOT_NULL((table = g_object_new(G_INET_TYPE_FLOW_TABLE, "stripes", stripes,
+                                                 NULL)));
+        /* Ten flows are due, five are not */
+        for (i = 0; i < 15; i++) {
+            packets[i].timestamp = i < 10 ? now : now + 1000000;
+            NP_ASSERT_NOT_NULL(flow_table_get(table, &packets[i], TRUE));
+        }
+        now += G_INET_FLOW_DEFAULT_NEW_TIMEOUT * 1000000;
+
+        /* Flows kept by the callback come back on the next call */
+        if (!stripes) {
+            calls = 0;
+            NP_ASSERT_EQUAL(g_inet_flow_expire_batch(table, now, 100, expire_batch_keep,
+                                                     &calls, &more), 10);
+            NP_ASSERT_EQUAL(calls, 10);
+            NP_ASSERT_FALSE(more);
+        }
+
+        calls = 0;
+        NP_ASSERT_EQUAL(g_inet_flow_expire_batch(table, now, 4, expire_batch_release,
+                                                 &calls, &more), 4);
+        NP_ASSERT_EQUAL(calls, 4);
+        NP_ASSERT_TRUE(more);
+        NP_ASSERT_EQUAL(g_inet_flow_expire_batch(table, now, 100, expire_batch_release,
+                                                 &calls, &more), 6);
+        NP_ASSERT_EQUAL(calls, 10);
+        NP_ASSERT_FALSE(more);
+        NP_ASSERT_EQUAL(g_inet_flow_expire_batch(table, now, 100, expire_batch_release,
+                                                 &calls, NULL), 0);
+        g_object_get(table, "size", &size, NULL);
+        NP_ASSERT_EQUAL(size, 5);
+        NP_ASSERT_EQUAL(g_inet_flow_expire_batch(table, G_MAXUINT64, 100,
+                                                 expire_batch_release, &calls, &more), 5);
+        g_object_unref(table);
+    }
+
+    /* Striped tables unlink flows before handing them over, so even kept
+     * flows are handed over once and lookups no longer find them
+     */
+    NP_ASSERT_NOT_NULL((table = g_object_new(G_INET_TYPE_FLOW_TABLE, "stripes", 4, NULL)));
+    for (i = 0; i < 10; i++)
+        NP_ASSERT_NOT_NULL(flow_table_get(table, &packets[i], TRUE));
+    held = g_ptr_array_new();
+    NP_ASSERT_EQUAL(g_inet_flow_expire_batch(table, G_MAXUINT64, 100, expire_batch_hold, held,
+                                             NULL), 10);
+    NP_ASSERT_EQUAL(g_inet_flow_expire_batch(table, G_MAXUINT64, 100, expire_batch_hold, held,
+                                             NULL), 0);
+    g_object_get(table, "size", &size, NULL);
+    NP_ASSERT_EQUAL(size, 0);
+    for (i = 0; i < 10; i++) {
+        NP_ASSERT_NULL(flow_index_lookup(stripe_for_hash(table, packets[i].hash),
+                                         &packets[i]));
+        g_object_unref(held->pdata[i]);
+    }
+    g_ptr_array_free(held, TRUE);
+    g_object_unref(table);
+
+    /* Record tables hand over records */
+    NP_ASSERT_NOT_NULL((table = g_object_new(G_INET_TYPE_FLOW_TABLE, "records", TRUE, NULL)));
+    for (i = 0; i < 15; i++) {
+        packets[i].timestamp = now;
+        flow_packet_get(table, &packets[i], TRUE);
+    }
+    calls = 0;
+    NP_ASSERT_EQUAL(g_inet_flow_record_expire_batch(table, G_MAXUINT64, G_MAXUINT,
+                                                    expire_batch_record, &calls, &more),
+                    15);
+    NP_ASSERT_EQUAL(calls, 15);
+    NP_ASSERT_NULL(g_inet_flow_record_expire(table, G_MAXUINT64));
+    g_object_unref(table);
+    g_free(packets);
+}
+
+void test_flow_aging_source()
+{
+    GInetFlowTable *table;
+    GMainContext *context;
+    GSource *source;
+    GInetFlow *packets;
+    guint64 past = get_time_us() - 3600 * (guint64) TIMESTAMP_RESOLUTION_US;
+    guint64 size;
+    guint calls;
+    int stripes;
+    int i;
+
+    setup_test();
+    packets = random_flows(7, 0);
+    context = g_main_context_new();
+    for (stripes = 0; stripes <= 4; stripes += 4) {
+        NP_ASSERT_NOT_NULL((table = g_object_new(G_INET_TYPE_FLOW_TABLE, "stripes", stripes,
+                                                 NULL)));
+        /* Five flows long due are aged two at a time */
+        for (i = 0; i < 5; i++) {
+            packets[i].timestamp = past;
+            NP_ASSERT_NOT_NULL(flow_table_get(table, &packets[i], TRUE));
+        }
+        NP_ASSERT_NOT_NULL((source = g_inet_flow_aging_source_new(table, 2)));
+        NP_ASSERT_NULL(g_inet_flow_aging_source_new(table, 2));
+        calls = 0;
+        g_source_set_callback(source, (GSourceFunc) expire_batch_release, &calls, NULL);
+        g_source_attach(source, context);
+        NP_ASSERT_EQUAL(g_source_get_ready_time(source), 0);
+        NP_ASSERT_TRUE(g_main_context_iteration(context, FALSE));
+        NP_ASSERT_EQUAL(calls, 2);
+        NP_ASSERT_TRUE(g_main_context_iteration(context, FALSE));
+        NP_ASSERT_TRUE(g_main_context_iteration(context, FALSE));
+        NP_ASSERT_EQUAL(calls, 5);
+        g_object_get(table, "size", &size, NULL);
+        NP_ASSERT_EQUAL(size, 0);
+        NP_ASSERT_EQUAL(g_source_get_ready_time(source), -1);
+
+        /* A new flow sets the source to run when it is due */
+        packets[5].timestamp = 0;
+        NP_ASSERT_NOT_NULL(flow_table_get(table, &packets[5], TRUE));
+        NP_ASSERT_TRUE(g_source_get_ready_time(source) > g_get_monotonic_time());
+        NP_ASSERT_FALSE(g_main_context_iteration(context, FALSE));
+
+        /* and one due sooner brings it forward */
+        packets[6].timestamp = past;
+        NP_ASSERT_NOT_NULL(flow_table_get(table, &packets[6], TRUE));
+        NP_ASSERT_TRUE(g_main_context_iteration(context, FALSE));
+        NP_ASSERT_EQUAL(calls, 6);
+        NP_ASSERT_TRUE(g_source_get_ready_time(source) > g_get_monotonic_time());
+
+        g_source_destroy(source);
+        g_source_unref(source);
+        NP_ASSERT_NULL(table->aging);
+        g_inet_flow_expire_batch(table, G_MAXUINT64, 100, expire_batch_release, &calls,
+                                 NULL);
+        g_object_unref(table);
+    }
+
+    /* Flows the callback keeps are offered again later, not straight away */
+    NP_ASSERT_NOT_NULL((table = g_inet_flow_table_new()));
+    packets[0].timestamp = past;
+    NP_ASSERT_NOT_NULL(flow_table_get(table, &packets[0], TRUE));
+    NP_ASSERT_NOT_NULL((source = g_inet_flow_aging_source_new(table, 2)));
+    calls = 0;
+    g_source_set_callback(source, (GSourceFunc) expire_batch_keep, &calls, NULL);
+    g_source_attach(source, context);
+    NP_ASSERT_TRUE(g_main_context_iteration(context, FALSE));
+    NP_ASSERT_EQUAL(calls, 1);
+    NP_ASSERT_TRUE(g_source_get_ready_time(source) > g_get_monotonic_time());
+    NP_ASSERT_FALSE(g_main_context_iteration(context, FALSE));
+    NP_ASSERT_EQUAL(calls, 1);
+    g_source_destroy(source);
+    g_source_unref(source);
+    g_inet_flow_expire_batch(table, G_MAXUINT64, 100, expire_batch_release, &calls, NULL);
+    g_object_unref(table);
+
+    /* Record tables hand over records */
+    NP_ASSERT_NOT_NULL((table = g_object_new(G_INET_TYPE_FLOW_TABLE, "records", TRUE, NULL)));
+    for (i = 0; i < 5; i++) {
+        packets[i].timestamp = past;
+        flow_packet_get(table, &packets[i], TRUE);
+    }
+    NP_ASSERT_NOT_NULL((source = g_inet_flow_aging_source_new(table, 100)));
+    calls = 0;
+    g_source_set_callback(source, (GSourceFunc) expire_batch_record, &calls, NULL);
+    g_source_attach(source, context);
+    NP_ASSERT_TRUE(g_main_context_iteration(context, FALSE));
+    NP_ASSERT_EQUAL(calls, 5);
+    g_source_destroy(source);
+    g_source_unref(source);
+    g_object_unref(table);
+    g_main_context_unref(context);
+    g_free(packets);
+}
+
+#define FIELD_IN_HOT_LINE(__f) \
+    (G_STRUCT_OFFSET(GInetFlow, __f) >= FLOW_HOT_START && \
+     G_STRUCT_OFFSET(GInetFlow, __f) + sizeof(((GInetFlow *) 0)->__f) <= \
+     FLOW_HOT_START + 64)
+
+void test_flow_layout()
+{
+    GInetFlowTable *table;
+    GInetFlow *packets;
+    GInetFlow *flow;
+
+    /* Key and per-packet update fields share one line of their own */
+    NP_ASSERT_EQUAL(FLOW_HOT_START % 64, 0);
+    NP_ASSERT(FLOW_HOT_END - FLOW_HOT_START <= 64);
+    NP_ASSERT(FIELD_IN_HOT_LINE(tuple));
+    NP_ASSERT(FIELD_IN_HOT_LINE(timestamp));
+    NP_ASSERT(FIELD_IN_HOT_LINE(packets));
+    NP_ASSERT(FIELD_IN_HOT_LINE(lifetime));
+    NP_ASSERT(FIELD_IN_HOT_LINE(state));
+    NP_ASSERT(FIELD_IN_HOT_LINE(direction));
+    NP_ASSERT(FIELD_IN_HOT_LINE(flags));
+    NP_ASSERT(!FIELD_IN_HOT_LINE(parent));
+    NP_ASSERT(!FIELD_IN_HOT_LINE(table));
+    NP_ASSERT(!FIELD_IN_HOT_LINE(context));
+    NP_ASSERT(!FIELD_IN_HOT_LINE(hash));
+    NP_ASSERT(!FIELD_IN_HOT_LINE(family));
+    NP_ASSERT_EQUAL(FLOW_STRIDE % 64, 0);
+
+    /* Records from a slab keep the hot line aligned */
+    setup_test();
+    table = g_object_new(G_INET_TYPE_FLOW_TABLE, "records", TRUE, NULL);
+    packets = random_flows(2, 0);
+    flow = flow_packet_get(table, &packets[0], TRUE);
+    NP_ASSERT_EQUAL((guintptr) &flow->tuple % 64, 0);
+    flow = flow_packet_get(table, &packets[1], TRUE);
+    NP_ASSERT_EQUAL((guintptr) &flow->tuple % 64, 0);
+    g_object_unref(table);
+    g_free(packets);
+}
+
+void test_flow_table_huge_pages()
+{
+    GInetFlowTable *table;
+    GInetFlow *packets;
+    GInetFlow *flows[3];
+    guint64 page_size;
+    guint64 free;
+    gboolean huge;
+    int i;
+
+    setup_test();
+    table = g_object_new(G_INET_TYPE_FLOW_TABLE, NULL);
+    g_object_get(table, "huge-pages", &huge, "page-size", &page_size, NULL);
+    NP_ASSERT_FALSE(huge);
+    NP_ASSERT_EQUAL(page_size, sysconf(_SC_PAGESIZE));
+    g_object_unref(table);
+
+    /* Falls back to the base page size where huge pages are unavailable */
+    table = g_object_new(G_INET_TYPE_FLOW_TABLE, "engine", G_INET_FLOW_TABLE_ENGINE_DUAL,
+                         "records", TRUE, "huge-pages", TRUE, NULL);
+    packets = random_flows(3, 0);
+    for (i = 0; i < 3; i++) {
+        packets[i].family = i ? G_SOCKET_FAMILY_IPV4 : G_SOCKET_FAMILY_IPV6;
+        flows[i] = flow_packet_get(table, &packets[i], TRUE);
+    }
+    for (i = 0; i < 3; i++)
+        NP_ASSERT(flow_index_lookup(table, &packets[i]) == flows[i]);
+    g_object_get(table, "page-size", &page_size, "free", &free, NULL);
+    NP_ASSERT(page_size >= sysconf(_SC_PAGESIZE));
+    NP_ASSERT_EQUAL(page_size & (page_size - 1), 0);
+    NP_ASSERT_EQUAL(free, (HUGE_PAGE_2MB - 63) / FLOW_STRIDE - 3);
+    NP_ASSERT_EQUAL(table->buckets.length % HUGE_PAGE_2MB, 0);
+    g_object_unref(table);
+    g_free(packets);
+}
+
+void test_flow_table_numa_node()
+{
+    GInetFlowTable *table;
+    GInetFlow *packets;
+    GInetFlow *flow;
+    const int mpol_f_addr = 2;
+    unsigned long nodes = 0;
+    int mode = -1;
+    int node;
+
+    setup_test();
+    table = g_object_new(G_INET_TYPE_FLOW_TABLE, NULL);
+    g_object_get(table, "numa-node", &node, NULL);
+    NP_ASSERT_EQUAL(node, -1);
+    g_object_unref(table);
+
+    /* Index and records prefer the node before their pages are touched */
+    table = g_object_new(G_INET_TYPE_FLOW_TABLE, "engine", G_INET_FLOW_TABLE_ENGINE_SWISS,
+                         "records", TRUE, "numa-node", 0, NULL);
+    g_object_get(table, "numa-node", &node, NULL);
+    NP_ASSERT_EQUAL(node, 0);
+    packets = random_flows(1, 0);
+    flow = flow_packet_get(table, packets, TRUE);
+    NP_ASSERT(flow_index_lookup(table, packets) == flow);
+    NP_ASSERT(table->buckets.length > 0);
+    NP_ASSERT_EQUAL(syscall(SYS_get_mempolicy, &mode, &nodes, NUMA_NODES_MAX + 1,
+                            table->buckets.buckets, mpol_f_addr), 0);
+    NP_ASSERT_EQUAL(mode, NUMA_MPOL_PREFERRED);
+    NP_ASSERT_EQUAL(nodes, 1);
+    NP_ASSERT_EQUAL(syscall(SYS_get_mempolicy, &mode, &nodes, NUMA_NODES_MAX + 1,
+                            flow, mpol_f_addr), 0);
+    NP_ASSERT_EQUAL(mode, NUMA_MPOL_PREFERRED);
+    g_object_unref(table);
+    g_free(packets);
+}
+
+#define STRIPE_TEST_THREADS 4
+#define STRIPE_TEST_FLOWS   4000
+struct stripe_test {
+    GInetFlowTable *table;
+    GInetFlow *packets;
+};
+
+static gpointer stripe_test_thread(gpointer data)
+{
+    struct stripe_test *test = (struct stripe_test *) data;
+    int pass;
+    int i;
+
+    /* Every flow is created on the first pass and found on the second */
+    for (pass = 0; pass < 2; pass++) {
+        for (i = 0; i < STRIPE_TEST_FLOWS / STRIPE_TEST_THREADS; i++) {
+            if (!flow_table_get(test->table, &test->packets[i], TRUE))
+                return GINT_TO_POINTER(FALSE);
+        }
+    }
+    return GINT_TO_POINTER(TRUE);
+}
+
+void test_flow_table_stripes()
+{
+    struct stripe_test tests[STRIPE_TEST_THREADS];
+    GThread *threads[STRIPE_TEST_THREADS];
+    GInetFlowTable *table;
+    GInetFlow *packets;
+    GInetFlow *flow;
+    guint64 hits, misses, size, in_use;
+    guint stripes;
+    guint8 *p;
+    guint len;
+    int i;
+
+    setup_test();
+    table = g_object_new(G_INET_TYPE_FLOW_TABLE, "engine", G_INET_FLOW_TABLE_ENGINE_SWISS,
+                         "stripes", 3, NULL);
+    g_object_get(table, "stripes", &stripes, NULL);
+    NP_ASSERT_EQUAL(stripes, 4);
+    packets = random_flows(STRIPE_TEST_FLOWS, 0);
+    for (i = 0; i < STRIPE_TEST_THREADS; i++) {
+        tests[i].table = table;
+        tests[i].packets = packets + i * (STRIPE_TEST_FLOWS / STRIPE_TEST_THREADS);
+        threads[i] = g_thread_new("stripe", stripe_test_thread, &tests[i]);
+    }
+    for (i = 0; i < STRIPE_TEST_THREADS; i++)
+        NP_ASSERT(GPOINTER_TO_INT(g_thread_join(threads[i])));
+
+    /* Statistics add up over the stripes and the per thread counters */
+    g_object_get(table, "size", &size, "hits", &hits, "misses", &misses, "in-use", &in_use,
+                 NULL);
+    NP_ASSERT_EQUAL(size, STRIPE_TEST_FLOWS);
+    NP_ASSERT_EQUAL(in_use, STRIPE_TEST_FLOWS);
+    NP_ASSERT_EQUAL(hits, STRIPE_TEST_FLOWS);
+    NP_ASSERT_EQUAL(misses, STRIPE_TEST_FLOWS);
+    for (i = 0; i < stripes; i++)
+        NP_ASSERT(flow_index_size(table->stripes[i]) > 0);
+
+    /* Expired flows are found in any stripe and unlinked under its lock, so
+     * lookups no longer find them even before they are released
+     */
+    NP_ASSERT_NOT_NULL((flow = g_inet_flow_expire(table, G_MAXUINT64)));
+    g_object_get(table, "size", &size, NULL);
+    NP_ASSERT_EQUAL(size, STRIPE_TEST_FLOWS - 1);
+    for (i = 0; i < STRIPE_TEST_FLOWS; i++) {
+        NP_ASSERT(flow_index_lookup(stripe_for_hash(table, packets[i].hash),
+                                    &packets[i]) != flow);
+    }
+    g_object_unref(flow);
+    while ((flow = g_inet_flow_expire(table, G_MAXUINT64)))
+        g_object_unref(flow);
+    g_object_get(table, "size", &size, "in-use", &in_use, NULL);
+    NP_ASSERT_EQUAL(size, 0);
+    NP_ASSERT_EQUAL(in_use, 0);
+
+    /* Fragments are tracked by the stripe for their IP ID */
+    p = build_hdr_eth(test_buffer, ETH_PROTOCOL_IP);
+    p = build_hdr_ip_fragment(p, ETH_PROTOCOL_IP, IP_PROTOCOL_UDP, FALSE, TRUE, 0, 0xbeef);
+    len = (guint) (p - test_buffer);
+    NP_ASSERT_NOT_NULL((flow = g_inet_flow_get_full(table, test_buffer, len, 0, 0, TRUE,
+                                                    TRUE)));
+    p = build_hdr_eth(test_buffer, ETH_PROTOCOL_IP);
+    p = build_hdr_ip_fragment(p, ETH_PROTOCOL_IP, IP_PROTOCOL_UDP, FALSE, FALSE, 0xb9,
+                              0xbeef);
+    NP_ASSERT(flow == g_inet_flow_get_full(table, test_buffer, len, 0, 0, TRUE, TRUE));
+    for (i = 0; i < stripes; i++)
+        NP_ASSERT_NULL(table->stripes[i]->frag_info_list);
+    g_object_unref(flow);
+    g_object_unref(table);
+    g_free(packets);
+}
+
+static gpointer lock_free_lookup_thread(gpointer data)
+{
+    struct stripe_test *test = (struct stripe_test *) data;
+    GInetFlow *flow;
+
+    g_inet_flow_read_lock();
+    flow = flow_table_get(test->table, &test->packets[0], FALSE);
+    g_inet_flow_read_unlock();
+    return flow;
+}
+
+struct lock_free_test {
+    GInetFlowTable *table;
+    GInetFlow *packets;
+    gint done;
+};
+
+/* Readers check every flow they find against the packet they looked up */
+static gpointer lock_free_reader_thread(gpointer data)
+{
+    struct lock_free_test *test = (struct lock_free_test *) data;
+    gboolean ok = TRUE;
+    int i;
+
+    while (!g_atomic_int_get(&test->done)) {
+        g_inet_flow_read_lock();
+        for (i = 0; i < 256; i++) {
+            GInetFlow *packet = &test->packets[g_random_int_range(0, 256)];
+            GInetFlow *flow = swiss_lookup_shared(&stripe_for_hash(test->table,
+                                                                   packet->hash)->buckets,
+                                                  packet);
+            if (flow && !flow_compare(flow, packet))
+                ok = FALSE;
+        }
+        g_inet_flow_read_unlock();
+    }
+    return GINT_TO_POINTER(ok);
+}
+
+void test_flow_table_lock_free()
+{
+    struct lock_free_test stress = { };
+    struct stripe_test test;
+    GThread *threads[2];
+    GInetFlowTable *table;
+    GInetFlowTable *stripe;
+    GInetFlowRecord *records[256];
+    GInetFlow *packets;
+    GThread *thread;
+    gboolean lock_free;
+    guint64 free;
+    int round;
+    int i;
+
+    setup_test();
+    table = g_object_new(G_INET_TYPE_FLOW_TABLE, "engine", G_INET_FLOW_TABLE_ENGINE_SWISS,
+                         "stripes", 2, "records", TRUE, "lock-free-lookups", TRUE, NULL);
+    g_object_get(table, "lock-free-lookups", &lock_free, NULL);
+    NP_ASSERT(lock_free);
+    packets = random_flows(256, 0);
+    records[0] = (GInetFlowRecord *) flow_table_get(table, &packets[0], TRUE);
+    NP_ASSERT_NOT_NULL(records[0]);
+    stripe = stripe_for_hash(table, packets[0].hash);
+
+    /* Readers find flows while a writer holds the stripe */
+    test.table = table;
+    test.packets = packets;
+    g_mutex_lock(&stripe->lock);
+    thread = g_thread_new("reader", lock_free_lookup_thread, &test);
+    NP_ASSERT((GInetFlowRecord *) g_thread_join(thread) == records[0]);
+    g_mutex_unlock(&stripe->lock);
+    g_inet_flow_read_lock();
+    NP_ASSERT((GInetFlowRecord *) flow_table_get(table, &packets[0], FALSE) == records[0]);
+
+    /* A released record is kept from the pool while a reader may hold it */
+    g_object_get(table, "free", &free, NULL);
+    g_inet_flow_record_release(records[0]);
+    epoch_reclaim(stripe, FALSE);
+    epoch_reclaim(stripe, FALSE);
+    NP_ASSERT(flow_compare((GInetFlow *) records[0], &packets[0]));
+    check_pool(table, 0, free, 1);
+    g_inet_flow_read_unlock();
+    epoch_reclaim(stripe, FALSE);
+    check_pool(table, 0, free + 1, 1);
+
+    /* Readers run against a writer creating, releasing and resizing */
+    stress.table = table;
+    stress.packets = packets;
+    for (i = 0; i < 2; i++)
+        threads[i] = g_thread_new("reader", lock_free_reader_thread, &stress);
+    for (round = 0; round < 200; round++) {
+        for (i = 0; i < 256; i++)
+            records[i] = (GInetFlowRecord *) flow_table_get(table, &packets[i], TRUE);
+        for (i = 0; i < 256; i++)
+            g_inet_flow_record_release(records[i]);
+    }
+    g_atomic_int_set(&stress.done, 1);
+    for (i = 0; i < 2; i++)
+        NP_ASSERT(GPOINTER_TO_INT(g_thread_join(threads[i])));
+    g_object_unref(table);
+    g_free(packets);
+}
+
+void test_flow_sharded_table()
+{
+    GInetFlowShardedTable *sharded;
+    GInetFlowTable *shard;
+    GInetFlow *flow1, *flow2;
+    guint64 size, hits, misses;
+    guint shards;
+    guint8 *p;
+    guint len;
+    gint id;
+    gint i;
+
+    setup_test();
+    NP_ASSERT_NOT_NULL((sharded = g_inet_flow_sharded_table_new(4)));
+    g_object_get(sharded, "shards", &shards, NULL);
+    NP_ASSERT_EQUAL(shards, 4);
+    NP_ASSERT(g_inet_flow_sharded_table_get_shard(sharded, 0) !=
+              g_inet_flow_sharded_table_get_shard(sharded, 3));
+
+    /* Both directions go to the shard that owns the flow */
+    len = make_pkt(test_buffer, ETH_PROTOCOL_IP, IP_PROTOCOL_TCP);
+    id = g_inet_flow_sharded_table_shard_for_frame(sharded, test_buffer, len, 0, TRUE);
+    NP_ASSERT(id >= 0 && id < 4);
+    shard = g_inet_flow_sharded_table_get_shard(sharded, id);
+    flow1 = g_inet_flow_get_full(shard, test_buffer, len, 0, 0, TRUE, TRUE);
+    len = make_pkt_reverse(test_buffer, ETH_PROTOCOL_IP, IP_PROTOCOL_TCP);
+    NP_ASSERT_EQUAL(g_inet_flow_sharded_table_shard_for_frame(sharded, test_buffer, len, 0,
+                                                              TRUE), id);
+    NP_ASSERT(flow1 == g_inet_flow_get_full(shard, test_buffer, len, 0, 0, TRUE, TRUE));
+    len = make_pkt(test_buffer, 0x0806, IP_PROTOCOL_ICMP);
+    NP_ASSERT_EQUAL(g_inet_flow_sharded_table_shard_for_frame(sharded, test_buffer, len, 0,
+                                                              TRUE), -1);
+
+    /* A 32 bit RSS value from the NIC picks the shard by its top bits */
+    for (i = 0; i < 4; i++) {
+        NP_ASSERT_EQUAL(g_inet_flow_sharded_table_shard_for_frame(sharded, test_buffer, len,
+                                                                  i * 0x40000000u + 0x1234,
+                                                                  TRUE), i);
+    }
+
+    /* Later fragments follow the first to the shard holding its ports */
+    p = build_hdr_eth(test_buffer, ETH_PROTOCOL_IP);
+    p = build_hdr_ip_fragment(p, ETH_PROTOCOL_IP, IP_PROTOCOL_UDP, FALSE, TRUE, 0, 0xbeef);
+    len = (guint) (p - test_buffer);
+    id = g_inet_flow_sharded_table_shard_for_frame(sharded, test_buffer, len, 0, TRUE);
+    shard = g_inet_flow_sharded_table_get_shard(sharded, id);
+    NP_ASSERT_NOT_NULL((flow2 = g_inet_flow_get_full(shard, test_buffer, len, 0, 0, TRUE,
+                                                     TRUE)));
+    p = build_hdr_eth(test_buffer, ETH_PROTOCOL_IP);
+    p = build_hdr_ip_fragment(p, ETH_PROTOCOL_IP, IP_PROTOCOL_UDP, FALSE, FALSE, 0xb9,
+                              0xbeef);
+    NP_ASSERT_EQUAL(g_inet_flow_sharded_table_shard_for_frame(sharded, test_buffer, len, 0,
+                                                              TRUE), id);
+    NP_ASSERT(flow2 == g_inet_flow_get_full(shard, test_buffer, len, 0, 0, TRUE, TRUE));
+
+    /* Totals cover every shard */
+    g_object_get(sharded, "size", &size, "hits", &hits, "misses", &misses, NULL);
+    NP_ASSERT_EQUAL(size, 2);
+    NP_ASSERT_EQUAL(hits, 2);
+    NP_ASSERT_EQUAL(misses, 2);
+    g_object_unref(flow1);
+    g_object_unref(flow2);
+    g_object_unref(sharded);
+}